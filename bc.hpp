@@ -0,0 +1,414 @@
+#ifndef BC_H
+#define BC_H
+
+#include "image.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Block compressed formats written by the texture compressor:
+// BC1 for opaque color, BC5 for normal maps, BC7 for everything else
+enum class BcFormat { BC1, BC5, BC7 };
+
+inline size_t bcBlockBytes(BcFormat format) {
+    return format == BcFormat::BC1 ? 8 : 16;
+}
+
+inline size_t bcLevelBytes(BcFormat format, int width, int height) {
+    return size_t((width + 3) / 4) * ((height + 3) / 4) * bcBlockBytes(format);
+}
+
+// 16 RGBA8 texels of one block, row by row
+struct BcBlock {
+    unsigned char rgba[16][4];
+};
+
+// Finds the closest of count (a multiple of 4, at most 16) palette colors
+// for every texel and returns the total squared error
+inline uint32_t matchPalette(const BcBlock &block,
+                             const unsigned char (*palette)[4], int count,
+                             uint8_t indices[16]) {
+    uint32_t total = 0;
+#ifdef __SSE2__
+    // Channels are kept as (r, g) and (b, a) int16 pairs,
+    // so one madd yields the partial squared distance to 4 colors
+    __m128i rg[4], ba[4];
+    for (int j = 0; j < count / 4; ++j) {
+        alignas(16) int16_t prg[8], pba[8];
+        for (int k = 0; k < 4; ++k) {
+            auto &color = palette[4 * j + k];
+            prg[2 * k] = color[0];
+            prg[2 * k + 1] = color[1];
+            pba[2 * k] = color[2];
+            pba[2 * k + 1] = color[3];
+        }
+        rg[j] = _mm_load_si128(reinterpret_cast<const __m128i *>(prg));
+        ba[j] = _mm_load_si128(reinterpret_cast<const __m128i *>(pba));
+    }
+    for (int i = 0; i < 16; ++i) {
+        auto &px = block.rgba[i];
+        __m128i trg = _mm_set1_epi32((px[1] << 16) | px[0]);
+        __m128i tba = _mm_set1_epi32((px[3] << 16) | px[2]);
+        uint32_t best = UINT32_MAX;
+        int bestIdx = 0;
+        for (int j = 0; j < count / 4; ++j) {
+            __m128i drg = _mm_sub_epi16(rg[j], trg);
+            __m128i dba = _mm_sub_epi16(ba[j], tba);
+            __m128i dist = _mm_add_epi32(_mm_madd_epi16(drg, drg),
+                                         _mm_madd_epi16(dba, dba));
+            alignas(16) uint32_t d[4];
+            _mm_store_si128(reinterpret_cast<__m128i *>(d), dist);
+            for (int k = 0; k < 4; ++k) {
+                if (d[k] < best) {
+                    best = d[k];
+                    bestIdx = 4 * j + k;
+                }
+            }
+        }
+        indices[i] = bestIdx;
+        total += best;
+    }
+#else
+    for (int i = 0; i < 16; ++i) {
+        auto &px = block.rgba[i];
+        uint32_t best = UINT32_MAX;
+        int bestIdx = 0;
+        for (int j = 0; j < count; ++j) {
+            uint32_t dist = 0;
+            for (int c = 0; c < 4; ++c) {
+                int d = int(palette[j][c]) - px[c];
+                dist += d * d;
+            }
+            if (dist < best) {
+                best = dist;
+                bestIdx = j;
+            }
+        }
+        indices[i] = bestIdx;
+        total += best;
+    }
+#endif
+    return total;
+}
+
+// Endpoints of the principal axis through the block's colors.
+// Only the first `channels` channels take part.
+inline void fitEndpoints(const BcBlock &block, int channels, float e0[4],
+                         float e1[4]) {
+    float mean[4] = {};
+    for (auto &px : block.rgba)
+        for (int c = 0; c < channels; ++c) mean[c] += px[c] / 16.0f;
+
+    float cov[4][4] = {};
+    for (auto &px : block.rgba) {
+        for (int a = 0; a < channels; ++a)
+            for (int b = 0; b < channels; ++b)
+                cov[a][b] += (px[a] - mean[a]) * (px[b] - mean[b]);
+    }
+
+    // Power iteration, started from the longest side of the bounding box
+    float axis[4] = {};
+    for (int c = 0; c < channels; ++c) {
+        unsigned char lo = 255, hi = 0;
+        for (auto &px : block.rgba) {
+            lo = std::min(lo, px[c]);
+            hi = std::max(hi, px[c]);
+        }
+        axis[c] = float(hi - lo);
+    }
+    for (int iter = 0; iter < 4; ++iter) {
+        float next[4] = {};
+        float norm = 0.0f;
+        for (int a = 0; a < channels; ++a) {
+            for (int b = 0; b < channels; ++b) next[a] += cov[a][b] * axis[b];
+            norm = std::max(norm, std::abs(next[a]));
+        }
+        if (norm == 0.0f) break;
+        for (int c = 0; c < channels; ++c) axis[c] = next[c] / norm;
+    }
+
+    float len2 = 0.0f;
+    for (int c = 0; c < channels; ++c) len2 += axis[c] * axis[c];
+    float tMin = 0.0f, tMax = 0.0f;
+    if (len2 > 0.0f) {
+        tMin = 1e30f;
+        tMax = -1e30f;
+        for (auto &px : block.rgba) {
+            float t = 0.0f;
+            for (int c = 0; c < channels; ++c)
+                t += (px[c] - mean[c]) * axis[c];
+            tMin = std::min(tMin, t / len2);
+            tMax = std::max(tMax, t / len2);
+        }
+    }
+    for (int c = 0; c < 4; ++c) {
+        e0[c] = std::clamp(mean[c] + tMin * axis[c], 0.0f, 255.0f);
+        e1[c] = std::clamp(mean[c] + tMax * axis[c], 0.0f, 255.0f);
+    }
+}
+
+// Least squares endpoints for fixed interpolation weights in [0, 1].
+// Returns false when the weights are degenerate.
+inline bool refineEndpoints(const BcBlock &block, const float weights[16],
+                            float e0[4], float e1[4]) {
+    float a = 0.0f, b = 0.0f, c = 0.0f;
+    float x0[4] = {}, x1[4] = {};
+    for (int i = 0; i < 16; ++i) {
+        float t = weights[i];
+        a += (1 - t) * (1 - t);
+        b += t * (1 - t);
+        c += t * t;
+        for (int ch = 0; ch < 4; ++ch) {
+            x0[ch] += (1 - t) * block.rgba[i][ch];
+            x1[ch] += t * block.rgba[i][ch];
+        }
+    }
+    float det = a * c - b * b;
+    if (std::abs(det) < 1e-6f) return false;
+    for (int ch = 0; ch < 4; ++ch) {
+        e0[ch] = std::clamp((c * x0[ch] - b * x1[ch]) / det, 0.0f, 255.0f);
+        e1[ch] = std::clamp((a * x1[ch] - b * x0[ch]) / det, 0.0f, 255.0f);
+    }
+    return true;
+}
+
+inline uint16_t packRgb565(const float color[4]) {
+    int r = std::lround(color[0] * 31.0f / 255.0f);
+    int g = std::lround(color[1] * 63.0f / 255.0f);
+    int b = std::lround(color[2] * 31.0f / 255.0f);
+    return uint16_t((r << 11) | (g << 5) | b);
+}
+
+inline void unpackRgb565(uint16_t packed, unsigned char color[4]) {
+    int r = packed >> 11, g = (packed >> 5) & 63, b = packed & 31;
+    color[0] = (r << 3) | (r >> 2);
+    color[1] = (g << 2) | (g >> 4);
+    color[2] = (b << 3) | (b >> 2);
+    color[3] = 255;
+}
+
+inline uint32_t encodeBc1Endpoints(const BcBlock &block, const float e0[4],
+                                   const float e1[4], unsigned char *out) {
+    uint16_t c0 = packRgb565(e1);
+    uint16_t c1 = packRgb565(e0);
+    // Four color mode needs c0 > c1
+    if (c0 < c1) std::swap(c0, c1);
+
+    unsigned char palette[4][4];
+    unpackRgb565(c0, palette[0]);
+    unpackRgb565(c1, palette[1]);
+    for (int c = 0; c < 4; ++c) {
+        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+
+    uint8_t indices[16];
+    uint32_t error = matchPalette(block, palette, 4, indices);
+    uint32_t bits = 0;
+    if (c0 != c1) {
+        for (int i = 0; i < 16; ++i) bits |= uint32_t(indices[i]) << (2 * i);
+    }
+    std::memcpy(out, &c0, 2);
+    std::memcpy(out + 2, &c1, 2);
+    std::memcpy(out + 4, &bits, 4);
+    return error;
+}
+
+inline void encodeBc1(BcBlock block, unsigned char *out) {
+    for (auto &px : block.rgba) px[3] = 255;
+    float e0[4], e1[4];
+    fitEndpoints(block, 3, e0, e1);
+    uint32_t error = encodeBc1Endpoints(block, e0, e1, out);
+
+    // One least squares pass over the chosen indices
+    static const float CODE_WEIGHTS[4] = {0.0f, 1.0f, 1.0f / 3, 2.0f / 3};
+    uint16_t c0, c1;
+    uint32_t bits;
+    std::memcpy(&c0, out, 2);
+    std::memcpy(&c1, out + 2, 2);
+    std::memcpy(&bits, out + 4, 4);
+    float weights[16];
+    for (int i = 0; i < 16; ++i) weights[i] = CODE_WEIGHTS[(bits >> 2 * i) & 3];
+    unsigned char p0[4], p1[4];
+    unpackRgb565(c0, p0);
+    unpackRgb565(c1, p1);
+    float r0[4], r1[4];
+    if (!refineEndpoints(block, weights, r0, r1)) return;
+
+    // Weights are relative to c0 here, the first call's were to e0 = min
+    unsigned char candidate[8];
+    if (encodeBc1Endpoints(block, r1, r0, candidate) < error)
+        std::memcpy(out, candidate, 8);
+}
+
+inline void encodeBc4(const BcBlock &block, int channel, unsigned char *out) {
+    unsigned char lo = 255, hi = 0;
+    for (auto &px : block.rgba) {
+        lo = std::min(lo, px[channel]);
+        hi = std::max(hi, px[channel]);
+    }
+    out[0] = hi;
+    out[1] = lo;
+
+    // Eight value mode, since out[0] > out[1] whenever they differ
+    int palette[8] = {hi, lo};
+    for (int k = 2; k < 8; ++k) palette[k] = ((8 - k) * hi + (k - 1) * lo) / 7;
+
+    uint64_t bits = 0;
+    if (hi != lo) {
+        for (int i = 0; i < 16; ++i) {
+            int value = block.rgba[i][channel];
+            int best = 0;
+            for (int k = 1; k < 8; ++k) {
+                if (std::abs(palette[k] - value)
+                    < std::abs(palette[best] - value))
+                    best = k;
+            }
+            bits |= uint64_t(best) << (3 * i);
+        }
+    }
+    for (int i = 0; i < 6; ++i) out[2 + i] = (bits >> (8 * i)) & 0xff;
+}
+
+inline void encodeBc5(const BcBlock &block, unsigned char *out) {
+    encodeBc4(block, 0, out);
+    encodeBc4(block, 1, out + 8);
+}
+
+// Appends bits to a 128-bit block, least significant first
+struct BlockBitWriter {
+    unsigned char *out;
+    int pos = 0;
+
+    void put(uint32_t value, int count) {
+        for (int i = 0; i < count; ++i, ++pos) {
+            if ((value >> i) & 1) out[pos / 8] |= 1 << (pos % 8);
+        }
+    }
+};
+
+constexpr int BC7_WEIGHTS4[16] = {0,  4,  9,  13, 17, 21, 26, 30,
+                                  34, 38, 43, 47, 51, 55, 60, 64};
+
+// Quantizes an endpoint to 7 bits per channel plus a shared p-bit
+inline void quantizeBc7Endpoint(const float color[4], int q[4], int &pbit) {
+    float bestError = 1e30f;
+    for (int p = 0; p < 2; ++p) {
+        int cand[4];
+        float error = 0.0f;
+        for (int c = 0; c < 4; ++c) {
+            cand[c] = std::clamp<int>(std::lround((color[c] - p) / 2.0f), 0,
+                                      127);
+            float d = (cand[c] * 2 + p) - color[c];
+            error += d * d;
+        }
+        if (error < bestError) {
+            bestError = error;
+            std::copy(cand, cand + 4, q);
+            pbit = p;
+        }
+    }
+}
+
+struct Bc7Mode6 {
+    int q[2][4];
+    int pbit[2];
+    uint8_t indices[16];
+    uint32_t error;
+};
+
+inline Bc7Mode6 encodeBc7Endpoints(const BcBlock &block, const float e0[4],
+                                   const float e1[4]) {
+    Bc7Mode6 res;
+    quantizeBc7Endpoint(e0, res.q[0], res.pbit[0]);
+    quantizeBc7Endpoint(e1, res.q[1], res.pbit[1]);
+
+    unsigned char palette[16][4];
+    for (int k = 0; k < 16; ++k) {
+        for (int c = 0; c < 4; ++c) {
+            int v0 = res.q[0][c] * 2 + res.pbit[0];
+            int v1 = res.q[1][c] * 2 + res.pbit[1];
+            palette[k][c]
+                = ((64 - BC7_WEIGHTS4[k]) * v0 + BC7_WEIGHTS4[k] * v1 + 32)
+                  >> 6;
+        }
+    }
+    res.error = matchPalette(block, palette, 16, res.indices);
+    return res;
+}
+
+// Mode 6 only: one subset, RGBA endpoints and 4-bit indices
+inline void encodeBc7(const BcBlock &block, unsigned char *out) {
+    float e0[4], e1[4];
+    fitEndpoints(block, 4, e0, e1);
+    Bc7Mode6 best = encodeBc7Endpoints(block, e0, e1);
+
+    for (int iter = 0; iter < 2 && best.error > 0; ++iter) {
+        float weights[16];
+        for (int i = 0; i < 16; ++i)
+            weights[i] = BC7_WEIGHTS4[best.indices[i]] / 64.0f;
+        if (!refineEndpoints(block, weights, e0, e1)) break;
+        Bc7Mode6 candidate = encodeBc7Endpoints(block, e0, e1);
+        if (candidate.error >= best.error) break;
+        best = candidate;
+    }
+
+    // The anchor index is stored without its top bit
+    if (best.indices[0] >= 8) {
+        std::swap(best.q[0], best.q[1]);
+        std::swap(best.pbit[0], best.pbit[1]);
+        for (auto &idx : best.indices) idx = 15 - idx;
+    }
+
+    std::memset(out, 0, 16);
+    BlockBitWriter bits{out};
+    bits.put(1 << 6, 7);
+    for (int c = 0; c < 4; ++c) {
+        bits.put(best.q[0][c], 7);
+        bits.put(best.q[1][c], 7);
+    }
+    bits.put(best.pbit[0], 1);
+    bits.put(best.pbit[1], 1);
+    bits.put(best.indices[0], 3);
+    for (int i = 1; i < 16; ++i) bits.put(best.indices[i], 4);
+}
+
+// Compresses one RGBA8 level, block rows spread over all cores
+inline std::vector<unsigned char> compressLevel(BcFormat format,
+                                                const MipLevel &level) {
+    int blocksX = (level.width + 3) / 4;
+    int blocksY = (level.height + 3) / 4;
+    size_t blockBytes = bcBlockBytes(format);
+    std::vector<unsigned char> out(size_t(blocksX) * blocksY * blockBytes);
+
+    parallelFor(blocksY, [&](size_t by) {
+        for (int bx = 0; bx < blocksX; ++bx) {
+            BcBlock block;
+            for (int i = 0; i < 16; ++i) {
+                // Partial edge blocks repeat their last row and column
+                int x = std::min(4 * bx + i % 4, level.width - 1);
+                int y = std::min(int(4 * by) + i / 4, level.height - 1);
+                std::memcpy(block.rgba[i],
+                            level.data + 4 * (size_t(y) * level.width + x), 4);
+            }
+            unsigned char *dst
+                = out.data() + (by * blocksX + bx) * blockBytes;
+            switch (format) {
+            case BcFormat::BC1: encodeBc1(block, dst); break;
+            case BcFormat::BC5: encodeBc5(block, dst); break;
+            case BcFormat::BC7: encodeBc7(block, dst); break;
+            }
+        }
+    });
+    return out;
+}
+
+#endif
@@ -0,0 +1,141 @@
+#include "bvh.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <glm/ext/matrix_clip_space.hpp>
+#include <glm/ext/matrix_transform.hpp>
+
+// Board and pieces of one chess set, in units of a square, with the
+// board's top at y = 0 and its corner at the origin
+static std::vector<GeometryBox> chessSet() {
+    std::vector<GeometryBox> set = {{{0.0f, -0.25f, 0.0f}, {8.0f, 0.0f, 8.0f}}};
+    // Rook, knight, bishop, queen, king, bishop, knight, rook
+    const float backHeights[8] = {0.8f, 0.9f, 1.0f, 1.2f, 1.3f, 1.0f, 0.9f,
+                                  0.8f};
+    for (int rank : {0, 1, 6, 7}) {
+        for (int file = 0; file < 8; ++file) {
+            bool pawn = rank == 1 || rank == 6;
+            float height = pawn ? 0.6f : backHeights[file];
+            float radius = pawn ? 0.3f : 0.38f;
+            glm::vec3 center(file + 0.5f, 0.0f, rank + 0.5f);
+            set.push_back({center - glm::vec3(radius, 0.0f, radius),
+                           center + glm::vec3(radius, height, radius)});
+        }
+    }
+    return set;
+}
+
+static double microsSince(std::chrono::steady_clock::time_point start) {
+    std::chrono::duration<double, std::micro> dt
+        = std::chrono::steady_clock::now() - start;
+    return dt.count();
+}
+
+// Replicates a chess set over a square grid of boards, one box per node
+// like the scene's instances, and times BVH queries against linear scans
+// over the same boxes from random cameras walking over the grid
+int main(int argc, char **argv) {
+    int side = argc > 1 ? std::atoi(argv[1]) : 18;
+    int queries = argc > 2 ? std::atoi(argv[2]) : 1000;
+    auto set = chessSet();
+    std::vector<GeometryBox> local;
+    std::vector<glm::mat4> worlds;
+    for (int z = 0; z < side; ++z) {
+        for (int x = 0; x < side; ++x) {
+            glm::vec3 offset(10.0f * x, 0.0f, 10.0f * z);
+            for (auto &box : set) {
+                local.push_back(box);
+                worlds.push_back(glm::translate(glm::mat4(1.0f), offset));
+            }
+        }
+    }
+    BoxSet boxes;
+    boxes.resize(local.size());
+    for (size_t i = 0; i < local.size(); ++i)
+        boxes.set(i, worlds[i], local[i]);
+
+    using Clock = std::chrono::steady_clock;
+    Bvh bvh;
+    auto start = Clock::now();
+    bvh.build(boxes);
+    double buildMicros = microsSince(start);
+    std::cout << boxes.size() << " nodes, " << bvh.nodes.size()
+              << " BVH nodes built in " << buildMicros / 1000.0 << " ms\n";
+
+    // One board's pieces move, then every node does
+    std::vector<std::pair<uint32_t, uint32_t>> moved = {
+        {1, uint32_t(set.size())}};
+    glm::mat4 lift = glm::translate(glm::mat4(1.0f), {0.0f, 0.5f, 0.0f});
+    for (uint32_t i = 1; i < set.size(); ++i)
+        boxes.set(i, lift * worlds[i], local[i]);
+    start = Clock::now();
+    bvh.refit(boxes, moved);
+    double partialMicros = microsSince(start);
+    start = Clock::now();
+    bvh.refit(boxes, {{0, uint32_t(boxes.size())}});
+    double fullMicros = microsSince(start);
+    std::cout << "Refit " << partialMicros << " us for one board, "
+              << fullMicros << " us for all\n";
+
+    std::default_random_engine rng;
+    float extent = 10.0f * side;
+    std::uniform_real_distribution<float> ground(0.0f, extent);
+    std::uniform_real_distribution<float> height(1.0f, 8.0f);
+    glm::mat4 matProj
+        = glm::perspective(glm::radians(45.0f), 16.0f / 9.0f, 100.0f, 0.001f);
+    std::vector<uint32_t> linear(boxes.size()), found;
+    double linearFrustum = 0.0, bvhFrustum = 0.0;
+    double linearRay = 0.0, bvhRay = 0.0;
+    size_t visible = 0, hits = 0, mismatches = 0;
+    for (int q = 0; q < queries; ++q) {
+        glm::vec3 eye(ground(rng), height(rng), ground(rng));
+        glm::vec3 target(ground(rng), 0.0f, ground(rng));
+        glm::mat4 matView = glm::lookAt(eye, target, {0.0f, 1.0f, 0.0f});
+        Frustum frustum(matProj * matView);
+
+        start = Clock::now();
+        size_t count = cullBoxes(boxes, frustum, linear.data());
+        linearFrustum += microsSince(start);
+        start = Clock::now();
+        bvh.queryFrustum(boxes, frustum, found);
+        bvhFrustum += microsSince(start);
+        visible += count;
+        if (found.size() != count
+            || !std::equal(found.begin(), found.end(), linear.begin()))
+            ++mismatches;
+
+        glm::vec3 dir = target - eye;
+        glm::vec3 invDir = 1.0f / dir;
+        start = Clock::now();
+        BvhHit nearest;
+        for (uint32_t i = 0; i < boxes.size(); ++i) {
+            glm::vec3 lo(boxes.minX[i], boxes.minY[i], boxes.minZ[i]);
+            glm::vec3 hi(boxes.maxX[i], boxes.maxY[i], boxes.maxZ[i]);
+            float t;
+            if (rayEntersBox(eye, invDir, lo, hi, nearest.t, t)
+                && t < nearest.t)
+                nearest = {i, t};
+        }
+        linearRay += microsSince(start);
+        start = Clock::now();
+        BvhHit hit = bvh.queryRay(boxes, eye, dir);
+        bvhRay += microsSince(start);
+        hits += hit.item != UINT32_MAX;
+        if (hit.item != nearest.item && hit.t != nearest.t) ++mismatches;
+    }
+
+    std::cout << "Frustum: " << double(visible) / queries << " of "
+              << boxes.size() << " visible, linear "
+              << linearFrustum / queries << " us, BVH "
+              << bvhFrustum / queries << " us\n"
+              << "Ray: " << hits << " of " << queries << " hit, linear "
+              << linearRay / queries << " us, BVH " << bvhRay / queries
+              << " us\n"
+              << mismatches << " queries disagreed\n";
+    return mismatches == 0 ? 0 : 1;
+}
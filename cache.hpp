@@ -0,0 +1,249 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HW03_HAS_MMAP 1
+#endif
+
+// Read-only view of a whole file.
+// Pages are mapped where mmap is available and read into memory otherwise.
+struct MappedFile {
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    MappedFile() = default;
+    ~MappedFile() { clear(); }
+
+    MappedFile(MappedFile &&rhs) { *this = std::move(rhs); }
+    MappedFile &operator=(MappedFile &&rhs) {
+        clear();
+        ptr = rhs.ptr;
+        len = rhs.len;
+        mapped = rhs.mapped;
+        fallback = std::move(rhs.fallback);
+        rhs.ptr = nullptr;
+        rhs.len = 0;
+        rhs.mapped = false;
+        return *this;
+    }
+
+    bool open(const std::string &path) {
+        clear();
+#ifdef HW03_HAS_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st {};
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        len = static_cast<size_t>(st.st_size);
+        if (len > 0) {
+            void *addr = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED) {
+                ::close(fd);
+                len = 0;
+                return false;
+            }
+            madvise(addr, len, MADV_WILLNEED);
+            ptr = static_cast<const unsigned char *>(addr);
+            mapped = true;
+        }
+        ::close(fd);
+        return true;
+#else
+        std::ifstream ifs(path, std::ios::binary);
+        if (!ifs) return false;
+        fallback.assign(std::istreambuf_iterator<char>(ifs), {});
+        ptr = fallback.data();
+        len = fallback.size();
+        return true;
+#endif
+    }
+
+    const unsigned char *data() const noexcept { return ptr; }
+    size_t size() const noexcept { return len; }
+    bool isMapped() const noexcept { return mapped; }
+
+  private:
+    const unsigned char *ptr = nullptr;
+    size_t len = 0;
+    bool mapped = false;
+    std::vector<unsigned char> fallback;
+
+    void clear() {
+#ifdef HW03_HAS_MMAP
+        if (mapped) munmap(const_cast<unsigned char *>(ptr), len);
+#endif
+        fallback.clear();
+        ptr = nullptr;
+        len = 0;
+        mapped = false;
+    }
+};
+
+// Bytes read in place, for example from a MappedFile
+struct BufferSpan {
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+    // Points into a read-only file mapping, see releasePages()
+    bool mapped = false;
+};
+
+// Drops the pages under [offset, offset + size) of a mapped span from the
+// resident set. They are clean, so reading them again just faults them
+// back in from the file. Does nothing for other spans.
+inline void releasePages(const BufferSpan &span, size_t offset, size_t size) {
+#ifdef HW03_HAS_MMAP
+    if (!span.mapped || offset >= span.size) return;
+    size = std::min(size, span.size - offset);
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    auto begin = reinterpret_cast<uintptr_t>(span.data + offset);
+    uintptr_t end = (begin + size + page - 1) / page * page;
+    begin = begin / page * page;
+    madvise(reinterpret_cast<void *>(begin), end - begin, MADV_DONTNEED);
+#endif
+}
+
+// FNV-1a, good enough to notice edited assets
+inline uint64_t hashBytes(const void *data, size_t size,
+                          uint64_t hash = 0xcbf29ce484222325ull) {
+    auto bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+inline bool hashFile(const std::string &path, uint64_t &hash) {
+    MappedFile file;
+    if (!file.open(path)) return false;
+    hash = hashBytes(file.data(), file.size());
+    return true;
+}
+
+struct FileStamp {
+    uint64_t size = 0;
+    int64_t mtime = 0;
+};
+
+inline bool statFile(const std::string &path, FileStamp &stamp) {
+    std::error_code ec;
+    auto size = std::filesystem::file_size(path, ec);
+    if (ec) return false;
+    auto mtime = std::filesystem::last_write_time(path, ec);
+    if (ec) return false;
+    stamp.size = size;
+    stamp.mtime = mtime.time_since_epoch().count();
+    return true;
+}
+
+struct BinaryWriter {
+    std::vector<unsigned char> bytes;
+
+    template <typename T> void put(const T &value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        putBytes(&value, sizeof(T));
+    }
+
+    template <typename T> void putVector(const std::vector<T> &values) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        put<uint64_t>(values.size());
+        putBytes(values.data(), values.size() * sizeof(T));
+    }
+
+    void putString(const std::string &str) {
+        put<uint64_t>(str.size());
+        putBytes(str.data(), str.size());
+    }
+
+    void putBytes(const void *data, size_t size) {
+        auto begin = static_cast<const unsigned char *>(data);
+        bytes.insert(bytes.end(), begin, begin + size);
+    }
+
+    void align(size_t alignment) {
+        bytes.resize((bytes.size() + alignment - 1) / alignment * alignment, 0);
+    }
+};
+
+struct BinaryReader {
+    BinaryReader(const unsigned char *begin, size_t size)
+        : ptr(begin), end(begin + size) {}
+
+    template <typename T> T get() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        T value;
+        std::memcpy(&value, take(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    template <typename T> std::vector<T> getVector() {
+        static_assert(std::is_trivially_copyable_v<T>);
+        size_t size = get<uint64_t>();
+        if (size > static_cast<size_t>(end - ptr) / sizeof(T))
+            throw std::runtime_error("Truncated cache file");
+        std::vector<T> values(size);
+        std::memcpy(values.data(), take(size * sizeof(T)), size * sizeof(T));
+        return values;
+    }
+
+    std::string getString() {
+        size_t size = get<uint64_t>();
+        auto data = reinterpret_cast<const char *>(take(size));
+        return std::string(data, data + size);
+    }
+
+  private:
+    const unsigned char *ptr;
+    const unsigned char *end;
+
+    const unsigned char *take(size_t size) {
+        if (size > static_cast<size_t>(end - ptr))
+            throw std::runtime_error("Truncated cache file");
+        auto res = ptr;
+        ptr += size;
+        return res;
+    }
+};
+
+// Writes through a temporary file, so a crash never leaves a torn cache.
+// A failed write removes the temporary file before it throws.
+inline void writeFileAtomically(const std::string &path,
+                                const std::vector<unsigned char> &head,
+                                const std::vector<unsigned char> &tail) {
+    std::string tmpPath = path + ".tmp";
+    try {
+        {
+            std::ofstream ofs(tmpPath, std::ios::binary | std::ios::trunc);
+            ofs.write(reinterpret_cast<const char *>(head.data()),
+                      head.size());
+            ofs.write(reinterpret_cast<const char *>(tail.data()),
+                      tail.size());
+            if (!ofs) throw std::runtime_error("Could not write " + tmpPath);
+        }
+        std::filesystem::rename(tmpPath, path);
+    } catch (...) {
+        std::error_code ec;
+        std::filesystem::remove(tmpPath, ec);
+        throw;
+    }
+}
+
+#endif
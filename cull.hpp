@@ -0,0 +1,159 @@
+#ifndef CULL_H
+#define CULL_H
+
+#include "geometry.hpp"
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// World space boxes, one array per bound, so that one load fetches a
+// coordinate of a whole batch of boxes
+struct BoxSet {
+    std::vector<float> minX, minY, minZ;
+    std::vector<float> maxX, maxY, maxZ;
+
+    size_t size() const noexcept { return minX.size(); }
+
+    void resize(size_t count) {
+        for (auto *bound : {&minX, &minY, &minZ, &maxX, &maxY, &maxZ})
+            bound->resize(count);
+    }
+
+    // Box i becomes the smallest one around box under mat. Empty boxes
+    // shrink to the mesh origin, their draws show nothing anyway.
+    void set(size_t i, const glm::mat4 &mat, const GeometryBox &box) {
+        bool empty = !(box.lo.x <= box.hi.x && box.lo.y <= box.hi.y
+                       && box.lo.z <= box.hi.z);
+        glm::vec3 center = empty ? glm::vec3(0.0f) : 0.5f * (box.lo + box.hi);
+        glm::vec3 extent = empty ? glm::vec3(0.0f) : 0.5f * (box.hi - box.lo);
+        glm::vec3 c = mat * glm::vec4(center, 1.0f);
+        glm::vec3 e = glm::abs(glm::vec3(mat[0])) * extent.x
+                      + glm::abs(glm::vec3(mat[1])) * extent.y
+                      + glm::abs(glm::vec3(mat[2])) * extent.z;
+        minX[i] = c.x - e.x, minY[i] = c.y - e.y, minZ[i] = c.z - e.z;
+        maxX[i] = c.x + e.x, maxY[i] = c.y + e.y, maxZ[i] = c.z + e.z;
+    }
+};
+
+// Clip volume of a view projection matrix. A point p is inside plane i
+// when dot(planes[i], vec4(p, 1)) >= 0.
+struct Frustum {
+    glm::vec4 planes[6];
+
+    explicit Frustum(const glm::mat4 &viewProj) {
+        glm::mat4 clip = glm::transpose(viewProj);
+        for (int i = 0; i < 3; ++i) {
+            planes[2 * i] = clip[3] + clip[i];
+            planes[2 * i + 1] = clip[3] - clip[i];
+        }
+    }
+};
+
+// Per frame, for the UI
+struct CullStats {
+    size_t tested = 0;
+    size_t visible = 0;
+    double millis = 0.0;
+};
+
+// Writes the indices of the boxes not wholly outside one of the planes to
+// visible, in order, and returns how many there are. A box is outside a
+// plane when its corner furthest along the normal is, and that corner
+// takes its coordinates from the same bound arrays for every box, so a
+// batch of boxes tests a plane with three multiply-adds.
+inline size_t cullBoxes(const BoxSet &boxes, const Frustum &frustum,
+                        uint32_t *visible) {
+    const float *xs[6], *ys[6], *zs[6];
+    for (int p = 0; p < 6; ++p) {
+        auto &plane = frustum.planes[p];
+        xs[p] = (plane.x >= 0.0f ? boxes.maxX : boxes.minX).data();
+        ys[p] = (plane.y >= 0.0f ? boxes.maxY : boxes.minY).data();
+        zs[p] = (plane.z >= 0.0f ? boxes.maxZ : boxes.minZ).data();
+    }
+
+    size_t count = boxes.size();
+    size_t found = 0;
+    size_t i = 0;
+#if defined(__AVX__)
+    __m256 px[6], py[6], pz[6], pw[6];
+    for (int p = 0; p < 6; ++p) {
+        auto &plane = frustum.planes[p];
+        px[p] = _mm256_set1_ps(plane.x);
+        py[p] = _mm256_set1_ps(plane.y);
+        pz[p] = _mm256_set1_ps(plane.z);
+        pw[p] = _mm256_set1_ps(plane.w);
+    }
+    const __m256 zero = _mm256_setzero_ps();
+    for (; i + 8 <= count; i += 8) {
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (int p = 0; p < 6; ++p) {
+            __m256 x = _mm256_loadu_ps(xs[p] + i);
+            __m256 y = _mm256_loadu_ps(ys[p] + i);
+            __m256 z = _mm256_loadu_ps(zs[p] + i);
+            __m256 d = _mm256_mul_ps(px[p], x);
+            d = _mm256_add_ps(d, _mm256_mul_ps(py[p], y));
+            d = _mm256_add_ps(d, _mm256_mul_ps(pz[p], z));
+            d = _mm256_add_ps(d, pw[p]);
+            __m256 ge = _mm256_cmp_ps(d, zero, _CMP_GE_OQ);
+            inside = _mm256_and_ps(inside, ge);
+        }
+        int mask = _mm256_movemask_ps(inside);
+        for (int k = 0; k < 8; ++k) {
+            visible[found] = i + k;
+            found += mask >> k & 1;
+        }
+    }
+#elif defined(__SSE2__)
+    __m128 px[6], py[6], pz[6], pw[6];
+    for (int p = 0; p < 6; ++p) {
+        auto &plane = frustum.planes[p];
+        px[p] = _mm_set1_ps(plane.x);
+        py[p] = _mm_set1_ps(plane.y);
+        pz[p] = _mm_set1_ps(plane.z);
+        pw[p] = _mm_set1_ps(plane.w);
+    }
+    const __m128 zero = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4) {
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (int p = 0; p < 6; ++p) {
+            __m128 d = _mm_mul_ps(px[p], _mm_loadu_ps(xs[p] + i));
+            d = _mm_add_ps(d, _mm_mul_ps(py[p], _mm_loadu_ps(ys[p] + i)));
+            d = _mm_add_ps(d, _mm_mul_ps(pz[p], _mm_loadu_ps(zs[p] + i)));
+            d = _mm_add_ps(d, pw[p]);
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(d, zero));
+        }
+        int mask = _mm_movemask_ps(inside);
+        for (int k = 0; k < 4; ++k) {
+            visible[found] = i + k;
+            found += mask >> k & 1;
+        }
+    }
+#endif
+    for (; i < count; ++i) {
+        bool inside = true;
+        for (int p = 0; p < 6; ++p) {
+            auto &plane = frustum.planes[p];
+            inside = inside
+                     && plane.x * xs[p][i] + plane.y * ys[p][i]
+                                + plane.z * zs[p][i] + plane.w
+                            >= 0.0f;
+        }
+        visible[found] = i;
+        found += inside;
+    }
+    return found;
+}
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef DRAWLIST_H
+#define DRAWLIST_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include <glm/mat4x4.hpp>
+
+// One primitive of one node, with the state it needs folded into a key
+// that orders the packets for submission. With instancing, the packet
+// covers every node drawing the primitive at the same LOD: instanceCount
+// of them from firstInstance on in the frame's instance list, nodeId
+// being the nearest.
+struct DrawPacket {
+    uint64_t key;
+    uint32_t nodeId;
+    uint32_t primId;
+    uint32_t firstInstance = 0;
+    uint32_t instanceCount = 1;
+};
+
+// Vertex attributes of an instance, which the G-buffer shaders take
+// instead of the uniforms in instanced draws
+struct InstanceMatrices {
+    glm::mat4 model;
+    glm::mat4 normal;
+};
+
+// Textured primitives first, as untextured ones need the other shader
+// variant, then by material, then front to back within a material.
+// There is a single vertex array, so it takes no bits.
+inline uint64_t drawSortKey(bool textured, uint32_t materialId,
+                            float depth) {
+    // Non-negative floats order like their bit patterns
+    depth = std::max(depth, 0.0f);
+    uint32_t depthBits;
+    std::memcpy(&depthBits, &depth, sizeof(depthBits));
+    return uint64_t(!textured) << 63 | uint64_t(materialId & INT32_MAX) << 32
+           | depthBits;
+}
+
+inline bool drawKeyTextured(uint64_t key) { return key >> 63 == 0; }
+
+inline uint32_t drawKeyMaterial(uint64_t key) {
+    return key >> 32 & INT32_MAX;
+}
+
+// LSD radix sort on the keys, a byte per pass, with all histograms
+// counted in one go. Bytes all packets share, like the high material
+// bytes mostly, skip their pass.
+inline void sortDrawPackets(std::vector<DrawPacket> &packets,
+                            std::vector<DrawPacket> &scratch) {
+    constexpr int PASSES = sizeof(uint64_t);
+    static thread_local size_t counts[PASSES][256];
+    std::memset(counts, 0, sizeof(counts));
+    for (auto &packet : packets)
+        for (int pass = 0; pass < PASSES; ++pass)
+            ++counts[pass][packet.key >> 8 * pass & 0xff];
+
+    scratch.resize(packets.size());
+    for (int pass = 0; pass < PASSES; ++pass) {
+        auto &count = counts[pass];
+        if (packets.empty()
+            || count[packets[0].key >> 8 * pass & 0xff] == packets.size())
+            continue;
+        size_t offset = 0;
+        for (auto &bucket : count) offset += std::exchange(bucket, offset);
+        for (auto &packet : packets)
+            scratch[count[packet.key >> 8 * pass & 0xff]++] = packet;
+        packets.swap(scratch);
+    }
+}
+
+// Per frame, to compare the submission paths. Changes count the uniform
+// and texture updates between draws.
+struct SubmitStats {
+    size_t draws = 0;
+    // Of the draws, those of several instances, and their instances
+    size_t instancedDraws = 0;
+    size_t instances = 0;
+    size_t variantChanges = 0;
+    size_t materialChanges = 0;
+    size_t transformChanges = 0;
+    double cpuMillis = 0.0;
+};
+
+#endif
@@ -1,19 +1,57 @@
-#version 330 core
-
-uniform bool isTextured;
-uniform vec4 colorFactor;
+#version 430 core
+#extension GL_ARB_bindless_texture : enable
 
 layout (location = 0) out vec4 gBaseColor;
 layout (location = 1) out vec4 gNormal;
 
 in vec3 normal;
 in vec2 texCoord0;
+flat in int drawTextured;
+flat in vec4 drawColorFactor;
+flat in int drawMaterialId;
+
+// As TexturePath and GpuMaterial in material.hpp
+const int TEXTURE_PATH_ARRAYS = 1;
+const int TEXTURE_PATH_BINDLESS = 2;
+const int MAX_TEXTURE_ARRAYS = 8;
+
+struct Material {
+    uvec2 handle;
+    int array;
+    int layer;
+};
+
+layout (std430, binding = 0) readonly buffer Materials {
+    Material materials[];
+};
 
+uniform int texturePath;
+
+// Unit 0, bound per draw
 uniform sampler2D tex;
+// Units 1 to MAX_TEXTURE_ARRAYS, bound per pass
+uniform sampler2DArray textureArrays[MAX_TEXTURE_ARRAYS];
+
+vec3 sampleBaseColor() {
+    if (texturePath == TEXTURE_PATH_ARRAYS) {
+        Material material = materials[drawMaterialId];
+        if (material.array >= 0)
+            return texture(textureArrays[material.array],
+                           vec3(texCoord0, material.layer))
+                .xyz;
+    }
+#ifdef GL_ARB_bindless_texture
+    if (texturePath == TEXTURE_PATH_BINDLESS)
+        return texture(sampler2D(materials[drawMaterialId].handle),
+                       texCoord0)
+            .xyz;
+#endif
+    return texture(tex, texCoord0).xyz;
+}
 
 void main() {
-    vec3 baseColor = isTextured ? texture(tex, texCoord0).xyz : vec3(1);
-    baseColor *= colorFactor.xyz;
+    vec3 baseColor = drawTextured != 0 ? sampleBaseColor() : vec3(1);
+    baseColor *= drawColorFactor.xyz;
     gBaseColor = vec4(baseColor, 1);
     gNormal = vec4(0.5 * normal + 0.5, 0);
 }
@@ -1,32 +1,117 @@
-#version 330 core
+#version 430 core
 
-uniform mat4 matModel;
 uniform mat4 matView;
 uniform mat4 matProj;
 
-// To not calculate it in the shader
-uniform mat4 matNormal;
-
 uniform float morphProgress;
 
+// Quantized vertices: positions are unorm within the mesh's bounds,
+// normals are octahedral. False for float vertices.
+uniform bool octahedralNormals;
+
 layout (location = 0) in vec3 inPosition;
 layout (location = 1) in vec3 inNormal;
 layout (location = 2) in vec2 inTexCoord0;
 
+#ifdef GPU_DRIVEN
+// As GpuInstance in indirect.hpp
+struct Instance {
+    vec4 lo;
+    vec4 hi;
+    vec4 colorFactor;
+    uint node;
+    uint mesh;
+    int material;
+    uint textured;
+    uint count;
+    uint firstIndex;
+    int baseVertex;
+    uint padding;
+};
+
+layout (std430, binding = 1) readonly buffer Instances {
+    Instance instances[];
+};
+layout (std430, binding = 2) readonly buffer Worlds {
+    mat4 worlds[];
+};
+// Written by cull.comp for the visible instances
+layout (std430, binding = 4) readonly buffer Normals {
+    mat4 normals[];
+};
+layout (std430, binding = 5) readonly buffer Dequantizations {
+    mat4 dequantizations[];
+};
+
+// Above every node, whose world matrix is relative to it
+uniform mat4 matModel;
+
+// The draw's baseInstance, as GL 4.3 has no gl_DrawID
+layout (location = 3) in uint instanceId;
+#else
+uniform mat4 matModel;
+// To not calculate it in the shader
+uniform mat4 matNormal;
+// Identity for float vertices
+uniform mat4 matDequant;
+
+// Instanced draws take the matrices per instance instead, as
+// InstanceMatrices in drawlist.hpp
+uniform bool instanced;
+layout (location = 4) in mat4 instanceModel;
+layout (location = 8) in mat4 instanceNormal;
+
+uniform bool isTextured;
+uniform vec4 colorFactor;
+uniform int materialId;
+#endif
+
 out vec3 normal;
 out vec2 texCoord0;
+// Per draw, for gbuf.frag
+flat out int drawTextured;
+flat out vec4 drawColorFactor;
+flat out int drawMaterialId;
+
+vec3 octahedralDecode(vec2 e) {
+    vec3 v = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-v.z, 0.0);
+    v.xy += mix(vec2(t), vec2(-t), greaterThanEqual(v.xy, vec2(0.0)));
+    return normalize(v);
+}
 
 void main() {
-    vec3 nextPos = normalize(inPosition);
+#ifdef GPU_DRIVEN
+    Instance instance = instances[instanceId];
+    mat4 model = matModel * worlds[instance.node];
+    mat4 normalMatrix = normals[instanceId];
+    mat4 dequant = dequantizations[instance.mesh];
+    drawTextured = int(instance.textured);
+    drawColorFactor = instance.colorFactor;
+    drawMaterialId = instance.material;
+#else
+    mat4 model = instanced ? instanceModel : matModel;
+    mat4 normalMatrix = instanced ? instanceNormal : matNormal;
+    mat4 dequant = matDequant;
+    drawTextured = int(isTextured);
+    drawColorFactor = colorFactor;
+    drawMaterialId = materialId;
+#endif
+
+    vec3 position = (dequant * vec4(inPosition, 1)).xyz;
+    vec3 meshNormal = octahedralNormals ? octahedralDecode(inNormal.xy)
+                                        : inNormal;
+
+    vec3 nextPos = normalize(position);
     vec3 nextNormal = nextPos; // morphing to a sphere
     nextPos *= 0.05;
 
-    vec3 pos = mix(inPosition, nextPos, morphProgress);
-    vec4 vp = matView * matModel * vec4(pos, 1);
+    vec3 pos = mix(position, nextPos, morphProgress);
+    vec4 vp = matView * model * vec4(pos, 1);
     gl_Position = matProj * vp;
 
-    vec3 immNormal = mix(inNormal, nextNormal, morphProgress);
-    normal = (matNormal * vec4(immNormal, 0)).xyz;
+    vec3 immNormal = mix(meshNormal, nextNormal, morphProgress);
+    normal = (normalMatrix * vec4(immNormal, 0)).xyz;
 
     texCoord0 = inTexCoord0;
 }
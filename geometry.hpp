@@ -0,0 +1,355 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#include "cache.hpp"
+#include "routine.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glm/common.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+
+#include <tiny_gltf.h>
+
+// Layout of the shared vertex buffer, matching gbuf.vert's attributes
+struct Vertex {
+    glm::vec3 position;
+    glm::vec3 normal;
+    glm::vec2 texCoord;
+};
+
+// Compact layout written by quantizeGeometry: 16-bit unorm positions
+// within the mesh's bounds, octahedral normals in 16-bit snorm and half
+// float texture coordinates. Position w is padding that keeps the other
+// attributes 4-byte aligned.
+struct QuantizedVertex {
+    uint16_t position[4];
+    int16_t normal[2];
+    uint16_t texCoord[2];
+};
+
+// Where a primitive lives in the shared buffers
+struct GeometryDraw {
+    uint32_t firstIndex = 0;
+    uint32_t indexCount = 0;
+    int32_t baseVertex = 0;
+    uint32_t vertexCount = 0;
+};
+
+// A contiguous run of a draw's triangles with bounds in mesh space.
+// The normal cone holds every triangle normal within its cutoff, which
+// is 1 when the triangles face too many ways for it to cull anything.
+struct Meshlet {
+    glm::vec3 center{0.0f};
+    float radius = 0.0f;
+    glm::vec3 coneAxis{0.0f, 0.0f, 1.0f};
+    float coneCutoff = 1.0f;
+    // Into the shared index buffer, like GeometryDraw
+    uint32_t firstIndex = 0;
+    uint32_t indexCount = 0;
+};
+
+// Axis aligned box in mesh space, inverted while empty
+struct GeometryBox {
+    glm::vec3 lo{INFINITY};
+    glm::vec3 hi{-INFINITY};
+};
+
+// A simplified version of a draw over the same vertices. error is how
+// far its surface may be from the full one, in mesh units.
+struct GeometryLod {
+    uint32_t firstIndex = 0;
+    uint32_t indexCount = 0;
+    float error = 0.0f;
+};
+
+// All static geometry of a model in one vertex and one index array.
+// Indices are relative to their draw's baseVertex, so they stay 16-bit
+// unless a single primitive has more than 65536 vertices.
+struct Geometry {
+    std::vector<Vertex> vertices;
+    std::vector<unsigned char> indices;
+    GLenum indexType = GL_UNSIGNED_SHORT;
+    // One per primitive of the used meshes, in mesh and primitive order
+    std::vector<GeometryDraw> draws;
+    // Draws of mesh i are [meshFirstDraw[i], meshFirstDraw[i + 1])
+    std::vector<uint32_t> meshFirstDraw;
+    // Per draw, taken from the POSITION accessor's min and max
+    std::vector<GeometryBox> drawBounds;
+    // Reordered by optimizeDraw
+    bool optimized = false;
+    // Set by quantizeGeometry, which moves vertices to quantizedVertices
+    // and fills in a dequantization matrix for every mesh
+    bool quantized = false;
+    std::vector<QuantizedVertex> quantizedVertices;
+    std::vector<glm::mat4> meshDequantization;
+    // Filled by buildDrawMeshlets for triangle list draws. Meshlets of draw
+    // i are [drawFirstMeshlet[i], drawFirstMeshlet[i + 1]).
+    std::vector<Meshlet> meshlets;
+    std::vector<uint32_t> drawFirstMeshlet;
+    // Filled by buildDrawLods, with their indices appended to the shared
+    // ones. LODs of draw i are [drawFirstLod[i], drawFirstLod[i + 1]),
+    // coarsest last. meshBounds are spheres around each mesh.
+    std::vector<GeometryLod> lods;
+    std::vector<uint32_t> drawFirstLod;
+    std::vector<glm::vec4> meshBounds;
+
+    size_t indexSize() const noexcept {
+        return indexType == GL_UNSIGNED_SHORT ? 2 : 4;
+    }
+
+    size_t vertexStride() const noexcept {
+        return quantized ? sizeof(QuantizedVertex) : sizeof(Vertex);
+    }
+
+    // The vertex buffer's contents in either layout
+    const void *vertexData() const noexcept {
+        return quantized ? static_cast<const void *>(quantizedVertices.data())
+                         : vertices.data();
+    }
+
+    size_t vertexBytes() const noexcept {
+        return quantized ? quantizedVertices.size() * sizeof(QuantizedVertex)
+                         : vertices.size() * sizeof(Vertex);
+    }
+};
+
+// Indices of a draw widened to 32 bits, relative to its baseVertex
+inline std::vector<uint32_t> readDrawIndices(const Geometry &geometry,
+                                             const GeometryDraw &draw) {
+    std::vector<uint32_t> indices(draw.indexCount);
+    size_t indexSize = geometry.indexSize();
+    auto data = geometry.indices.data() + draw.firstIndex * indexSize;
+    for (size_t i = 0; i < indices.size(); ++i) {
+        if (indexSize == 2) {
+            uint16_t index;
+            std::memcpy(&index, data + 2 * i, 2);
+            indices[i] = index;
+        } else {
+            std::memcpy(&indices[i], data + 4 * i, 4);
+        }
+    }
+    return indices;
+}
+
+// Covers every component type KHR_mesh_quantization allows for positions,
+// normals and texture coordinates, normalized or not
+inline float componentToFloat(const unsigned char *ptr, int componentType,
+                              bool normalized) {
+    switch (componentType) {
+    case TINYGLTF_COMPONENT_TYPE_FLOAT: {
+        float value;
+        std::memcpy(&value, ptr, sizeof(value));
+        return value;
+    }
+    case TINYGLTF_COMPONENT_TYPE_BYTE: {
+        auto value = static_cast<int8_t>(*ptr);
+        return normalized ? std::max(value / 127.0f, -1.0f) : value;
+    }
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+        return normalized ? *ptr / 255.0f : *ptr;
+    case TINYGLTF_COMPONENT_TYPE_SHORT: {
+        int16_t value;
+        std::memcpy(&value, ptr, sizeof(value));
+        return normalized ? std::max(value / 32767.0f, -1.0f) : value;
+    }
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT: {
+        uint16_t value;
+        std::memcpy(&value, ptr, sizeof(value));
+        return normalized ? value / 65535.0f : value;
+    }
+    }
+    throw std::runtime_error("Unsupported vertex component type");
+}
+
+// Required glTF extensions that buildGeometry understands
+inline bool isSupportedExtension(const std::string &name) {
+    return name == "KHR_mesh_quantization";
+}
+
+// Calls fn(i, element) for every element of the accessor, reading the
+// bytes of buffer i from buffers[i] rather than from the model.
+// Mapped pages are released afterwards, keeping at most one accessor of
+// a large file resident.
+template <typename F>
+void forEachElement(const tinygltf::Model &model,
+                    const std::vector<BufferSpan> &buffers,
+                    const tinygltf::Accessor &accessor, F &&fn) {
+    if (accessor.bufferView < 0 || accessor.sparse.isSparse)
+        throw std::runtime_error("Unsupported accessor");
+    auto &bufferView = model.bufferViews[accessor.bufferView];
+    if (bufferView.buffer < 0 || bufferView.buffer >= buffers.size())
+        throw std::runtime_error("Invalid buffer view");
+    auto &buffer = buffers[bufferView.buffer];
+    int byteStride = accessor.ByteStride(bufferView);
+    if (byteStride <= 0) throw std::runtime_error("Invalid accessor stride");
+    size_t stride = byteStride;
+    size_t elementSize
+        = tinygltf::GetComponentSizeInBytes(accessor.componentType)
+          * tinygltf::GetNumComponentsInType(accessor.type);
+    size_t offset = bufferView.byteOffset + accessor.byteOffset;
+    if (accessor.count > 0
+        && offset + stride * (accessor.count - 1) + elementSize
+               > buffer.size)
+        throw std::runtime_error("Accessor out of bounds");
+    for (size_t i = 0; i < accessor.count; ++i)
+        fn(i, buffer.data + offset + stride * i);
+    releasePages(buffer, offset, stride * accessor.count);
+}
+
+// Fills the N floats at fieldOffset of vertices [base, base + count)
+template <int N>
+void readAttribute(const tinygltf::Model &model,
+                   const std::vector<BufferSpan> &buffers,
+                   const tinygltf::Accessor &accessor,
+                   std::vector<Vertex> &vertices, size_t base,
+                   size_t fieldOffset) {
+    if (tinygltf::GetNumComponentsInType(accessor.type) != N)
+        throw std::runtime_error("Unexpected attribute type");
+    size_t componentSize
+        = tinygltf::GetComponentSizeInBytes(accessor.componentType);
+    auto read = [&](size_t i, const unsigned char *ptr) {
+        float dst[N];
+        for (int c = 0; c < N; ++c)
+            dst[c] = componentToFloat(ptr + c * componentSize,
+                                      accessor.componentType,
+                                      accessor.normalized);
+        std::memcpy(reinterpret_cast<unsigned char *>(&vertices[base + i])
+                        + fieldOffset,
+                    dst, sizeof(dst));
+    };
+    forEachElement(model, buffers, accessor, read);
+}
+
+inline uint32_t readIndex(const unsigned char *ptr, int componentType) {
+    switch (componentType) {
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE: return *ptr;
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT: {
+        uint16_t value;
+        std::memcpy(&value, ptr, sizeof(value));
+        return value;
+    }
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT: {
+        uint32_t value;
+        std::memcpy(&value, ptr, sizeof(value));
+        return value;
+    }
+    }
+    throw std::runtime_error("Unsupported index type");
+}
+
+// The accessor's min and max where glTF requires them, which only holds
+// them in mesh units for floats. Otherwise the decoded positions from
+// base on.
+inline GeometryBox positionBounds(const tinygltf::Accessor &accessor,
+                                  const std::vector<Vertex> &vertices,
+                                  size_t base) {
+    GeometryBox box;
+    if (accessor.componentType == TINYGLTF_COMPONENT_TYPE_FLOAT
+        && accessor.minValues.size() == 3 && accessor.maxValues.size() == 3) {
+        for (int i = 0; i < 3; ++i) {
+            box.lo[i] = accessor.minValues[i];
+            box.hi[i] = accessor.maxValues[i];
+        }
+        return box;
+    }
+    for (size_t v = base; v < base + accessor.count; ++v) {
+        box.lo = glm::min(box.lo, vertices[v].position);
+        box.hi = glm::max(box.hi, vertices[v].position);
+    }
+    return box;
+}
+
+// Converts every primitive of the used meshes to the shared layout
+inline Geometry buildGeometry(const tinygltf::Model &model,
+                              const std::vector<BufferSpan> &buffers,
+                              const std::vector<bool> &meshUsed) {
+    Geometry geometry;
+    std::vector<uint32_t> indices;
+    uint32_t maxIndex = 0;
+
+    geometry.meshFirstDraw.push_back(0);
+    for (int meshId = 0; meshId < model.meshes.size(); ++meshId) {
+        if (meshUsed[meshId]) {
+            for (auto &prim : model.meshes[meshId].primitives) {
+                auto position = prim.attributes.find("POSITION");
+                if (position == prim.attributes.end())
+                    throw std::runtime_error("Primitive without positions");
+                size_t base = geometry.vertices.size();
+                size_t count = model.accessors[position->second].count;
+                geometry.vertices.resize(base + count, Vertex{});
+
+                for (auto &[name, accessorId] : prim.attributes) {
+                    auto &accessor = model.accessors[accessorId];
+                    if (accessor.count != count)
+                        throw std::runtime_error("Attribute count mismatch");
+                    auto &vertices = geometry.vertices;
+                    if (name == "POSITION") {
+                        readAttribute<3>(model, buffers, accessor, vertices,
+                                         base, offsetof(Vertex, position));
+                    } else if (name == "NORMAL") {
+                        readAttribute<3>(model, buffers, accessor, vertices,
+                                         base, offsetof(Vertex, normal));
+                    } else if (name == "TEXCOORD_0") {
+                        readAttribute<2>(model, buffers, accessor, vertices,
+                                         base, offsetof(Vertex, texCoord));
+                    } else {
+                        std::cerr << "Unknown parameter " << name << '\n';
+                    }
+                }
+
+                GeometryDraw draw;
+                draw.firstIndex = indices.size();
+                draw.baseVertex = base;
+                draw.vertexCount = count;
+                if (prim.indices >= 0) {
+                    auto &accessor = model.accessors[prim.indices];
+                    auto read = [&](size_t, const unsigned char *ptr) {
+                        uint32_t index = readIndex(ptr, accessor.componentType);
+                        if (index >= count)
+                            throw std::runtime_error("Index out of range");
+                        indices.push_back(index);
+                    };
+                    forEachElement(model, buffers, accessor, read);
+                } else {
+                    for (uint32_t i = 0; i < count; ++i) indices.push_back(i);
+                }
+                draw.indexCount = indices.size() - draw.firstIndex;
+                if (count > 0)
+                    maxIndex = std::max<uint32_t>(maxIndex, count - 1);
+                geometry.draws.push_back(draw);
+                geometry.drawBounds.push_back(positionBounds(
+                    model.accessors[position->second], geometry.vertices,
+                    base));
+            }
+        }
+        geometry.meshFirstDraw.push_back(geometry.draws.size());
+    }
+
+    if (maxIndex > UINT16_MAX) {
+        geometry.indexType = GL_UNSIGNED_INT;
+        geometry.indices.resize(indices.size() * sizeof(uint32_t));
+        std::memcpy(geometry.indices.data(), indices.data(),
+                    geometry.indices.size());
+    } else {
+        geometry.indexType = GL_UNSIGNED_SHORT;
+        std::vector<uint16_t> narrow(indices.begin(), indices.end());
+        geometry.indices.resize(narrow.size() * sizeof(uint16_t));
+        std::memcpy(geometry.indices.data(), narrow.data(),
+                    geometry.indices.size());
+    }
+    return geometry;
+}
+
+#endif
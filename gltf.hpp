@@ -0,0 +1,218 @@
+#ifndef GLTF_H
+#define GLTF_H
+
+#include "cache.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <json.hpp>
+#include <tiny_gltf.h>
+
+// A .gltf or .glb file whose buffers never pass through tinygltf.
+// The binary chunk and external .bin files stay mapped and are read in
+// place through buffers, tinygltf parses the rest with one-byte
+// placeholders instead. Only data URIs are decoded into memory.
+// Mapped pages can be dropped once read, see releasePages().
+struct GltfFile {
+    // Per glTF buffer
+    std::vector<BufferSpan> buffers;
+
+    // Parses path into model. Every image is passed to loadImage with its
+    // encoded bytes, as with tinygltf::TinyGLTF::SetImageLoader.
+    bool load(tinygltf::Model &model, const std::string &path,
+              std::string &err, std::string &warn,
+              tinygltf::LoadImageDataFunction loadImage
+              = tinygltf::LoadImageData,
+              void *userData = nullptr) {
+        clear();
+        try {
+            std::string json = mapAndStripBuffers(path);
+            auto dir = std::filesystem::path(path).parent_path().string();
+            ImageLoader imageLoader{this, loadImage, userData};
+            tinygltf::TinyGLTF loader;
+            loader.SetImageLoader(loadMappedImage, &imageLoader);
+            if (!loader.LoadASCIIFromString(&model, &err, &warn, json.data(),
+                                            json.size(), dir))
+                return false;
+        } catch (const std::exception &e) {
+            err += path + ": " + e.what() + '\n';
+            return false;
+        }
+
+        // Point the model back at the actual data
+        for (size_t i = 0; i < model.buffers.size(); ++i) {
+            model.buffers[i].uri = bufferUris[i];
+            model.buffers[i].data = std::vector<unsigned char>();
+        }
+        for (size_t i = 0; i < model.images.size(); ++i) {
+            if (imageViews[i] < 0) continue;
+            model.images[i].uri.clear();
+            model.images[i].bufferView = imageViews[i];
+            model.images[i].mimeType = imageMimeTypes[i];
+        }
+        return true;
+    }
+
+    // Unmaps the files, buffers must not be read afterwards
+    void clear() {
+        buffers.clear();
+        bufferUris.clear();
+        imageViews.clear();
+        imageMimeTypes.clear();
+        imageSpans.clear();
+        decoded.clear();
+        binFiles.clear();
+        file = MappedFile();
+    }
+
+  private:
+    static constexpr uint32_t GLB_MAGIC = 0x46546c67;
+    static constexpr uint32_t GLB_CHUNK_JSON = 0x4e4f534a;
+    static constexpr uint32_t GLB_CHUNK_BIN = 0x004e4942;
+    // One zero byte, which tinygltf decodes without touching the disk
+    static constexpr const char *PLACEHOLDER_URI
+        = "data:application/octet-stream;base64,AA==";
+
+    MappedFile file;
+    std::vector<MappedFile> binFiles;
+    std::vector<std::vector<unsigned char>> decoded;
+    std::vector<std::string> bufferUris;
+    // Per image, the buffer view it was stored in or -1
+    std::vector<int> imageViews;
+    std::vector<std::string> imageMimeTypes;
+    std::vector<BufferSpan> imageSpans;
+
+    struct ImageLoader {
+        const GltfFile *file;
+        tinygltf::LoadImageDataFunction loadImage;
+        void *userData;
+    };
+
+    // Swaps the placeholder of a buffer view image for its mapped bytes
+    static bool loadMappedImage(tinygltf::Image *image, const int imageId,
+                                std::string *err, std::string *warn,
+                                int reqWidth, int reqHeight,
+                                const unsigned char *bytes, int size,
+                                void *userData) {
+        auto &loader = *static_cast<ImageLoader *>(userData);
+        auto &spans = loader.file->imageSpans;
+        if (0 <= imageId && imageId < spans.size() && spans[imageId].data) {
+            bytes = spans[imageId].data;
+            size = static_cast<int>(spans[imageId].size);
+        }
+        return loader.loadImage(image, imageId, err, warn, reqWidth,
+                                reqHeight, bytes, size, loader.userData);
+    }
+
+    static uint32_t readU32(const unsigned char *ptr) {
+        uint32_t value;
+        std::memcpy(&value, ptr, sizeof(value));
+        return value;
+    }
+
+    // Splits a GLB into its JSON and optional BIN chunk
+    void splitGlb(BufferSpan &json, BufferSpan &bin) const {
+        auto data = file.data();
+        size_t size = file.size();
+        if (size < 12 || readU32(data + 4) != 2 || readU32(data + 8) > size)
+            throw std::runtime_error("Invalid GLB header");
+        size = readU32(data + 8);
+
+        size_t offset = 12;
+        while (offset + 8 <= size) {
+            size_t length = readU32(data + offset);
+            uint32_t type = readU32(data + offset + 4);
+            offset += 8;
+            if (length > size - offset)
+                throw std::runtime_error("Truncated GLB chunk");
+            if (type == GLB_CHUNK_JSON && !json.data)
+                json = {data + offset, length};
+            else if (type == GLB_CHUNK_BIN && !bin.data)
+                bin = {data + offset, length};
+            offset += (length + 3) / 4 * 4;
+        }
+        if (!json.data) throw std::runtime_error("GLB without JSON chunk");
+    }
+
+    // Maps the file and every external buffer, and returns the JSON with
+    // buffers and buffer view images replaced by placeholders
+    std::string mapAndStripBuffers(const std::string &path) {
+        using Json = nlohmann::json;
+        if (!file.open(path)) throw std::runtime_error("Could not open file");
+
+        BufferSpan text, bin;
+        if (file.size() >= 4 && readU32(file.data()) == GLB_MAGIC)
+            splitGlb(text, bin);
+        else
+            text = {file.data(), file.size()};
+        Json json = Json::parse(text.data, text.data + text.size);
+
+        auto dir = std::filesystem::path(path).parent_path();
+        Json empty = Json::array();
+        auto member = [&](const char *name) -> Json & {
+            auto it = json.find(name);
+            return it != json.end() && it->is_array() ? *it : empty;
+        };
+        Json &jsonBuffers = member("buffers");
+        for (size_t i = 0; i < jsonBuffers.size(); ++i) {
+            Json &buffer = jsonBuffers[i];
+            size_t byteLength = buffer.at("byteLength").get<size_t>();
+            std::string uri = buffer.value("uri", std::string());
+            BufferSpan span;
+            if (uri.empty()) {
+                if (i != 0 || byteLength > bin.size)
+                    throw std::runtime_error("Missing GLB binary chunk");
+                span = {bin.data, byteLength, file.isMapped()};
+            } else if (tinygltf::IsDataURI(uri)) {
+                std::string mimeType;
+                auto &bytes = decoded.emplace_back();
+                if (!tinygltf::DecodeDataURI(&bytes, mimeType, uri,
+                                             byteLength, true))
+                    throw std::runtime_error("Invalid data URI");
+                span = {bytes.data(), bytes.size()};
+            } else {
+                std::string binPath;
+                tinygltf::URIDecode(uri, &binPath, nullptr);
+                binPath = (dir / binPath).string();
+                auto &binFile = binFiles.emplace_back();
+                if (!binFile.open(binPath))
+                    throw std::runtime_error("Could not open " + binPath);
+                if (binFile.size() < byteLength)
+                    throw std::runtime_error("Truncated " + binPath);
+                span = {binFile.data(), byteLength, binFile.isMapped()};
+            }
+            buffers.push_back(span);
+            bufferUris.push_back(uri);
+            buffer = Json{{"byteLength", 1}, {"uri", PLACEHOLDER_URI}};
+        }
+
+        const Json &views = member("bufferViews");
+        for (auto &image : member("images")) {
+            imageViews.push_back(image.value("bufferView", -1));
+            imageMimeTypes.push_back(image.value("mimeType", std::string()));
+            imageSpans.push_back({});
+            int viewId = imageViews.back();
+            if (viewId < 0) continue;
+
+            auto &view = views.at(viewId);
+            size_t bufferId = view.at("buffer").get<size_t>();
+            size_t offset = view.value("byteOffset", size_t(0));
+            size_t length = view.at("byteLength").get<size_t>();
+            if (bufferId >= buffers.size()
+                || offset > buffers[bufferId].size
+                || length > buffers[bufferId].size - offset)
+                throw std::runtime_error("Image buffer view out of bounds");
+            imageSpans.back() = {buffers[bufferId].data + offset, length};
+            image.erase("bufferView");
+            image["uri"] = PLACEHOLDER_URI;
+        }
+        return json.dump();
+    }
+};
+
+#endif
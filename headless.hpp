@@ -0,0 +1,70 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include "routine.hpp"
+#include "trace.hpp"
+
+#include <stdexcept>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+// 4.3 core context without a window or surface, for running the loader
+// where there is no display. Takes the place of RaiiContext.
+struct HeadlessContext {
+    HeadlessContext(const HeadlessContext &) = delete;
+    HeadlessContext &operator=(const HeadlessContext &) = delete;
+
+    HeadlessContext() {
+        TraceScope _trace("window");
+        // Mesa's surfaceless platform needs no display server at all
+        auto getPlatformDisplay
+            = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+                eglGetProcAddress("eglGetPlatformDisplayEXT"));
+        if (getPlatformDisplay)
+            display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+                                         EGL_DEFAULT_DISPLAY, nullptr);
+        if (display == EGL_NO_DISPLAY)
+            display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        if (display == EGL_NO_DISPLAY
+            || !eglInitialize(display, nullptr, nullptr))
+            throw std::runtime_error("Could not initialize EGL");
+        if (!eglBindAPI(EGL_OPENGL_API))
+            throw std::runtime_error("EGL does not support OpenGL");
+
+        const EGLint attribs[] = {
+            EGL_CONTEXT_MAJOR_VERSION,
+            4,
+            EGL_CONTEXT_MINOR_VERSION,
+            3,
+            EGL_CONTEXT_OPENGL_PROFILE_MASK,
+            EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+            EGL_CONTEXT_OPENGL_DEBUG,
+            EGL_TRUE,
+            EGL_NONE,
+        };
+        context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT,
+                                   attribs);
+        if (context == EGL_NO_CONTEXT
+            || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                               context))
+            throw std::runtime_error("Could not create headless context");
+
+        gladLoadGL(eglGetProcAddress);
+        getProcAddress = eglGetProcAddress;
+        enableDebugOutput();
+    }
+
+    ~HeadlessContext() {
+        eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                       EGL_NO_CONTEXT);
+        eglDestroyContext(display, context);
+        eglTerminate(display);
+    }
+
+  private:
+    EGLDisplay display = EGL_NO_DISPLAY;
+    EGLContext context = EGL_NO_CONTEXT;
+};
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// How an image is referenced by the materials, which decides how its
+// texels are filtered and compressed
+enum class ImageUsage { Unknown, BaseColor, Normal, Orm };
+
+struct MipLevel {
+    int width = 0;
+    int height = 0;
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+};
+
+inline size_t mipLevelCount(int width, int height) {
+    size_t count = 1;
+    while (width > 1 || height > 1) {
+        width = std::max(width / 2, 1);
+        height = std::max(height / 2, 1);
+        ++count;
+    }
+    return count;
+}
+
+// Expands an 8 or 16 bit image with 1-4 channels to RGBA8,
+// filling missing channels the way GL does on upload
+inline std::vector<unsigned char> toRgba8(const unsigned char *src, int width,
+                                          int height, int components,
+                                          int bits) {
+    size_t count = size_t(width) * height;
+    std::vector<unsigned char> dst(4 * count);
+    for (size_t i = 0; i < count; ++i) {
+        unsigned char rgba[4] = {0, 0, 0, 255};
+        for (int c = 0; c < components; ++c) {
+            size_t idx = i * components + c;
+            if (bits == 16) {
+                unsigned value = reinterpret_cast<const uint16_t *>(src)[idx];
+                rgba[c] = static_cast<unsigned char>((value * 255 + 32767)
+                                                     / 65535);
+            } else {
+                rgba[c] = src[idx];
+            }
+        }
+        std::memcpy(&dst[4 * i], rgba, 4);
+    }
+    return dst;
+}
+
+#endif
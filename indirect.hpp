@@ -0,0 +1,262 @@
+#ifndef INDIRECT_H
+#define INDIRECT_H
+
+#include "routine.hpp"
+#include "scene.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+#include <glm/mat4x4.hpp>
+#include <glm/vec4.hpp>
+
+// Storage buffer bindings of cull.comp and gbuf.vert's GPU_DRIVEN
+// variant, next to the material buffer at 0
+constexpr GLuint INSTANCE_BUFFER_BINDING = 1;
+constexpr GLuint WORLD_BUFFER_BINDING = 2;
+constexpr GLuint COMMAND_BUFFER_BINDING = 3;
+constexpr GLuint NORMAL_BUFFER_BINDING = 4;
+constexpr GLuint DEQUANTIZATION_BUFFER_BINDING = 5;
+constexpr GLuint COUNTER_BUFFER_BINDING = 6;
+// Vertex attribute and binding of the instance index in gbuf.vert
+constexpr GLuint INSTANCE_ID_ATTRIBUTE = 3;
+constexpr GLuint INSTANCE_ID_BINDING = 1;
+constexpr GLuint CULL_GROUP_SIZE = 64;
+// Counters are read back this many frames after cull.comp wrote them
+constexpr size_t COUNTER_LATENCY = 3;
+
+// std430 layout of Instance in cull.comp and gbuf.vert. Bounds are in
+// mesh space, the draw parameters those of the whole primitive.
+struct GpuInstance {
+    glm::vec4 lo{0.0f};
+    glm::vec4 hi{0.0f};
+    glm::vec4 colorFactor{1.0f};
+    uint32_t node = 0;
+    uint32_t mesh = 0;
+    int32_t material = 0;
+    uint32_t textured = 0;
+    uint32_t count = 0;
+    uint32_t firstIndex = 0;
+    int32_t baseVertex = 0;
+    uint32_t padding = 0;
+};
+
+// As glMultiDrawElementsIndirect reads them
+struct DrawElementsIndirectCommand {
+    uint32_t count;
+    uint32_t instanceCount;
+    uint32_t firstIndex;
+    int32_t baseVertex;
+    uint32_t baseInstance;
+};
+
+// Of the frame COUNTER_LATENCY or more frames back, as counted by
+// cull.comp
+struct IndirectStats {
+    uint32_t visible = 0;
+    uint32_t triangles = 0;
+};
+
+// Everything the GPU-driven G-buffer pass reads: per instance records,
+// dequantization matrices and world matrices below the model matrix,
+// which follow the nodes as they move, and per frame the commands and
+// normal matrices cull.comp writes. A culled instance keeps its command
+// with no instances, so one multi-draw covers all of them and the CPU's
+// work per frame does not grow with the scene. GL 4.3 has no gl_DrawID,
+// so every command's baseInstance is its instance index, which reaches
+// gbuf.vert through an attribute with divisor 1 over the indices 0 to
+// n - 1.
+struct IndirectScene {
+    IndirectScene(const IndirectScene &) = delete;
+    IndirectScene &operator=(const IndirectScene &) = delete;
+
+    IndirectScene() = default;
+    ~IndirectScene() { clear(); }
+
+    // One multi-draw takes one primitive mode
+    static bool supports(const Scene &scene) {
+        return std::all_of(scene.primModes.begin(), scene.primModes.end(),
+                           [](GLenum mode) { return mode == GL_TRIANGLES; });
+    }
+
+    size_t instanceCount() const noexcept { return instances; }
+
+    // Adds the instance index attribute to vao, which has to be bound
+    void build(const Scene &scene) {
+        clear();
+        instances = scene.instanceNodes.size();
+        size_t indexSize = scene.indexType == GL_UNSIGNED_SHORT ? 2 : 4;
+        std::vector<GpuInstance> records(instances);
+        for (size_t i = 0; i < instances; ++i) {
+            uint32_t primId = scene.instancePrims[i];
+            uint32_t nodeId = scene.instanceNodes[i];
+            auto &box = scene.primBounds[primId];
+            auto &record = records[i];
+            if (box.lo.x <= box.hi.x && box.lo.y <= box.hi.y
+                && box.lo.z <= box.hi.z) {
+                record.lo = glm::vec4(box.lo, 1.0f);
+                record.hi = glm::vec4(box.hi, 1.0f);
+            }
+            int32_t materialId = scene.primMaterials[primId];
+            record.colorFactor = scene.baseColorFactors[materialId];
+            record.node = nodeId;
+            record.mesh = scene.nodeMeshes[nodeId];
+            record.material = materialId;
+            record.textured = scene.baseColorTextures[materialId] >= 0;
+            record.count = scene.primCounts[primId];
+            record.firstIndex = scene.primIndexOffsets[primId] / indexSize;
+            record.baseVertex = scene.primBaseVertices[primId];
+        }
+        instanceBuffer = createBuffer(records, GL_STATIC_DRAW);
+        dequantizationBuffer
+            = createBuffer(scene.meshDequantization, GL_STATIC_DRAW);
+        worldBuffer = createBuffer(std::vector<glm::mat4>(scene.nodeCount()),
+                                   GL_DYNAMIC_DRAW);
+        commandBuffer = createBuffer(
+            std::vector<DrawElementsIndirectCommand>(instances),
+            GL_DYNAMIC_COPY);
+        normalBuffer = createBuffer(std::vector<glm::mat4>(instances),
+                                    GL_DYNAMIC_COPY);
+        for (auto &counter : counters)
+            counter.buffer = createBuffer(std::vector<IndirectStats>(1),
+                                          GL_DYNAMIC_READ);
+        scratchCounter
+            = createBuffer(std::vector<IndirectStats>(1), GL_DYNAMIC_COPY);
+
+        std::vector<uint32_t> ids(instances);
+        std::iota(ids.begin(), ids.end(), 0);
+        instanceIdBuffer = createBuffer(ids, GL_STATIC_DRAW);
+        glEnableVertexAttribArray(INSTANCE_ID_ATTRIBUTE);
+        glVertexAttribIFormat(INSTANCE_ID_ATTRIBUTE, 1, GL_UNSIGNED_INT, 0);
+        glVertexAttribBinding(INSTANCE_ID_ATTRIBUTE, INSTANCE_ID_BINDING);
+        glVertexBindingDivisor(INSTANCE_ID_BINDING, 1);
+        glBindVertexBuffer(INSTANCE_ID_BINDING, instanceIdBuffer, 0,
+                           sizeof(uint32_t));
+    }
+
+    // Uploads the node ranges [first, second) of worlds that moved
+    void updateWorlds(const std::vector<glm::mat4> &worlds,
+                      const std::vector<std::pair<uint32_t, uint32_t>> &moved) {
+        if (moved.empty()) return;
+        RaiiBindBuffer _bind(GL_SHADER_STORAGE_BUFFER, worldBuffer);
+        for (auto [first, end] : moved)
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER,
+                            first * sizeof(glm::mat4),
+                            (end - first) * sizeof(glm::mat4),
+                            worlds.data() + first);
+    }
+
+    // Runs cull.comp, which has to be in use with its uniforms set, and
+    // leaves the buffers bound for the draw
+    // Counts into the oldest counter once the GPU is done with it. While
+    // the GPU is more frames behind, the frame counts into a scratch
+    // buffer nobody reads, and the stats stay those of the last frame
+    // read back.
+    void cull() {
+        auto &counter = counters[frame % COUNTER_LATENCY];
+        bool counting = !counter.fence || signalled(counter.fence);
+        if (counting && counter.fence) {
+            glDeleteSync(counter.fence);
+            counter.fence = nullptr;
+            RaiiBindBuffer _bind(GL_SHADER_STORAGE_BUFFER, counter.buffer);
+            glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(stats),
+                               &stats);
+        }
+        if (counting) {
+            IndirectStats zero;
+            RaiiBindBuffer _bind(GL_SHADER_STORAGE_BUFFER, counter.buffer);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(zero), &zero);
+        }
+
+        bindBuffers(counting ? counter.buffer : scratchCounter);
+        glDispatchCompute((instances + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE,
+                          1, 1);
+        if (counting) {
+            counter.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            ++frame;
+        }
+        glMemoryBarrier(GL_COMMAND_BARRIER_BIT
+                        | GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+    // The whole pass, with the vertex array bound
+    void draw(GLenum indexType) const {
+        RaiiBindBuffer _bind(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+        glMultiDrawElementsIndirect(GL_TRIANGLES, indexType, nullptr,
+                                    instances, 0);
+    }
+
+    const IndirectStats &lastStats() const noexcept { return stats; }
+
+    void clear() {
+        for (GLuint *buffer : {&instanceBuffer, &dequantizationBuffer,
+                               &worldBuffer, &commandBuffer, &normalBuffer,
+                               &instanceIdBuffer, &scratchCounter}) {
+            glDeleteBuffers(1, buffer);
+            *buffer = 0;
+        }
+        for (auto &counter : counters) {
+            glDeleteBuffers(1, &counter.buffer);
+            if (counter.fence) glDeleteSync(counter.fence);
+            counter = {};
+        }
+        instances = 0;
+    }
+
+  private:
+    struct Counter {
+        GLuint buffer = 0;
+        GLsync fence = nullptr;
+    };
+
+    size_t instances = 0;
+    GLuint instanceBuffer = 0;
+    GLuint dequantizationBuffer = 0;
+    GLuint worldBuffer = 0;
+    GLuint commandBuffer = 0;
+    GLuint normalBuffer = 0;
+    GLuint instanceIdBuffer = 0;
+    Counter counters[COUNTER_LATENCY];
+    GLuint scratchCounter = 0;
+    size_t frame = 0;
+    IndirectStats stats;
+
+    static bool signalled(GLsync fence) {
+        GLenum status = glClientWaitSync(fence, 0, 0);
+        return status == GL_ALREADY_SIGNALED
+               || status == GL_CONDITION_SATISFIED;
+    }
+
+    template <typename T>
+    static GLuint createBuffer(const std::vector<T> &data, GLenum usage) {
+        GLuint buffer;
+        glGenBuffers(1, &buffer);
+        RaiiBindBuffer _bind(GL_SHADER_STORAGE_BUFFER, buffer);
+        // Empty storage buffers cannot be bound
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                     std::max<size_t>(data.size(), 1) * sizeof(T), data.data(),
+                     usage);
+        return buffer;
+    }
+
+    void bindBuffers(GLuint counterBuffer) const {
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, INSTANCE_BUFFER_BINDING,
+                         instanceBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, WORLD_BUFFER_BINDING,
+                         worldBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, COMMAND_BUFFER_BINDING,
+                         commandBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, NORMAL_BUFFER_BINDING,
+                         normalBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER,
+                         DEQUANTIZATION_BUFFER_BINDING, dequantizationBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, COUNTER_BUFFER_BINDING,
+                         counterBuffer);
+    }
+};
+
+#endif
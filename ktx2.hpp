@@ -0,0 +1,221 @@
+#ifndef KTX2_H
+#define KTX2_H
+
+#include "bc.hpp"
+#include "cache.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+constexpr unsigned char KTX2_IDENTIFIER[12] = {0xAB, 0x4B, 0x54, 0x58,
+                                               0x20, 0x32, 0x30, 0xBB,
+                                               0x0D, 0x0A, 0x1A, 0x0A};
+constexpr size_t KTX2_HEADER_SIZE = 80;
+constexpr size_t KTX2_LEVEL_INDEX_ENTRY_SIZE = 24;
+
+// Only the formats BcFormat produces, in their UNORM flavours
+constexpr uint32_t VK_FORMAT_BC1_RGB_UNORM_BLOCK = 131;
+constexpr uint32_t VK_FORMAT_BC5_UNORM_BLOCK = 141;
+constexpr uint32_t VK_FORMAT_BC7_UNORM_BLOCK = 145;
+
+inline uint32_t ktx2VkFormat(BcFormat format) {
+    switch (format) {
+    case BcFormat::BC1: return VK_FORMAT_BC1_RGB_UNORM_BLOCK;
+    case BcFormat::BC5: return VK_FORMAT_BC5_UNORM_BLOCK;
+    case BcFormat::BC7: return VK_FORMAT_BC7_UNORM_BLOCK;
+    }
+    return 0;
+}
+
+inline bool ktx2BcFormat(uint32_t vkFormat, BcFormat &format) {
+    switch (vkFormat) {
+    case VK_FORMAT_BC1_RGB_UNORM_BLOCK: format = BcFormat::BC1; return true;
+    case VK_FORMAT_BC5_UNORM_BLOCK: format = BcFormat::BC5; return true;
+    case VK_FORMAT_BC7_UNORM_BLOCK: format = BcFormat::BC7; return true;
+    default: return false;
+    }
+}
+
+// Basic data format descriptor for a single block compressed plane
+inline std::vector<unsigned char> ktx2Dfd(BcFormat format) {
+    // KHR_DF_MODEL_BC1A, KHR_DF_MODEL_BC5, KHR_DF_MODEL_BC7
+    uint8_t model = format == BcFormat::BC1   ? 128
+                    : format == BcFormat::BC5 ? 132
+                                              : 134;
+    uint32_t blockBytes = bcBlockBytes(format);
+    uint32_t sampleCount = format == BcFormat::BC5 ? 2 : 1;
+    uint32_t blockSize = 24 + 16 * sampleCount;
+
+    BinaryWriter dfd;
+    dfd.put<uint32_t>(4 + blockSize);
+    dfd.put<uint32_t>(0); // Khronos vendor, basic descriptor type
+    dfd.put<uint32_t>(2 | (blockSize << 16));
+    // Model, BT.709 primaries, linear transfer, straight alpha
+    dfd.put<uint32_t>(model | (1 << 8) | (1 << 16));
+    dfd.put<uint32_t>(3 | (3 << 8)); // 4x4 texel blocks
+    dfd.put<uint32_t>(blockBytes);
+    dfd.put<uint32_t>(0);
+    uint32_t sampleBits = 8 * blockBytes / sampleCount;
+    for (uint32_t i = 0; i < sampleCount; ++i) {
+        dfd.put<uint32_t>((i * sampleBits) | ((sampleBits - 1) << 16)
+                          | (i << 24));
+        dfd.put<uint32_t>(0);
+        dfd.put<uint32_t>(0);
+        dfd.put<uint32_t>(UINT32_MAX);
+    }
+    return dfd.bytes;
+}
+
+// Levels hold compressed data, level 0 first.
+// keyValues must be sorted by key as the specification demands.
+inline void writeKtx2(
+    const std::string &path, BcFormat format, int width, int height,
+    const std::vector<std::vector<unsigned char>> &levels,
+    const std::vector<std::pair<std::string, std::string>> &keyValues) {
+    auto dfd = ktx2Dfd(format);
+
+    BinaryWriter kvd;
+    for (auto &[key, value] : keyValues) {
+        kvd.put<uint32_t>(key.size() + 1 + value.size() + 1);
+        kvd.putBytes(key.c_str(), key.size() + 1);
+        kvd.putBytes(value.c_str(), value.size() + 1);
+        kvd.align(4);
+    }
+
+    size_t dfdOffset
+        = KTX2_HEADER_SIZE + KTX2_LEVEL_INDEX_ENTRY_SIZE * levels.size();
+    size_t kvdOffset = dfdOffset + dfd.size();
+
+    // Levels are stored smallest first, aligned to the block size
+    size_t blockBytes = bcBlockBytes(format);
+    std::vector<size_t> offsets(levels.size());
+    size_t offset = kvdOffset + kvd.bytes.size();
+    for (size_t i = levels.size(); i-- > 0;) {
+        offset = (offset + blockBytes - 1) / blockBytes * blockBytes;
+        offsets[i] = offset;
+        offset += levels[i].size();
+    }
+
+    BinaryWriter out;
+    out.putBytes(KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER));
+    out.put<uint32_t>(ktx2VkFormat(format));
+    out.put<uint32_t>(1); // typeSize
+    out.put<uint32_t>(width);
+    out.put<uint32_t>(height);
+    out.put<uint32_t>(0); // pixelDepth
+    out.put<uint32_t>(0); // layerCount
+    out.put<uint32_t>(1); // faceCount
+    out.put<uint32_t>(levels.size());
+    out.put<uint32_t>(0); // no supercompression
+    out.put<uint32_t>(dfdOffset);
+    out.put<uint32_t>(dfd.size());
+    out.put<uint32_t>(kvd.bytes.empty() ? 0 : kvdOffset);
+    out.put<uint32_t>(kvd.bytes.size());
+    out.put<uint64_t>(0); // no supercompression global data
+    out.put<uint64_t>(0);
+    for (size_t i = 0; i < levels.size(); ++i) {
+        out.put<uint64_t>(offsets[i]);
+        out.put<uint64_t>(levels[i].size());
+        out.put<uint64_t>(levels[i].size());
+    }
+    out.putBytes(dfd.data(), dfd.size());
+    out.putBytes(kvd.bytes.data(), kvd.bytes.size());
+    for (size_t i = levels.size(); i-- > 0;) {
+        out.bytes.resize(offsets[i], 0);
+        out.putBytes(levels[i].data(), levels[i].size());
+    }
+    writeFileAtomically(path, out.bytes, {});
+}
+
+// Block compressed 2D texture read from a KTX2 file.
+// Level data points into the mapping, which must outlive the levels.
+struct Ktx2Texture {
+    BcFormat format = BcFormat::BC1;
+    std::vector<MipLevel> levels;
+    std::vector<std::pair<std::string, std::string>> keyValues;
+
+    const std::string *find(const std::string &key) const {
+        for (auto &[k, v] : keyValues)
+            if (k == key) return &v;
+        return nullptr;
+    }
+};
+
+// Returns false for anything but the uncompressed 2D BC files written above
+inline bool readKtx2(const MappedFile &file, Ktx2Texture &texture) {
+    if (file.size() < KTX2_HEADER_SIZE
+        || std::memcmp(file.data(), KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER))
+               != 0)
+        return false;
+
+    try {
+        BinaryReader header(file.data() + sizeof(KTX2_IDENTIFIER),
+                            file.size() - sizeof(KTX2_IDENTIFIER));
+        uint32_t vkFormat = header.get<uint32_t>();
+        header.get<uint32_t>();
+        int width = header.get<uint32_t>();
+        int height = header.get<uint32_t>();
+        uint32_t depth = header.get<uint32_t>();
+        uint32_t layers = header.get<uint32_t>();
+        uint32_t faces = header.get<uint32_t>();
+        uint32_t levelCount = header.get<uint32_t>();
+        uint32_t supercompression = header.get<uint32_t>();
+        if (!ktx2BcFormat(vkFormat, texture.format) || depth != 0
+            || layers != 0 || faces != 1 || levelCount == 0
+            || supercompression != 0 || width <= 0 || height <= 0)
+            return false;
+
+        header.get<uint32_t>();
+        header.get<uint32_t>();
+        uint32_t kvdOffset = header.get<uint32_t>();
+        uint32_t kvdLength = header.get<uint32_t>();
+        header.get<uint64_t>();
+        header.get<uint64_t>();
+
+        texture.levels.resize(levelCount);
+        for (uint32_t i = 0; i < levelCount; ++i) {
+            uint64_t offset = header.get<uint64_t>();
+            uint64_t length = header.get<uint64_t>();
+            header.get<uint64_t>();
+            auto &level = texture.levels[i];
+            level.width = std::max(width >> i, 1);
+            level.height = std::max(height >> i, 1);
+            if (length != bcLevelBytes(texture.format, level.width,
+                                       level.height)
+                || offset > file.size() || length > file.size() - offset)
+                return false;
+            level.data = file.data() + offset;
+            level.size = length;
+        }
+
+        if (kvdOffset > file.size() || kvdLength > file.size() - kvdOffset)
+            return false;
+        BinaryReader kvd(file.data() + kvdOffset, kvdLength);
+        for (size_t read = 0; read + 4 <= kvdLength;) {
+            uint32_t length = kvd.get<uint32_t>();
+            std::vector<char> entry(length);
+            for (auto &ch : entry) ch = kvd.get<char>();
+            size_t keyEnd = std::find(entry.begin(), entry.end(), '\0')
+                            - entry.begin();
+            if (keyEnd == entry.size()) return false;
+            std::string key(entry.data(), keyEnd);
+            std::string value(entry.data() + keyEnd + 1,
+                              entry.size() - keyEnd - 1);
+            if (!value.empty() && value.back() == '\0') value.pop_back();
+            texture.keyValues.emplace_back(std::move(key), std::move(value));
+            size_t padded = (length + 3) / 4 * 4;
+            for (size_t i = length; i < padded && read + 4 + i < kvdLength;
+                 ++i)
+                kvd.get<char>();
+            read += 4 + padded;
+        }
+    } catch (const std::exception &) {
+        return false;
+    }
+    return true;
+}
+
+#endif
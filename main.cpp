@@ -1,9 +1,42 @@
+#include "bvh.hpp"
+#include "cache.hpp"
+#include "cull.hpp"
+#include "drawlist.hpp"
+#include "geometry.hpp"
+#include "gltf.hpp"
 #include "imgui.h"
+#include "indirect.hpp"
+#include "material.hpp"
+#include "meshlet.hpp"
+#include "meshopt.hpp"
+#include "mip.hpp"
+#include "parallel.hpp"
+#include "quantize.hpp"
 #include "routine.hpp"
+#include "scene.hpp"
+#include "simplify.hpp"
+#include "texcompress.hpp"
+#include "texture.hpp"
+#include "trace.hpp"
+#include "upload.hpp"
+#include "watch.hpp"
+#ifdef HW03_LOADBENCH
+#include "headless.hpp"
+#endif
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <exception>
+#include <future>
 #include <map>
+#include <memory>
+#include <numeric>
+#include <optional>
 #include <random>
+#include <thread>
 #include <tuple>
 #include <vector>
 
@@ -23,7 +56,10 @@
 
 #include <tiny_gltf.h>
 
+// The load benchmark creates a headless context per run instead
+#ifndef HW03_LOADBENCH
 RaiiContext _context;
+#endif
 
 constexpr float PI = glm::pi<float>();
 constexpr float TWO_PI = 2.0f * PI;
@@ -36,6 +72,8 @@ constexpr glm::vec2 FULL_SCREEN_TRIANGLE[] = {
 };
 
 ShaderProgram programGBuf;
+ShaderProgram programGBufIndirect;
+ShaderProgram programCull;
 ShaderProgram programScreen;
 
 GLuint uniformIsTextured = 0;
@@ -45,6 +83,27 @@ GLuint uniformMatView = 0;
 GLuint uniformMatProj = 0;
 GLuint uniformMatNormal = 0;
 GLuint uniformMorphProgress = 0;
+GLuint uniformMatDequant = 0;
+GLuint uniformOctahedralNormals = 0;
+GLuint uniformTexturePath = 0;
+GLuint uniformMaterialId = 0;
+GLuint uniformTextureArrays = 0;
+GLuint uniformInstanced = 0;
+
+// The G-buffer shaders' GPU-driven variant, which has no per draw uniforms
+GLuint uniformIndirectMatModel = 0;
+GLuint uniformIndirectMatView = 0;
+GLuint uniformIndirectMatProj = 0;
+GLuint uniformIndirectMorphProgress = 0;
+GLuint uniformIndirectOctahedralNormals = 0;
+GLuint uniformIndirectTexturePath = 0;
+GLuint uniformIndirectTextureArrays = 0;
+
+GLuint uniformCullMatModel = 0;
+GLuint uniformCullMatView = 0;
+GLuint uniformCullFrustumPlanes = 0;
+GLuint uniformCullFrustumCulling = 0;
+GLuint uniformCullInstanceCount = 0;
 
 GLuint uniformGBaseColor = 0;
 GLuint uniformGNormal = 0;
@@ -62,15 +121,11 @@ GLuint uniformSpotLightDir = 0;
 GLuint uniformSpotLightColor = 0;
 GLuint uniformSpotLightAngleCos = 0;
 
-void loadShaders() {
+void loadGBufShaders() {
     Shader shaderGBufVert(GL_VERTEX_SHADER, "gbuf.vert");
     Shader shaderGBufFrag(GL_FRAGMENT_SHADER, "gbuf.frag");
     ShaderProgram programGBuf(shaderGBufVert.get(), shaderGBufFrag.get());
 
-    Shader shaderScreenVert(GL_VERTEX_SHADER, "screen.vert");
-    Shader shaderScreenFrag(GL_FRAGMENT_SHADER, "screen.frag");
-    ShaderProgram programScreen(shaderScreenVert.get(), shaderScreenFrag.get());
-
     uniformIsTextured = programGBuf.locateUniform("isTextured");
     uniformColorFactor = programGBuf.locateUniform("colorFactor");
 
@@ -79,6 +134,51 @@ void loadShaders() {
     uniformMatProj = programGBuf.locateUniform("matProj");
     uniformMatNormal = programGBuf.locateUniform("matNormal");
     uniformMorphProgress = programGBuf.locateUniform("morphProgress");
+    uniformMatDequant = programGBuf.locateUniform("matDequant");
+    uniformOctahedralNormals = programGBuf.locateUniform("octahedralNormals");
+    uniformTexturePath = programGBuf.locateUniform("texturePath");
+    uniformMaterialId = programGBuf.locateUniform("materialId");
+    uniformTextureArrays = programGBuf.locateUniform("textureArrays");
+    uniformInstanced = programGBuf.locateUniform("instanced");
+
+    Shader shaderIndirectVert(GL_VERTEX_SHADER, "gbuf.vert",
+                              "#define GPU_DRIVEN\n");
+    ShaderProgram programGBufIndirect(shaderIndirectVert.get(),
+                                      shaderGBufFrag.get());
+
+    uniformIndirectMatModel = programGBufIndirect.locateUniform("matModel");
+    uniformIndirectMatView = programGBufIndirect.locateUniform("matView");
+    uniformIndirectMatProj = programGBufIndirect.locateUniform("matProj");
+    uniformIndirectMorphProgress
+        = programGBufIndirect.locateUniform("morphProgress");
+    uniformIndirectOctahedralNormals
+        = programGBufIndirect.locateUniform("octahedralNormals");
+    uniformIndirectTexturePath
+        = programGBufIndirect.locateUniform("texturePath");
+    uniformIndirectTextureArrays
+        = programGBufIndirect.locateUniform("textureArrays");
+
+    ::programGBuf = std::move(programGBuf);
+    ::programGBufIndirect = std::move(programGBufIndirect);
+}
+
+void loadCullShaders() {
+    Shader shaderCullComp(GL_COMPUTE_SHADER, "cull.comp");
+    ShaderProgram programCull(shaderCullComp.get());
+
+    uniformCullMatModel = programCull.locateUniform("matModel");
+    uniformCullMatView = programCull.locateUniform("matView");
+    uniformCullFrustumPlanes = programCull.locateUniform("frustumPlanes");
+    uniformCullFrustumCulling = programCull.locateUniform("frustumCulling");
+    uniformCullInstanceCount = programCull.locateUniform("instanceCount");
+
+    ::programCull = std::move(programCull);
+}
+
+void loadScreenShaders() {
+    Shader shaderScreenVert(GL_VERTEX_SHADER, "screen.vert");
+    Shader shaderScreenFrag(GL_FRAGMENT_SHADER, "screen.frag");
+    ShaderProgram programScreen(shaderScreenVert.get(), shaderScreenFrag.get());
 
     uniformGBaseColor = programScreen.locateUniform("gBaseColor");
     uniformGNormal = programScreen.locateUniform("gNormal");
@@ -96,96 +196,768 @@ void loadShaders() {
     uniformSpotLightColor = programScreen.locateUniform("spotLightColor");
     uniformSpotLightAngleCos = programScreen.locateUniform("spotLightAngleCos");
 
-    ::programGBuf = std::move(programGBuf);
     ::programScreen = std::move(programScreen);
 }
 
+void loadShaders() {
+    loadGBufShaders();
+    loadCullShaders();
+    loadScreenShaders();
+}
+
+// A changed shader only rebuilds its own program
+struct ShaderFile {
+    const char *path;
+    void (*load)();
+};
+
+constexpr ShaderFile SHADER_FILES[] = {
+    {"gbuf.vert", loadGBufShaders},
+    {"gbuf.frag", loadGBufShaders},
+    {"cull.comp", loadCullShaders},
+    {"screen.vert", loadScreenShaders},
+    {"screen.frag", loadScreenShaders},
+};
+
+struct LoadOptions {
+    // Decode images on a worker pool instead of one by one
+    bool parallelDecode = true;
+    // Reuse upload-ready data from <path>.cache, or write it after loading
+    bool useCache = true;
+    // Prefer block compressed KTX2 files next to the images when the driver
+    // samples BC formats, compressing missing or stale ones on the way
+    bool compressedTextures = true;
+    // Copy buffers and texture levels through one persistently mapped
+    // staging ring instead of handing client memory to every GL call
+    bool stagingRing = true;
+    // Reorder triangles and vertices of every mesh for the vertex cache,
+    // overdraw and fetch locality. The cache keeps the result.
+    bool optimizeMeshes = true;
+    // Store vertices in 16 bytes instead of 32: quantized positions,
+    // octahedral normals and half float texture coordinates
+    bool quantizeVertices = true;
+    // Split triangle lists into meshlets with bounds, which are culled
+    // against the frustum and by their normal cones every frame
+    bool buildMeshlets = true;
+    // Simplify every triangle list into a few coarser LODs, picked per
+    // node by how large their error would show on screen
+    bool buildLods = true;
+    // Load on a worker thread with a shared context while frames keep
+    // rendering, instead of blocking before the first frame
+    bool asyncLoad = true;
+    // Filter for the mip levels built from decoded images. Base color is
+    // averaged in linear light and normal maps are renormalized either way.
+    MipFilter mipFilter = MipFilter::Box;
+    // Also time glGenerateMipmap on the decoded images, for comparison
+    bool compareDriverMipmaps = false;
+};
+
+// Coarse steps of Model::loadFrom, shown while loading in the background
+enum class LoadPhase { Parsing, Decoding, Geometry, Textures, Uploading, Done };
+
+constexpr const char *LOAD_PHASE_NAMES[] = {
+    "Parsing", "Decoding images", "Building geometry",
+    "Preparing textures", "Uploading", "Done",
+};
+
 struct Model {
     ~Model() {
-        glDeleteVertexArrays(vaos.size(), vaos.data());
-        glDeleteBuffers(buffers.size(), buffers.data());
-        glDeleteTextures(textures.size(), textures.data());
+        // Loading cannot be interrupted, closing early waits for it
+        if (loader.joinable()) loader.join();
+        if (loaderWindow) glfwDestroyWindow(loaderWindow);
+        if (loadFence) glDeleteSync(loadFence);
+        // Handles must not outlive their textures
+        materialTextures.clear();
+        glDeleteVertexArrays(1, &vao);
+        glDeleteBuffers(1, &vertexBuffer);
+        glDeleteBuffers(1, &indexBuffer);
+        glDeleteBuffers(1, &instanceMatrixBuffer);
+        for (auto &texture : textures) glDeleteTextures(1, &texture.tex);
+        for (auto &texture : replacements) glDeleteTextures(1, &texture.tex);
+        glDeleteTextures(1, &placeholder);
+        glDeleteSamplers(samplers.size(), samplers.data());
     }
 
-    void loadFrom(const std::string &path) {
-        loadModel(path);
+    // Loads on a worker thread whose context shares objects with the
+    // window's. The worker fences its GL commands when done, and
+    // pollLoad() takes the model over once the fence has signalled.
+    void startLoading(const std::string &path, const LoadOptions &options) {
+        loadStart = std::chrono::steady_clock::now();
+        if (!options.asyncLoad) {
+            loadFrom(path, options);
+            finishLoading();
+            return;
+        }
 
-        auto &scene = model.scenes[model.defaultScene];
-        std::vector<bool> nodeUsed(model.nodes.size(), false);
-        for (int nodeId : scene.nodes) findUsedNodes(nodeUsed, nodeId);
+        loaderWindow = createSharedContext();
+        loader = std::thread([this, path, options] {
+            glfwMakeContextCurrent(loaderWindow);
+            enableDebugOutput();
+            try {
+                loadFrom(path, options);
+            } catch (...) {
+                loadError = std::current_exception();
+            }
+            loadFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            glFlush();
+            glfwMakeContextCurrent(nullptr);
+            loadFenced.store(true, std::memory_order_release);
+        });
+    }
 
-        createBuffersAndTextures(nodeUsed);
+    // Called every frame on the render thread, true once the model is
+    // ready to be drawn. Rethrows what the loader threw.
+    bool pollLoad() {
+        if (loaded) return true;
+        if (!loadFenced.load(std::memory_order_acquire)) return false;
+        GLenum status = glClientWaitSync(loadFence, 0, 0);
+        if (status == GL_WAIT_FAILED)
+            throw std::runtime_error("Could not wait for loader fence");
+        if (status == GL_TIMEOUT_EXPIRED) return false;
+
+        glDeleteSync(loadFence);
+        loadFence = nullptr;
+        loader.join();
+        glfwDestroyWindow(loaderWindow);
+        loaderWindow = nullptr;
+        if (loadError) std::rethrow_exception(loadError);
+        finishLoading();
+        return true;
+    }
 
-        std::vector<bool> meshUsed(model.meshes.size(), false);
-        vaos.resize(model.meshes.size(), 0);
+    void showLoadProgress() {
+        if (loaded) return;
+        int phase = static_cast<int>(loadPhase.load());
+        std::chrono::duration<double> elapsed
+            = std::chrono::steady_clock::now() - loadStart;
+        ImGui::Text("Loading: %s (%.1f s)", LOAD_PHASE_NAMES[phase],
+                    elapsed.count());
+        ImGui::ProgressBar(float(phase) / int(LoadPhase::Done));
+    }
 
-        for (int nodeId = 0; nodeId < model.nodes.size(); ++nodeId) {
-            auto &node = model.nodes[nodeId];
-            if (nodeUsed[nodeId]) {
-                if (0 > node.mesh || node.mesh >= model.meshes.size()) continue;
-                meshUsed[node.mesh] = true;
+    void loadFrom(const std::string &path, const LoadOptions &options = {}) {
+        TraceScope _trace("load", path);
+        auto start = std::chrono::steady_clock::now();
+        loadPhase = LoadPhase::Parsing;
+        mipFilter = options.mipFilter;
+        std::string cachePath = path + ".cache";
+        if (options.stagingRing && !ring.create(STAGING_RING_SIZE))
+            std::cout << "Persistent mapping unsupported, "
+                         "uploading directly\n";
+        bool compress = options.compressedTextures && bcTexturesSupported();
+        bool cached
+            = options.useCache && loadCache(path, cachePath, options, compress);
+        if (!cached) {
+            loadModel(path, options, compress);
+            modelFiles = {path};
+            for (auto &buffer : model.buffers) {
+                auto file = uriPath(path, buffer.uri);
+                if (!file.empty()) modelFiles.push_back(file);
             }
         }
-        for (int meshId = 0; meshId < model.meshes.size(); ++meshId) {
-            if (meshUsed[meshId]) bindMesh(meshId);
+
+        auto &gltfScene = model.scenes[model.defaultScene];
+        std::vector<bool> nodeUsed(model.nodes.size(), false);
+        for (int nodeId : gltfScene.nodes) findUsedNodes(nodeUsed, nodeId);
+
+        if (!cached) {
+            createBuffersAndTextures(nodeUsed, path, options, compress);
+            // The cache only speeds up the next load, so this one keeps
+            // its model when it cannot be written
+            try {
+                if (options.useCache) saveCache(path, cachePath);
+            } catch (const std::exception &e) {
+                std::cout << "Could not write cache " << cachePath << ": "
+                          << e.what() << '\n';
+            }
         }
+        loadPhase = LoadPhase::Uploading;
+        finishBufferUploads();
+
+        // Textures render as their material's baseColorFactor
+        // (placeholder times colorFactor) until a level is resident
+        const unsigned char white[4] = {255, 255, 255, 255};
+        placeholder = createSolidTexture(white);
+        for (auto &texture : textures) {
+            if (!texture.levels.empty()) texture.allocate();
+        }
+        for (auto &state : samplerStates) samplers.push_back(state.create());
+
+        // Everything needed to draw is in GL or the flat scene now,
+        // so the parsed glTF with its decoded images and buffers can go
+        scene = buildScene(model, geometry, textureBindings);
+        model = tinygltf::Model();
+        geometry = Geometry();
+        textureBindings = std::vector<TextureBinding>();
+        imageHashes = std::vector<uint64_t>();
+        canonicalImages = std::vector<int>();
+
+        std::chrono::duration<double, std::milli> dt
+            = std::chrono::steady_clock::now() - start;
+        std::cout << "Loaded " << path << (cached ? " from cache" : "")
+                  << " in " << dt.count() << " ms\n";
+    }
+
+    // Uploads pending mip levels, spending about budget bytes per call
+    size_t streamTextures(size_t budget) {
+        if (!loaded) return 0;
+        if (streamingDone) return streamReloads(budget);
+        auto start = std::chrono::steady_clock::now();
+        size_t uploaded = streamer.stream(textures, budget,
+                                          ring.isActive() ? &ring : nullptr);
+        std::chrono::duration<double, std::milli> dt
+            = std::chrono::steady_clock::now() - start;
+        uploadStats.textureMillis += dt.count();
+        uploadStats.textureBytes += uploaded;
+        if (uploaded > 0)
+            startupTrace.record({"texture_upload", {}, dt.count(), uploaded});
+        uploadStats.sampleGpuMemory();
+        streamedBytes += uploaded;
+
+        bool done = true;
+        for (auto &texture : textures) done = done && texture.isComplete();
+        if (done) {
+            // Everything is on the GPU, CPU copies are no longer needed
+            for (auto &texture : textures) texture.releaseTexels();
+            cacheFile = MappedFile();
+            ktxFiles.clear();
+            streamingDone = true;
+            materialsDirty = true;
+        }
+        return uploaded;
+    }
+
+    // Takes effect once every texture is resident, binds until then
+    void setTexturePath(TexturePath path) {
+        if (path == texturePath) return;
+        texturePath = path;
+        materialsDirty = true;
+    }
+
+    TexturePath activeTexturePath() const noexcept {
+        return materialTextures.path();
+    }
+
+    bool bindlessSupported() const noexcept {
+        return materialTextures.bindlessSupported();
+    }
+
+    // Of the last textured pass
+    size_t textureBindCount() const noexcept { return textureBinds; }
+
+    // Files the model was loaded from, to watch for changes
+    std::vector<std::string> sourceFiles() const {
+        auto files = modelFiles;
+        for (auto &[file, slot] : textureFiles) files.push_back(file);
+        return files;
+    }
+
+    // Starts decoding a changed image file in the background. Returns
+    // false if the file is not the source of any of the model's textures.
+    bool reloadTexture(const std::string &file) {
+        auto it = textureFiles.find(file);
+        if (!loaded || it == textureFiles.end()) return false;
+        std::cout << "Reloading texture " << file << '\n';
+        size_t slot = it->second;
+        reloads.push_back({slot, file,
+                           std::async(std::launch::async, decodeTextureFile,
+                                      file, textureUsages[slot], mipFilter)});
+        return true;
+    }
+
+    void showTextureInfo() {
+        if (!loaded || !ImGui::CollapsingHeader("Textures")) return;
+
+        size_t resident = 0, total = 0;
+        for (auto &texture : textures) {
+            resident += texture.residentBytes();
+            for (auto &level : texture.levels) total += level.size;
+        }
+        ImGui::Text("Resident: %.1f / %.1f MB (%.1f MB streamed)",
+                    resident / 1048576.0, total / 1048576.0,
+                    streamedBytes / 1048576.0);
+        ImGui::Text("%zu textures, %zu samplers", textures.size(),
+                    samplers.size());
+
+        for (size_t textureId = 0; textureId < textures.size(); ++textureId) {
+            auto &texture = textures[textureId];
+            if (!texture.tex) continue;
+            const char *state = texture.isComplete() ? "resident"
+                                : texture.resident ? "streaming"
+                                                   : "placeholder";
+            auto &top = texture.levels[texture.levels.size()
+                                       - std::max<size_t>(texture.resident, 1)];
+            ImGui::Text("#%zu %s: %zu/%zu levels, %dx%d", textureId, state,
+                        texture.resident, texture.levels.size(),
+                        texture.resident ? top.width : 0,
+                        texture.resident ? top.height : 0);
+        }
+    }
+
+    void showUploadInfo() {
+        if (!loaded || !ImGui::CollapsingHeader("Uploads")) return;
+
+        ImGui::Text("Path: %s", ring.isActive() ? "staging ring" : "direct");
+        ImGui::Text("Buffers: %.1f MB in %.2f ms",
+                    uploadStats.bufferBytes / 1048576.0,
+                    uploadStats.bufferMillis);
+        ImGui::Text("Textures: %.1f MB in %.2f ms",
+                    uploadStats.textureBytes / 1048576.0,
+                    uploadStats.textureMillis);
+        ImGui::Text("Peak resident: %.1f MB", peakResidentBytes() / 1048576.0);
+        if (uploadStats.peakGpuBytes)
+            ImGui::Text("Peak video memory: %.1f MB",
+                        uploadStats.peakGpuBytes / 1048576.0);
+    }
+
+    // Draws every primitive into the G-buffer, culled and drawn by the GPU
+    // when it can, else through the sorted draw list or as a textured and
+    // then a flat walk over the nodes
+    void drawGBuffer(const glm::mat4 &matView, const glm::mat4 &matProj,
+                     const glm::mat4 &matModel) {
+        if (!loaded) return;
+        auto start = std::chrono::steady_clock::now();
+        meshletStats = {};
+        submittedTriangles = 0;
+        nodesPerLod.assign(MAX_LODS + 1, 0);
+        double cpuMillis = submitStats.cpuMillis;
+        submitStats = {};
+        // The GPU-driven pass applies matModel in its shaders, so there
+        // world matrices stay relative to it and a turning model moves
+        // no node
+        drewIndirect = indirectReady();
+        transformedNodes = transforms.update(
+            scene, drewIndirect ? glm::mat4(1.0f) : matModel);
+        boxesToWorld = drewIndirect ? matModel : glm::mat4(1.0f);
+        if (gpuDriven && indirect.instanceCount() > 0)
+            indirect.updateWorlds(transforms.worlds, transforms.movedNodes);
+        std::chrono::duration<double, std::milli> dt
+            = std::chrono::steady_clock::now() - start;
+        if (drewIndirect) {
+            drawIndirect(matView, matProj, matModel);
+            transformMillis = dt.count();
+            dt = std::chrono::steady_clock::now() - start;
+            submitStats.cpuMillis
+                = cpuMillis + 0.05 * (dt.count() - cpuMillis);
+            return;
+        }
+        nodeModelViews.resize(scene.nodeCount());
+        nodeNormals.resize(scene.nodeCount());
+        computeNodeMatrices(matView, transforms.worlds.data(),
+                            transforms.similar.data(), scene.nodeCount(),
+                            nodeModelViews.data(), nodeNormals.data());
+        dt = std::chrono::steady_clock::now() - start;
+        transformMillis = dt.count();
+        cullInstances(matProj * matView);
+
+        RaiiBindVao _bind(vao);
+        glUniform1i(uniformOctahedralNormals, scene.quantized);
+        glUniform1i(uniformInstanced, false);
+        nodeLods.resize(scene.nodeCount(), 0);
+        if (drawList) {
+            drawSorted(matProj);
+        } else {
+            drawPass(matProj, true);
+            drawPass(matProj, false);
+        }
+        dt = std::chrono::steady_clock::now() - start;
+        submitStats.cpuMillis = cpuMillis + 0.05 * (dt.count() - cpuMillis);
+    }
+
+    void setDrawList(bool enabled) { drawList = enabled; }
+
+    // Nodes sharing a primitive at the same LOD draw as instances of it,
+    // in the sorted draw list only
+    void setInstancing(bool enabled) { instancing = enabled; }
+
+    // Falls back to the CPU paths while a draw would have to bind its
+    // own texture, or the scene has primitives other than triangles
+    void setGpuDriven(bool enabled) {
+        if (enabled == gpuDriven) return;
+        gpuDriven = enabled;
+        // World matrices are only uploaded as they move while the mode is
+        // on. Before the first frame, the first update moves them all.
+        uint32_t nodes = transforms.worlds.size();
+        if (enabled && indirect.instanceCount() > 0 && nodes > 0)
+            indirect.updateWorlds(transforms.worlds, {{0, nodes}});
+    }
+
+    // Whether the last frame was culled and drawn by the GPU
+    bool drewGpuDriven() const noexcept { return drewIndirect; }
+
+    bool gpuDrivenSupported() const noexcept {
+        return loaded && indirect.instanceCount() > 0;
+    }
+
+    const SubmitStats &lastSubmitStats() const noexcept {
+        return submitStats;
+    }
+
+    // Off while vertices are displaced in the shader, which the bounds
+    // do not cover
+    void setMeshletCulling(bool enabled) { meshletCulling = enabled; }
+
+    // Same as for meshlets. Scenes of BVH_MIN_CULL_BOXES instances or more
+    // may cull through the BVH, to the same instances as the linear scan.
+    void setFrustumCulling(bool enabled, bool throughBvh) {
+        frustumCulling = enabled;
+        bvhCulling = throughBvh;
+    }
+
+    const CullStats &lastCullStats() const noexcept { return cullStats; }
+
+    // Node whose primitive bounds a world space ray enters first as of
+    // the last frame, -1 when it misses them all. After a GPU-driven frame
+    // the bounds are boxes below the model matrix, which fit tighter while
+    // it rotates.
+    int32_t pickNode(const glm::vec3 &origin, const glm::vec3 &dir) {
+        if (!loaded) return -1;
+        if (bvhStale) updateBvh();
+        glm::mat4 worldToBoxes = glm::inverse(boxesToWorld);
+        BvhHit hit = bvh.queryRay(
+            transforms.boxes, glm::vec3(worldToBoxes * glm::vec4(origin, 1.0f)),
+            glm::vec3(worldToBoxes * glm::vec4(dir, 0.0f)));
+        if (hit.item == UINT32_MAX) return -1;
+        return scene.instanceNodes[hit.item];
+    }
+
+    glm::mat4 nodeLocal(int32_t nodeId) const {
+        return scene.nodeLocals[nodeId];
+    }
+
+    // The next frame recomputes the node's subtree only
+    void setNodeLocal(int32_t nodeId, const glm::mat4 &local) {
+        transforms.setLocal(scene, nodeId, local);
+    }
+
+    // Nodes take the coarsest LOD whose error stays under thresholdPixels
+    // on a viewport viewportHeight pixels high
+    void setLodSelection(bool enabled, float thresholdPixels,
+                         int viewportHeight) {
+        lodSelection = enabled;
+        lodThreshold = thresholdPixels;
+        lodViewportHeight = viewportHeight;
+    }
+
+    // True once every texture of the load is resident
+    bool texturesStreamed() const noexcept { return streamingDone; }
+
+    bool hasLods() const noexcept { return loaded && !scene.lods.empty(); }
+
+    // Of the last frame, and how many nodes drew at every LOD
+    size_t submittedTriangleCount() const noexcept {
+        return submittedTriangles;
     }
 
-    void drawPassFlat(const glm::mat4 &matView, const glm::mat4 &matModel) {
-        auto &scene = model.scenes[model.defaultScene];
-        for (int nodeId : scene.nodes)
-            drawNode(matView, matModel, nodeId, false);
+    const std::vector<size_t> &lodNodeCounts() const noexcept {
+        return nodesPerLod;
     }
 
-    void drawPassTextured(const glm::mat4 &matView, const glm::mat4 &matModel) {
-        auto &scene = model.scenes[model.defaultScene];
-        for (int nodeId : scene.nodes)
-            drawNode(matView, matModel, nodeId, true);
+    // Of the last frame, world matrices recomputed and the time it took
+    // along with the view space matrices of all nodes
+    void showTransformInfo() const {
+        if (!loaded) return;
+        ImGui::Text("World matrices: %zu of %zu updated, %.3f ms with "
+                    "normal matrices",
+                    transformedNodes, scene.nodeCount(), transformMillis);
+    }
+
+    bool hasMeshlets() const noexcept {
+        return loaded && !scene.meshlets.empty();
+    }
+
+    const MeshletStats &lastMeshletStats() const noexcept {
+        return meshletStats;
     }
 
   private:
+    // A changed image being decoded again for texture slot
+    struct TextureReload {
+        size_t slot;
+        std::string file;
+        std::future<StreamedTexture> result;
+    };
+
+    // Everything below is owned by the loader thread until pollLoad()
+    // has joined it, except for the atomics
+    std::thread loader;
+    GLFWwindow *loaderWindow = nullptr;
+    std::atomic<bool> loadFenced = false;
+    std::atomic<LoadPhase> loadPhase = LoadPhase::Parsing;
+    GLsync loadFence = nullptr;
+    std::exception_ptr loadError;
+    std::chrono::steady_clock::time_point loadStart;
+    bool loaded = false;
+
+    // Only alive while loading
     tinygltf::Model model;
-    std::vector<GLuint> vaos;
-    std::vector<GLuint> buffers;
-    std::vector<GLuint> textures;
+    // Mapped buffers of model, only alive until geometry is built
+    GltfFile gltf;
+    Scene scene;
+    // Cached between frames, updated once per frame
+    WorldTransforms transforms;
+    size_t transformedNodes = 0;
+    double transformMillis = 0.0;
+    // Per node, recomputed every frame for the camera
+    std::vector<glm::mat4> nodeModelViews;
+    std::vector<glm::mat4> nodeNormals;
+    // Sorted each frame, scratch is the radix sort's other buffer
+    bool drawList = true;
+    std::vector<DrawPacket> packets;
+    std::vector<DrawPacket> packetScratch;
+    SubmitStats submitStats;
+    // Per primitive and LOD, the packet being filled with its instances
+    bool instancing = true;
+    std::vector<uint32_t> packetSlots;
+    // Of the packets with several instances, streamed every frame
+    std::vector<InstanceMatrices> instanceMatrices;
+    GLuint instanceMatrixBuffer = 0;
+    // Instances inside the frustum this frame, in node order
+    bool frustumCulling = true;
+    std::vector<uint32_t> visibleInstances;
+    // Over the instances' boxes, refit as transforms move them. The
+    // GPU-driven pass leaves the refit to the next pick or CPU frame.
+    Bvh bvh;
+    bool bvhStale = false;
+    // From the space of the boxes to world space, matModel after a
+    // GPU-driven frame
+    glm::mat4 boxesToWorld{1.0f};
+    bool bvhCulling = true;
+    CullStats cullStats;
+    // Instances, world matrices and draw commands on the GPU, empty when
+    // the scene cannot be drawn that way
+    IndirectScene indirect;
+    bool gpuDriven = false;
+    bool drewIndirect = false;
+    // All static geometry, drawn through one vertex array
+    GLuint vao = 0;
+    GLuint vertexBuffer = 0;
+    GLuint indexBuffer = 0;
+    // Only alive while loading, drawing uses the copy in scene
+    Geometry geometry;
+    // One per distinct image, shared by all glTF textures showing it
+    std::vector<StreamedTexture> textures;
+    // Per texture, how its mips were filtered, for reloads to match
+    std::vector<ImageUsage> textureUsages;
+    MipFilter mipFilter = MipFilter::Box;
+    // Per glTF texture, only alive while loading
+    std::vector<TextureBinding> textureBindings;
+    // Distinct states of the glTF samplers and their sampler objects
+    std::vector<SamplerState> samplerStates;
+    std::vector<GLuint> samplers;
+    // Image files to the texture slot only they show, and the glTF, its
+    // buffers and images sharing a slot, whose changes need a full reload
+    std::map<std::string, size_t> textureFiles;
+    std::vector<std::string> modelFiles;
+    // Decodes in flight in order of the changes, then textures streaming
+    // in for replacementSlots while the old ones are still drawn
+    std::vector<TextureReload> reloads;
+    std::vector<StreamedTexture> replacements;
+    std::vector<size_t> replacementSlots;
+    // Rebuilt from the complete textures whenever they or the path change
+    MaterialTextures materialTextures;
+    TexturePath texturePath = TexturePath::Binds;
+    bool materialsDirty = false;
+    size_t textureBinds = 0;
+    bool meshletCulling = true;
+    MeshletStats meshletStats;
+    bool lodSelection = true;
+    float lodThreshold = 1.0f;
+    int lodViewportHeight = 1;
+    // Per node, the LOD drawn last, which selection moves away from
+    // only past the hysteresis band
+    std::vector<uint32_t> nodeLods;
+    size_t submittedTriangles = 0;
+    std::vector<size_t> nodesPerLod;
+    // Surviving index ranges of a primitive, for one multi-draw
+    std::vector<GLsizei> rangeCounts;
+    std::vector<const void *> rangeOffsets;
+    std::vector<GLint> rangeBaseVertices;
+    GLuint placeholder = 0;
+    TextureStreamer streamer;
+    bool streamingDone = false;
+    size_t streamedBytes = 0;
+    StagingRing ring;
+    UploadStats uploadStats;
+    // Keeps cached texels mapped until they are streamed
+    MappedFile cacheFile;
+    // Per image, levels of a matching KTX2 file or nothing
+    std::vector<Ktx2Texture> compressedImages;
+    std::vector<uint64_t> imageHashes;
+    // Per image, the first image with the same encoded bytes
+    std::vector<int> canonicalImages;
+    std::vector<MappedFile> ktxFiles;
+
+    // Encoded image as handed over by tinygltf, decoded after parsing
+    struct PendingImage {
+        int imageId = -1;
+        int reqWidth = 0;
+        int reqHeight = 0;
+        std::vector<unsigned char> bytes;
+    };
+
+    // Names an image in the startup trace
+    static std::string imageName(const tinygltf::Image &img) {
+        return img.uri.empty() ? img.name : img.uri;
+    }
+
+    static bool deferImageData(tinygltf::Image *, const int imageId,
+                               std::string *, std::string *, int reqWidth,
+                               int reqHeight, const unsigned char *bytes,
+                               int size, void *userData) {
+        auto &pending = *static_cast<std::vector<PendingImage> *>(userData);
+        pending.push_back({imageId, reqWidth, reqHeight,
+                           std::vector<unsigned char>(bytes, bytes + size)});
+        return true;
+    }
 
-    void loadModel(const std::string &path) {
+    void loadModel(const std::string &path, const LoadOptions &options,
+                   bool compress) {
         std::string err;
         std::string warn;
-        tinygltf::TinyGLTF loader;
-        bool ret = loader.LoadASCIIFromFile(&model, &err, &warn, path);
+        std::vector<PendingImage> pending;
+        bool ret;
+        {
+            TraceScope _trace("parse", path);
+            ret = gltf.load(model, path, err, warn, deferImageData, &pending);
+            for (auto &buffer : gltf.buffers) _trace.addBytes(buffer.size);
+        }
+        if (ret) deduplicateImages(pending);
+        loadPhase = LoadPhase::Decoding;
+        if (ret && compress) loadCompressedImages(path, pending);
+        if (ret && !pending.empty())
+            ret = decodeImages(pending, err, options.parallelDecode);
 
         std::cout << "Warnings: " << warn << "\nErrors: " << err << '\n';
 
         if (!ret) throw std::runtime_error("Could not load model");
+        for (auto &extension : model.extensionsRequired) {
+            if (!isSupportedExtension(extension))
+                std::cerr << "Unsupported required extension " << extension
+                          << '\n';
+        }
+    }
+
+    // Hashes the encoded images and drops those identical to an earlier
+    // one, which are then neither decoded nor uploaded a second time
+    void deduplicateImages(std::vector<PendingImage> &pending) {
+        imageHashes.assign(model.images.size(), 0);
+        canonicalImages.resize(model.images.size());
+        for (int imageId = 0; imageId < model.images.size(); ++imageId)
+            canonicalImages[imageId] = imageId;
+        parallelFor(pending.size(), [&](size_t i) {
+            auto &item = pending[i];
+            imageHashes[item.imageId]
+                = hashBytes(item.bytes.data(), item.bytes.size());
+        });
+
+        std::unordered_map<uint64_t, size_t> seen;
+        std::vector<PendingImage> unique;
+        for (auto &item : pending) {
+            auto [it, inserted]
+                = seen.emplace(imageHashes[item.imageId], unique.size());
+            if (!inserted && unique[it->second].bytes == item.bytes) {
+                canonicalImages[item.imageId] = unique[it->second].imageId;
+                continue;
+            }
+            unique.push_back(std::move(item));
+        }
+        if (unique.size() < pending.size())
+            std::cout << "Skipping " << pending.size() - unique.size()
+                      << " duplicate images\n";
+        pending = std::move(unique);
+    }
+
+    // Takes KTX2 files written for exactly these image bytes,
+    // whose images then need not be decoded at all
+    void loadCompressedImages(const std::string &path,
+                              std::vector<PendingImage> &pending) {
+        compressedImages.assign(model.images.size(), {});
+
+        std::vector<PendingImage> rest;
+        for (auto &item : pending) {
+            auto &img = model.images[item.imageId];
+            MappedFile file;
+            Ktx2Texture ktx;
+            if (file.open(ktx2PathFor(path, img, item.imageId))
+                && readKtx2(file, ktx)
+                && ktx2MatchesSource(ktx, imageHashes[item.imageId])) {
+                compressedImages[item.imageId] = std::move(ktx);
+                ktxFiles.push_back(std::move(file));
+            } else {
+                rest.push_back(std::move(item));
+            }
+        }
+        std::cout << "Using " << ktxFiles.size()
+                  << " compressed images, decoding " << rest.size() << '\n';
+        pending = std::move(rest);
+    }
+
+    // Runs the very same stb_image path as tinygltf's default loader,
+    // so the decoded images are identical to the serial ones
+    bool decodeImages(const std::vector<PendingImage> &pending,
+                      std::string &err, bool parallel) {
+        using Clock = std::chrono::steady_clock;
+        TraceScope _trace("decode");
+        std::vector<std::string> errors(pending.size());
+        std::vector<double> millis(pending.size(), 0.0);
+
+        auto start = Clock::now();
+        auto decode = [&](size_t i) {
+            auto &item = pending[i];
+            auto &img = model.images[item.imageId];
+            auto imgStart = Clock::now();
+            tinygltf::LoadImageData(&img, item.imageId, &errors[i], nullptr,
+                                    item.reqWidth, item.reqHeight,
+                                    item.bytes.data(),
+                                    static_cast<int>(item.bytes.size()),
+                                    nullptr);
+            std::chrono::duration<double, std::milli> dt
+                = Clock::now() - imgStart;
+            millis[i] = dt.count();
+            startupTrace.record({"decode_image", imageName(img), dt.count(),
+                                 img.image.size()});
+        };
+        if (parallel) {
+            parallelFor(pending.size(), decode);
+        } else {
+            for (size_t i = 0; i < pending.size(); ++i) decode(i);
+        }
+        std::chrono::duration<double, std::milli> total = Clock::now() - start;
+
+        double sum = 0.0;
+        for (size_t i = 0; i < pending.size(); ++i) {
+            auto &img = model.images[pending[i].imageId];
+            std::cout << "Decoded image " << pending[i].imageId << " \""
+                      << img.name << "\" " << img.width << 'x' << img.height
+                      << " in " << millis[i] << " ms\n";
+            sum += millis[i];
+            err += errors[i];
+        }
+        std::cout << "Decoded " << pending.size() << " images in "
+                  << total.count() << " ms (" << sum << " ms of work on "
+                  << (parallel ? workerCount() : 1) << " threads)\n";
+
+        for (auto &error : errors)
+            if (!error.empty()) return false;
+        return true;
     }
 
-    void createBuffersAndTextures(const std::vector<bool> &nodeUsed) {
-        std::vector<bool> bufUsed(model.bufferViews.size(), false);
+    void createBuffersAndTextures(const std::vector<bool> &nodeUsed,
+                                  const std::string &path,
+                                  const LoadOptions &options, bool compress) {
+        std::vector<bool> meshUsed(model.meshes.size(), false);
         std::vector<bool> texUsed(model.textures.size(), false);
 
         for (int nodeId = 0; nodeId < model.nodes.size(); ++nodeId) {
             if (!nodeUsed[nodeId]) continue;
 
             auto &node = model.nodes[nodeId];
-            if (0 > node.mesh || node.mesh > model.meshes.size()) continue;
+            if (0 > node.mesh || node.mesh >= model.meshes.size()) continue;
+            meshUsed[node.mesh] = true;
 
             auto &mesh = model.meshes[node.mesh];
             for (auto &prim : mesh.primitives) {
-                auto &idxAcc = model.accessors[prim.indices];
-                if (idxAcc.ByteStride(model.bufferViews[idxAcc.bufferView])
-                    != tinygltf::GetComponentSizeInBytes(
-                        idxAcc.componentType)) {
-                    throw std::runtime_error(
-                        "Index buffer is not tightly packed");
-                }
-                bufUsed[idxAcc.bufferView] = true;
-
-                for (auto &[name, accessorId] : prim.attributes) {
-                    auto &accessor = model.accessors[accessorId];
-                    bufUsed[accessor.bufferView] = true;
-                }
-
                 auto &material = model.materials[prim.material];
                 auto &pbr = material.pbrMetallicRoughness;
                 auto &texInfo = pbr.baseColorTexture;
@@ -194,185 +966,1434 @@ struct Model {
             }
         }
 
-        buffers.resize(model.bufferViews.size(), 0);
-        for (int bufferViewId = 0; bufferViewId < model.bufferViews.size();
-             ++bufferViewId) {
-            auto &bufferView = model.bufferViews[bufferViewId];
-            if (!bufUsed[bufferViewId]) continue;
-            if (bufferView.target == 0) continue;
+        loadPhase = LoadPhase::Geometry;
+        {
+            TraceScope _trace("geometry");
+            geometry = buildGeometry(model, gltf.buffers, meshUsed);
+            _trace.addBytes(geometry.vertexBytes() + geometry.indices.size());
+        }
+        // Vertex data was read straight from the mapped files, which are
+        // not needed anymore
+        gltf.clear();
+        if (options.optimizeMeshes) optimizeGeometry();
+        if (options.buildMeshlets) buildMeshlets();
+        if (options.buildLods) buildLods();
+        if (options.quantizeVertices) quantizeVertices();
+        uploadGeometry(geometry.vertexData(), geometry.vertexBytes(),
+                       geometry.indices.data(), geometry.indices.size());
+
+        loadPhase = LoadPhase::Textures;
+        // One GL texture per distinct image and one sampler per distinct
+        // sampler state, however many glTF textures refer to them
+        textureBindings.assign(model.textures.size(), {});
+        std::vector<int> slotImages;
+        std::vector<int32_t> imageSlots(model.images.size(), -1);
+        size_t usedCount = 0;
+        for (int textureId = 0; textureId < model.textures.size();
+             ++textureId) {
+            auto &gltfTexture = model.textures[textureId];
+            if (!texUsed[textureId] || gltfTexture.source < 0
+                || gltfTexture.source >= model.images.size())
+                continue;
+            int imageId = canonicalImages[gltfTexture.source];
+            if (imageSlots[imageId] < 0) {
+                imageSlots[imageId] = slotImages.size();
+                slotImages.push_back(imageId);
+            }
+            auto &binding = textureBindings[textureId];
+            binding.texture = imageSlots[imageId];
+            binding.sampler = addSampler(gltfTexture.sampler);
+            ++usedCount;
+        }
+        std::cout << usedCount << " textures use " << slotImages.size()
+                  << " distinct images and " << samplerStates.size()
+                  << " distinct samplers\n";
+        // A slot that distinct files with the same bytes share reloads with
+        // the model, which splits it again if the files now differ
+        std::map<std::string, int32_t> fileSlots;
+        std::vector<size_t> slotFileCounts(slotImages.size());
+        for (int imageId = 0; imageId < model.images.size(); ++imageId) {
+            auto file = uriPath(path, model.images[imageId].uri);
+            int32_t slot = imageSlots[canonicalImages[imageId]];
+            if (!file.empty() && slot >= 0
+                && fileSlots.emplace(file, slot).second)
+                ++slotFileCounts[slot];
+        }
+        for (auto &[file, slot] : fileSlots) {
+            if (slotFileCounts[slot] == 1)
+                textureFiles[file] = slot;
+            else if (std::find(modelFiles.begin(), modelFiles.end(), file)
+                     == modelFiles.end())
+                modelFiles.push_back(file);
+        }
 
-            auto &buffer = model.buffers[bufferView.buffer];
-            GLuint vbo = 0;
-            glGenBuffers(1, &vbo);
-            buffers[bufferViewId] = vbo;
+        // Images are spread over the cores. A lone image, as on reloads,
+        // spreads the rows of its levels instead.
+        auto usages = classifyImages(model);
+        textures.resize(slotImages.size());
+        textureUsages.resize(slotImages.size());
+        auto mipStart = std::chrono::steady_clock::now();
+        std::atomic<size_t> mipmapped = 0;
+        parallelFor(slotImages.size(), [&](size_t slot) {
+            int imageId = slotImages[slot];
+            auto &texture = textures[slot];
+            textureUsages[slot] = usages[imageId];
+            if (!compressedImages.empty()
+                && !compressedImages[imageId].levels.empty()) {
+                auto &ktx = compressedImages[imageId];
+                texture.format = glBcFormat(ktx.format);
+                texture.levels = ktx.levels;
+                return;
+            }
 
-            RaiiBindBuffer _bind(bufferView.target, vbo);
-            glBufferData(bufferView.target, bufferView.byteLength,
-                         buffer.data.data() + bufferView.byteOffset,
-                         GL_STATIC_DRAW);
+            auto &img = model.images[imageId];
+            TraceScope _trace("mip_image", imageName(img));
+            fillTexture(texture, img, usages[imageId], options.mipFilter);
+            _trace.addBytes(texture.texels.size());
+            ++mipmapped;
+        });
+        if (mipmapped > 0) {
+            std::chrono::duration<double, std::milli> dt
+                = std::chrono::steady_clock::now() - mipStart;
+            startupTrace.record({"mips", {}, dt.count(), 0});
+            std::cout << "Built " << MIP_FILTER_NAMES[int(options.mipFilter)]
+                      << " filtered mips of " << mipmapped << " images in "
+                      << dt.count() << " ms\n";
+            if (options.compareDriverMipmaps) timeDriverMipmaps();
         }
 
-        textures.resize(model.textures.size(), 0);
-        for (int textureId = 0; textureId < model.textures.size();
-             ++textureId) {
-            auto &texture = model.textures[textureId];
-            if (!texUsed[textureId]) continue;
+        // First load with compression: write KTX2 files for next time.
+        // Levels are compressed in parallel, so images go one by one.
+        if (compress) {
+            for (size_t slot = 0; slot < slotImages.size(); ++slot) {
+                auto &texture = textures[slot];
+                if (texture.format != GL_RGBA8) continue;
+
+                int imageId = slotImages[slot];
+                auto &img = model.images[imageId];
+                TraceScope _trace("compress", imageName(img));
+                BcFormat format
+                    = chooseBcFormat(usages[imageId], texture.levels[0]);
+                auto levels = compressLevels(format, texture.levels);
+                // The file only spares the next load compressing again
+                auto ktxPath = ktx2PathFor(path, img, imageId);
+                try {
+                    writeCompressedKtx2(ktxPath, format, texture.levels,
+                                        levels, imageHashes[imageId]);
+                } catch (const std::exception &e) {
+                    std::cout << "Could not write " << ktxPath << ": "
+                              << e.what() << '\n';
+                }
+
+                size_t total = 0;
+                for (auto &level : levels) total += level.size();
+                texture.texels.resize(total);
+                size_t offset = 0;
+                for (size_t i = 0; i < levels.size(); ++i) {
+                    std::memcpy(texture.texels.data() + offset,
+                                levels[i].data(), levels[i].size());
+                    texture.levels[i].data = texture.texels.data() + offset;
+                    texture.levels[i].size = levels[i].size();
+                    offset += levels[i].size();
+                }
+                texture.format = glBcFormat(format);
+                _trace.addBytes(total);
+                std::cout << "Compressed image " << imageId << " \""
+                          << img.name << "\"\n";
+            }
+        }
+        compressedImages.clear();
+    }
 
+    // Mips of the RGBA8 textures generated by the driver instead, from the
+    // top levels just built. Includes uploading them, which the CPU path
+    // pays later while streaming.
+    void timeDriverMipmaps() {
+        glFinish();
+        TraceScope _trace("driver_mips");
+        auto start = std::chrono::steady_clock::now();
+        size_t count = 0;
+        for (auto &texture : textures) {
+            if (texture.format != GL_RGBA8) continue;
+            auto &top = texture.levels[0];
             GLuint tex = 0;
             glGenTextures(1, &tex);
-            textures[textureId] = tex;
-
             RaiiBindTexture _bind(GL_TEXTURE_2D, tex);
+            glTexStorage2D(GL_TEXTURE_2D, texture.levels.size(), GL_RGBA8,
+                           top.width, top.height);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, top.width, top.height,
+                            GL_RGBA, GL_UNSIGNED_BYTE, top.data);
+            glGenerateMipmap(GL_TEXTURE_2D);
+            glFinish();
+            glDeleteTextures(1, &tex);
+            ++count;
+        }
+        std::chrono::duration<double, std::milli> dt
+            = std::chrono::steady_clock::now() - start;
+        std::cout << "glGenerateMipmap on " << count << " images took "
+                  << dt.count() << " ms\n";
+    }
 
-            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-            auto &img = model.images[texture.source];
-            GLenum format = 0;
-            switch (img.component) {
-            case 1: format = GL_RED; break;
-            case 2: format = GL_RG; break;
-            case 3: format = GL_RGB; break;
-            case 4: format = GL_RGBA; break;
-            default:
-                throw std::runtime_error("Unexpected number of components");
-            }
-
-            GLenum type = 0;
-            switch (img.pixel_type) {
-            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
-                type = GL_UNSIGNED_BYTE;
-                break;
-            case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
-                type = GL_UNSIGNED_SHORT;
+    // Full RGBA8 chain of a decoded image
+    static void fillTexture(StreamedTexture &texture,
+                            const tinygltf::Image &img, ImageUsage usage,
+                            MipFilter filter) {
+        if (img.component < 1 || img.component > 4)
+            throw std::runtime_error("Unexpected number of components");
+        if (img.pixel_type != TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE
+            && img.pixel_type != TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT)
+            throw std::runtime_error("Unsupported image format");
+
+        auto rgba = toRgba8(img.image.data(), img.width, img.height,
+                            img.component, img.bits);
+        texture.levels = buildMipChain(texture.texels, rgba.data(),
+                                       img.width, img.height, usage, filter);
+    }
+
+    // Runs on a reload's own thread
+    static StreamedTexture decodeTextureFile(const std::string &file,
+                                             ImageUsage usage,
+                                             MipFilter filter) {
+        MappedFile bytes;
+        if (!bytes.open(file))
+            throw std::runtime_error("Could not read " + file);
+        tinygltf::Image img;
+        std::string err;
+        if (!tinygltf::LoadImageData(&img, 0, &err, nullptr, 0, 0,
+                                     bytes.data(),
+                                     static_cast<int>(bytes.size()), nullptr))
+            throw std::runtime_error(err);
+        StreamedTexture texture;
+        fillTexture(texture, img, usage, filter);
+        return texture;
+    }
+
+    // Takes over finished decodes in the order the changes came in, and
+    // streams them under the budget. A replacement is swapped in at the
+    // start of the frame after its last level went up, so a texture
+    // never shows partially reloaded.
+    size_t streamReloads(size_t budget) {
+        while (!reloads.empty()) {
+            auto &reload = reloads.front();
+            if (reload.result.wait_for(std::chrono::seconds(0))
+                != std::future_status::ready)
                 break;
-            default: throw std::runtime_error("Unsupported image format");
+            try {
+                auto texture = reload.result.get();
+                texture.allocate();
+                auto it = std::find(replacementSlots.begin(),
+                                    replacementSlots.end(), reload.slot);
+                if (it != replacementSlots.end()) {
+                    // Superseded before it finished streaming
+                    auto &stale = replacements[it - replacementSlots.begin()];
+                    glDeleteTextures(1, &stale.tex);
+                    stale = std::move(texture);
+                } else {
+                    replacements.push_back(std::move(texture));
+                    replacementSlots.push_back(reload.slot);
+                }
+            } catch (const std::exception &e) {
+                std::cout << "Could not reload " << reload.file << ": "
+                          << e.what() << '\n';
             }
+            reloads.erase(reloads.begin());
+        }
 
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, img.width, img.height, 0,
-                         format, type, img.image.data());
-            glGenerateMipmap(GL_TEXTURE_2D);
+        for (size_t i = 0; i < replacements.size();) {
+            auto &texture = replacements[i];
+            if (!texture.isComplete()) {
+                ++i;
+                continue;
+            }
+            auto &current = textures[replacementSlots[i]];
+            // Handles and array copies of the old texture go first
+            materialTextures.clear();
+            materialsDirty = true;
+            glDeleteTextures(1, &current.tex);
+            texture.releaseTexels();
+            current = std::move(texture);
+            replacements.erase(replacements.begin() + i);
+            replacementSlots.erase(replacementSlots.begin() + i);
         }
+        if (replacements.empty()) return 0;
+
+        size_t uploaded = streamer.stream(replacements, budget,
+                                          ring.isActive() ? &ring : nullptr);
+        uploadStats.textureBytes += uploaded;
+        streamedBytes += uploaded;
+        return uploaded;
     }
 
-    void findUsedNodes(std::vector<bool> &visited, int nodeId) {
-        if (visited[nodeId]) return;
-        visited[nodeId] = true;
+    // File a buffer or image URI refers to, empty for embedded data
+    static std::string uriPath(const std::string &gltfPath,
+                               const std::string &uri) {
+        if (uri.empty() || tinygltf::IsDataURI(uri)) return {};
+        std::string decoded;
+        tinygltf::URIDecode(uri, &decoded, nullptr);
+        auto dir = std::filesystem::path(gltfPath).parent_path();
+        return (dir / decoded).string();
+    }
 
-        auto &node = model.nodes[nodeId];
-        for (int nodeId : node.children) findUsedNodes(visited, nodeId);
+    // Index of the sampler state of a glTF sampler, added when new
+    int32_t addSampler(int samplerId) {
+        SamplerState state;
+        if (0 <= samplerId && samplerId < model.samplers.size()) {
+            auto &sampler = model.samplers[samplerId];
+            state = SamplerState(sampler.minFilter, sampler.magFilter,
+                                 sampler.wrapS, sampler.wrapT);
+        }
+        auto it = std::find(samplerStates.begin(), samplerStates.end(), state);
+        if (it != samplerStates.end()) return it - samplerStates.begin();
+        samplerStates.push_back(state);
+        return samplerStates.size() - 1;
     }
 
-    void bindMesh(int meshId) {
-        GLuint vao = 0;
-        glGenVertexArrays(1, &vao);
-        vaos[meshId] = vao;
+    static constexpr size_t STAGING_RING_SIZE = size_t(32) << 20;
+
+    static GLuint createBuffer(GLenum target, size_t size, const void *data) {
+        GLuint vbo = 0;
+        glGenBuffers(1, &vbo);
+        RaiiBindBuffer _bind(target, vbo);
+        glBufferData(target, size, data, GL_STATIC_DRAW);
+        return vbo;
+    }
+
+    // Staged copies are only issued by finishBufferUploads()
+    GLuint uploadBuffer(GLenum target, size_t size, const void *data) {
+        TraceScope _trace("buffer_upload", {}, size);
+        auto start = std::chrono::steady_clock::now();
+        GLuint vbo = 0;
+        if (ring.isActive()) {
+            vbo = ring.createBuffer(size);
+            ring.uploadBuffer(vbo, 0, data, size);
+        } else {
+            vbo = createBuffer(target, size, data);
+        }
+        std::chrono::duration<double, std::milli> dt
+            = std::chrono::steady_clock::now() - start;
+        uploadStats.bufferMillis += dt.count();
+        uploadStats.bufferBytes += size;
+        return vbo;
+    }
+
+    void optimizeGeometry() {
+        TraceScope _trace("optimize");
+        struct Item {
+            int meshId;
+            size_t primId;
+            uint32_t drawId;
+            MeshOptStats stats;
+        };
+        std::vector<Item> items;
+        for (int meshId = 0; meshId < model.meshes.size(); ++meshId) {
+            auto &mesh = model.meshes[meshId];
+            uint32_t first = geometry.meshFirstDraw[meshId];
+            uint32_t end = geometry.meshFirstDraw[meshId + 1];
+            for (uint32_t drawId = first; drawId < end; ++drawId) {
+                size_t primId = drawId - first;
+                if (mesh.primitives[primId].mode == TINYGLTF_MODE_TRIANGLES)
+                    items.push_back({meshId, primId, drawId, {}});
+            }
+        }
+
+        parallelFor(items.size(), [&](size_t i) {
+            auto &item = items[i];
+            item.stats = optimizeDraw(geometry, geometry.draws[item.drawId]);
+        });
+        geometry.optimized = true;
+
+        for (auto &item : items) {
+            auto &draw = geometry.draws[item.drawId];
+            std::cout << "Optimized \"" << model.meshes[item.meshId].name
+                      << "\" #" << item.primId << " (" << draw.vertexCount
+                      << " vertices, " << draw.indexCount / 3
+                      << " triangles): ACMR " << item.stats.acmrBefore
+                      << " -> " << item.stats.acmrAfter << " in "
+                      << item.stats.millis << " ms\n";
+        }
+    }
+
+    // Bounds are taken from the float positions, before quantization
+    void buildMeshlets() {
+        TraceScope _trace("meshlets");
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::vector<Meshlet>> perDraw(geometry.draws.size());
+        std::vector<uint32_t> drawIds;
+        for (int meshId = 0; meshId < model.meshes.size(); ++meshId) {
+            auto &mesh = model.meshes[meshId];
+            uint32_t first = geometry.meshFirstDraw[meshId];
+            uint32_t end = geometry.meshFirstDraw[meshId + 1];
+            for (uint32_t drawId = first; drawId < end; ++drawId) {
+                if (mesh.primitives[drawId - first].mode
+                    == TINYGLTF_MODE_TRIANGLES)
+                    drawIds.push_back(drawId);
+            }
+        }
+        parallelFor(drawIds.size(), [&](size_t i) {
+            uint32_t drawId = drawIds[i];
+            perDraw[drawId]
+                = buildDrawMeshlets(geometry, geometry.draws[drawId]);
+        });
+
+        geometry.meshlets.clear();
+        geometry.drawFirstMeshlet = {0};
+        size_t triangles = 0;
+        for (auto &meshlets : perDraw) {
+            geometry.meshlets.insert(geometry.meshlets.end(),
+                                     meshlets.begin(), meshlets.end());
+            geometry.drawFirstMeshlet.push_back(geometry.meshlets.size());
+            for (auto &meshlet : meshlets) triangles += meshlet.indexCount / 3;
+        }
+        std::chrono::duration<double, std::milli> dt
+            = std::chrono::steady_clock::now() - start;
+        std::cout << "Built " << geometry.meshlets.size() << " meshlets of "
+                  << triangles << " triangles in " << dt.count() << " ms\n";
+    }
+
+    // Appends the LOD indices after the full ones, so meshlet ranges stay
+    // valid. Bounds come from the float positions like the meshlets'.
+    void buildLods() {
+        TraceScope _trace("lods");
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::vector<DrawLod>> perDraw(geometry.draws.size());
+        std::vector<uint32_t> drawIds;
+        for (int meshId = 0; meshId < model.meshes.size(); ++meshId) {
+            auto &mesh = model.meshes[meshId];
+            uint32_t first = geometry.meshFirstDraw[meshId];
+            uint32_t end = geometry.meshFirstDraw[meshId + 1];
+            for (uint32_t drawId = first; drawId < end; ++drawId) {
+                if (mesh.primitives[drawId - first].mode
+                    == TINYGLTF_MODE_TRIANGLES)
+                    drawIds.push_back(drawId);
+            }
+        }
+        parallelFor(drawIds.size(), [&](size_t i) {
+            uint32_t drawId = drawIds[i];
+            perDraw[drawId]
+                = buildDrawLods(geometry, geometry.draws[drawId]);
+        });
+
+        size_t indexSize = geometry.indexSize();
+        geometry.lods.clear();
+        geometry.drawFirstLod = {0};
+        size_t full = 0, coarsest = 0;
+        for (size_t drawId = 0; drawId < perDraw.size(); ++drawId) {
+            size_t triangles = geometry.draws[drawId].indexCount / 3;
+            full += triangles;
+            for (auto &lod : perDraw[drawId]) {
+                GeometryLod range;
+                range.firstIndex = geometry.indices.size() / indexSize;
+                range.indexCount = lod.indices.size();
+                range.error = lod.error;
+                size_t offset = geometry.indices.size();
+                geometry.indices.resize(offset
+                                        + lod.indices.size() * indexSize);
+                auto dst = geometry.indices.data() + offset;
+                for (size_t i = 0; i < lod.indices.size(); ++i) {
+                    if (indexSize == 2) {
+                        uint16_t index = lod.indices[i];
+                        std::memcpy(dst + 2 * i, &index, 2);
+                    } else {
+                        std::memcpy(dst + 4 * i, &lod.indices[i], 4);
+                    }
+                }
+                geometry.lods.push_back(range);
+                triangles = lod.indices.size() / 3;
+            }
+            coarsest += triangles;
+            geometry.drawFirstLod.push_back(geometry.lods.size());
+        }
 
+        geometry.meshBounds.assign(model.meshes.size(), glm::vec4(0.0f));
+        for (int meshId = 0; meshId < model.meshes.size(); ++meshId) {
+            uint32_t first = geometry.meshFirstDraw[meshId];
+            uint32_t end = geometry.meshFirstDraw[meshId + 1];
+            glm::vec3 lo(INFINITY), hi(-INFINITY);
+            for (uint32_t drawId = first; drawId < end; ++drawId) {
+                auto &draw = geometry.draws[drawId];
+                for (uint32_t v = 0; v < draw.vertexCount; ++v) {
+                    auto &vertex = geometry.vertices[draw.baseVertex + v];
+                    lo = glm::min(lo, vertex.position);
+                    hi = glm::max(hi, vertex.position);
+                }
+            }
+            if (first == end) continue;
+            glm::vec3 center = 0.5f * (lo + hi);
+            geometry.meshBounds[meshId]
+                = glm::vec4(center, glm::distance(center, hi));
+        }
+
+        std::chrono::duration<double, std::milli> dt
+            = std::chrono::steady_clock::now() - start;
+        std::cout << "Built " << geometry.lods.size() << " LODs, "
+                  << full << " triangles down to " << coarsest
+                  << " at the coarsest, in " << dt.count() << " ms\n";
+    }
+
+    void quantizeVertices() {
+        TraceScope _trace("quantize");
+        size_t before = geometry.vertexBytes();
+        auto errors = quantizeGeometry(geometry);
+        for (int meshId = 0; meshId < model.meshes.size(); ++meshId) {
+            uint32_t first = geometry.meshFirstDraw[meshId];
+            uint32_t end = geometry.meshFirstDraw[meshId + 1];
+            if (first == end) continue;
+            size_t vertexCount = 0;
+            for (uint32_t drawId = first; drawId < end; ++drawId)
+                vertexCount += geometry.draws[drawId].vertexCount;
+            auto &error = errors[meshId];
+            std::cout << "Quantized \"" << model.meshes[meshId].name << "\" ("
+                      << vertexCount << " vertices): position error "
+                      << error.position << " ("
+                      << 100.0f * error.positionRelative
+                      << "% of the bounds), normal " << error.normalDegrees
+                      << " deg, texcoord " << error.texCoord << '\n';
+        }
+        std::cout << "Quantized vertices from " << sizeof(Vertex) << " to "
+                  << sizeof(QuantizedVertex) << " bytes, "
+                  << before / 1048576.0 << " -> "
+                  << geometry.vertexBytes() / 1048576.0 << " MB\n";
+    }
+
+    void uploadGeometry(const void *vertices, size_t vertexBytes,
+                        const void *indices, size_t indexBytes) {
+        vertexBuffer = uploadBuffer(GL_ARRAY_BUFFER, vertexBytes, vertices);
+        indexBuffer = uploadBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBytes, indices);
+    }
+
+    // Runs on the render thread, whose context owns the vertex array
+    void finishLoading() {
+        createVertexArray();
+        if (IndirectScene::supports(scene)) {
+            RaiiBindVao _bind(vao);
+            indirect.build(scene);
+        }
+        loadPhase = LoadPhase::Done;
+        loaded = true;
+        std::chrono::duration<double, std::milli> dt
+            = std::chrono::steady_clock::now() - loadStart;
+        std::cout << "Model ready after " << dt.count() << " ms\n";
+    }
+
+    // Vertex arrays are not shared between contexts
+    void createVertexArray() {
+        glGenVertexArrays(1, &vao);
         RaiiBindVao _bind(vao);
+        auto attribute = [](GLuint index, GLint size, GLenum type,
+                            GLboolean normalized, size_t offset) {
+            glEnableVertexAttribArray(index);
+            glVertexAttribFormat(index, size, type, normalized, offset);
+            glVertexAttribBinding(index, 0);
+        };
+        if (scene.quantized) {
+            attribute(0, 3, GL_UNSIGNED_SHORT, GL_TRUE,
+                      offsetof(QuantizedVertex, position));
+            attribute(1, 2, GL_SHORT, GL_TRUE,
+                      offsetof(QuantizedVertex, normal));
+            attribute(2, 2, GL_HALF_FLOAT, GL_FALSE,
+                      offsetof(QuantizedVertex, texCoord));
+        } else {
+            attribute(0, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, position));
+            attribute(1, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, normal));
+            attribute(2, 2, GL_FLOAT, GL_FALSE, offsetof(Vertex, texCoord));
+        }
+        GLsizei stride
+            = scene.quantized ? sizeof(QuantizedVertex) : sizeof(Vertex);
+        glBindVertexBuffer(0, vertexBuffer, 0, stride);
+
+        // Columns of InstanceMatrices, one set per instance
+        for (GLuint column = 0; column < 8; ++column) {
+            GLuint index = 4 + column;
+            glEnableVertexAttribArray(index);
+            glVertexAttribFormat(index, 4, GL_FLOAT, GL_FALSE,
+                                 column * sizeof(glm::vec4));
+            glVertexAttribBinding(index, 2);
+        }
+        glVertexBindingDivisor(2, 1);
+        glGenBuffers(1, &instanceMatrixBuffer);
+        RaiiBindBuffer _bindBuffer(GL_ARRAY_BUFFER, instanceMatrixBuffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(InstanceMatrices), nullptr,
+                     GL_STREAM_DRAW);
+        glBindVertexBuffer(2, instanceMatrixBuffer, 0,
+                           sizeof(InstanceMatrices));
+        // Part of the vertex array's state, so it stays bound
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+    }
 
-        auto &mesh = model.meshes[meshId];
-
-        for (auto &prim : mesh.primitives) {
-            auto &idxAccessor = model.accessors[prim.indices];
-            for (auto &[name, accId] : prim.attributes) {
-                int vaa = -1;
-                if (name == "POSITION") {
-                    vaa = 0;
-                } else if (name == "NORMAL") {
-                    vaa = 1;
-                } else if (name == "TEXCOORD_0") {
-                    vaa = 2;
-                } else {
-                    std::cerr << "Unknown parameter " << name << '\n';
-                    continue;
+    // Waits for the GPU, so the time covers the driver's copies as well
+    void finishBufferUploads() {
+        TraceScope _trace("buffer_upload");
+        auto start = std::chrono::steady_clock::now();
+        if (ring.isActive()) ring.flush();
+        glFinish();
+        std::chrono::duration<double, std::milli> dt
+            = std::chrono::steady_clock::now() - start;
+        uploadStats.bufferMillis += dt.count();
+        uploadStats.sampleGpuMemory();
+        std::cout << "Uploaded " << uploadStats.bufferBytes / 1048576.0
+                  << " MB of buffers in " << uploadStats.bufferMillis
+                  << " ms " << (ring.isActive() ? "through the staging ring"
+                                                : "directly")
+                  << ", peak resident " << peakResidentBytes() / 1048576.0
+                  << " MB\n";
+    }
+
+    // Cache layout: header, source stamps and the scene description,
+    // then page-aligned blobs of merged geometry and texture levels,
+    // which are handed to GL directly from the mapped file.
+    static constexpr uint64_t CACHE_MAGIC = 0x31484341434d4748ull;
+    static constexpr uint32_t CACHE_VERSION = 12;
+    static constexpr size_t CACHE_BLOB_ALIGNMENT = 4096;
+
+    struct CacheSource {
+        std::string path;
+        FileStamp stamp;
+        uint64_t hash = 0;
+    };
+
+    std::vector<CacheSource> listSources(const std::string &path) const {
+        std::vector<std::string> paths = modelFiles;
+        for (auto &image : model.images) {
+            auto file = uriPath(path, image.uri);
+            if (!file.empty()
+                && std::find(paths.begin(), paths.end(), file) == paths.end())
+                paths.push_back(file);
+        }
+
+        std::vector<CacheSource> sources;
+        for (auto &sourcePath : paths) {
+            CacheSource source;
+            source.path = sourcePath;
+            if (!statFile(sourcePath, source.stamp)
+                || !hashFile(sourcePath, source.hash))
+                throw std::runtime_error("Could not read " + sourcePath);
+            sources.push_back(std::move(source));
+        }
+        return sources;
+    }
+
+    static bool sourceUnchanged(const CacheSource &source) {
+        FileStamp stamp;
+        if (!statFile(source.path, stamp)) return false;
+        if (stamp.size != source.stamp.size) return false;
+        if (stamp.mtime == source.stamp.mtime) return true;
+        // Touched but maybe not edited
+        uint64_t hash = 0;
+        return hashFile(source.path, hash) && hash == source.hash;
+    }
+
+    void saveCache(const std::string &path, const std::string &cachePath) {
+        TraceScope _trace("cache_save", cachePath);
+        BinaryWriter meta;
+        BinaryWriter blobs;
+        auto putBlob = [&](const void *data, size_t size) {
+            blobs.align(CACHE_BLOB_ALIGNMENT);
+            meta.put<uint64_t>(blobs.bytes.size());
+            meta.put<uint64_t>(size);
+            blobs.putBytes(data, size);
+        };
+
+        meta.put(CACHE_MAGIC);
+        meta.put(CACHE_VERSION);
+
+        auto sources = listSources(path);
+        meta.put<uint64_t>(sources.size());
+        for (auto &source : sources) {
+            meta.putString(source.path);
+            meta.put(source.stamp);
+            meta.put(source.hash);
+        }
+
+        meta.put<int32_t>(model.defaultScene);
+        meta.put<uint64_t>(model.scenes.size());
+        for (auto &scene : model.scenes) meta.putVector(scene.nodes);
+
+        meta.put<uint64_t>(model.nodes.size());
+        for (auto &node : model.nodes) {
+            meta.put<int32_t>(node.mesh);
+            meta.putVector(node.children);
+            meta.putVector(node.matrix);
+            meta.putVector(node.translation);
+            meta.putVector(node.rotation);
+            meta.putVector(node.scale);
+        }
+
+        meta.put<uint64_t>(model.meshes.size());
+        for (auto &mesh : model.meshes) {
+            meta.put<uint64_t>(mesh.primitives.size());
+            for (auto &prim : mesh.primitives) {
+                meta.put<int32_t>(prim.mode);
+                meta.put<int32_t>(prim.material);
+            }
+        }
+
+        meta.put<uint64_t>(model.materials.size());
+        for (auto &material : model.materials) {
+            auto &pbr = material.pbrMetallicRoughness;
+            meta.putVector(pbr.baseColorFactor);
+            meta.put<int32_t>(pbr.baseColorTexture.index);
+        }
+
+        meta.put<uint8_t>(uint8_t(mipFilter));
+        meta.put<uint64_t>(textures.size());
+        for (size_t slot = 0; slot < textures.size(); ++slot) {
+            auto &texture = textures[slot];
+            meta.put<uint32_t>(texture.format);
+            meta.put<uint8_t>(uint8_t(textureUsages[slot]));
+            meta.put<uint64_t>(texture.levels.size());
+            for (auto &level : texture.levels) {
+                meta.put<int32_t>(level.width);
+                meta.put<int32_t>(level.height);
+                putBlob(level.data, level.size);
+            }
+        }
+        meta.putVector(textureBindings);
+        meta.putVector(samplerStates);
+        meta.put<uint64_t>(modelFiles.size());
+        for (auto &file : modelFiles) meta.putString(file);
+        meta.put<uint64_t>(textureFiles.size());
+        for (auto &[file, slot] : textureFiles) {
+            meta.putString(file);
+            meta.put<uint64_t>(slot);
+        }
+
+        meta.put<uint32_t>(geometry.indexType);
+        meta.putVector(geometry.draws);
+        meta.putVector(geometry.meshFirstDraw);
+        meta.putVector(geometry.drawBounds);
+        meta.put<uint8_t>(geometry.optimized);
+        meta.put<uint8_t>(geometry.quantized);
+        meta.putVector(geometry.meshDequantization);
+        meta.putVector(geometry.meshlets);
+        meta.putVector(geometry.drawFirstMeshlet);
+        meta.putVector(geometry.lods);
+        meta.putVector(geometry.drawFirstLod);
+        meta.putVector(geometry.meshBounds);
+        putBlob(geometry.vertexData(), geometry.vertexBytes());
+        putBlob(geometry.indices.data(), geometry.indices.size());
+
+        BinaryWriter head;
+        head.put<uint64_t>(meta.bytes.size());
+        head.putBytes(meta.bytes.data(), meta.bytes.size());
+        head.align(CACHE_BLOB_ALIGNMENT);
+        writeFileAtomically(cachePath, head.bytes, blobs.bytes);
+        _trace.addBytes(head.bytes.size() + blobs.bytes.size());
+        std::cout << "Wrote " << cachePath << '\n';
+    }
+
+    bool loadCache(const std::string &path, const std::string &cachePath,
+                   const LoadOptions &options, bool compressed) {
+        MappedFile file;
+        if (!file.open(cachePath)) return false;
+        TraceScope _trace("cache_load", cachePath, file.size());
+
+        try {
+            BinaryReader head(file.data(), file.size());
+            uint64_t metaSize = head.get<uint64_t>();
+            size_t blobBase = (sizeof(uint64_t) + metaSize
+                               + CACHE_BLOB_ALIGNMENT - 1)
+                              / CACHE_BLOB_ALIGNMENT * CACHE_BLOB_ALIGNMENT;
+            if (metaSize > file.size() || blobBase > file.size())
+                throw std::runtime_error("Truncated cache file");
+
+            BinaryReader meta(file.data() + sizeof(uint64_t), metaSize);
+            auto getBlob = [&]() {
+                uint64_t offset = meta.get<uint64_t>();
+                uint64_t size = meta.get<uint64_t>();
+                if (offset > file.size() - blobBase
+                    || size > file.size() - blobBase - offset)
+                    throw std::runtime_error("Truncated cache file");
+                return std::make_pair(file.data() + blobBase + offset, size);
+            };
+
+            if (meta.get<uint64_t>() != CACHE_MAGIC
+                || meta.get<uint32_t>() != CACHE_VERSION)
+                return false;
+
+            size_t sourceCount = meta.get<uint64_t>();
+            for (size_t i = 0; i < sourceCount; ++i) {
+                CacheSource source;
+                source.path = meta.getString();
+                source.stamp = meta.get<FileStamp>();
+                source.hash = meta.get<uint64_t>();
+                if (i == 0 && source.path != path) return false;
+                if (!sourceUnchanged(source)) {
+                    std::cout << "Cache is stale: " << source.path
+                              << " changed\n";
+                    return false;
                 }
+            }
 
-                auto &accessor = model.accessors[accId];
+            tinygltf::Model cached;
+            cached.defaultScene = meta.get<int32_t>();
+            cached.scenes.resize(meta.get<uint64_t>());
+            for (auto &scene : cached.scenes)
+                scene.nodes = meta.getVector<int>();
+
+            cached.nodes.resize(meta.get<uint64_t>());
+            for (auto &node : cached.nodes) {
+                node.mesh = meta.get<int32_t>();
+                node.children = meta.getVector<int>();
+                node.matrix = meta.getVector<double>();
+                node.translation = meta.getVector<double>();
+                node.rotation = meta.getVector<double>();
+                node.scale = meta.getVector<double>();
+            }
 
-                int size = 1;
-                if (accessor.type != TINYGLTF_TYPE_SCALAR) {
-                    size = accessor.type;
+            cached.meshes.resize(meta.get<uint64_t>());
+            for (auto &mesh : cached.meshes) {
+                mesh.primitives.resize(meta.get<uint64_t>());
+                for (auto &prim : mesh.primitives) {
+                    prim.mode = meta.get<int32_t>();
+                    prim.material = meta.get<int32_t>();
                 }
+            }
+
+            cached.materials.resize(meta.get<uint64_t>());
+            for (auto &material : cached.materials) {
+                auto &pbr = material.pbrMetallicRoughness;
+                pbr.baseColorFactor = meta.getVector<double>();
+                pbr.baseColorTexture.index = meta.get<int32_t>();
+            }
 
-                int byteStride = accessor.ByteStride(
-                    model.bufferViews[accessor.bufferView]);
+            auto cachedFilter = MipFilter(meta.get<uint8_t>());
+            std::vector<StreamedTexture> cachedTextures(
+                meta.get<uint64_t>());
+            std::vector<ImageUsage> cachedUsages(cachedTextures.size());
+            for (size_t slot = 0; slot < cachedTextures.size(); ++slot) {
+                auto &texture = cachedTextures[slot];
+                texture.format = meta.get<uint32_t>();
+                if (texture.format != GL_RGBA8 && !compressed) {
+                    std::cout << "Cache holds compressed textures\n";
+                    return false;
+                }
+                if (texture.format == GL_RGBA8
+                    && cachedFilter != options.mipFilter) {
+                    std::cout << "Cache holds "
+                              << MIP_FILTER_NAMES[int(cachedFilter)]
+                              << " filtered mips\n";
+                    return false;
+                }
+                auto usage = meta.get<uint8_t>();
+                if (usage > uint8_t(ImageUsage::Orm))
+                    throw std::runtime_error("Corrupted cache file");
+                cachedUsages[slot] = ImageUsage(usage);
+                texture.levels.resize(meta.get<uint64_t>());
+                for (auto &level : texture.levels) {
+                    level.width = meta.get<int32_t>();
+                    level.height = meta.get<int32_t>();
+                    std::tie(level.data, level.size) = getBlob();
+                    if (level.size
+                        != levelBytes(texture.format, level.width,
+                                      level.height))
+                        throw std::runtime_error("Corrupted cache file");
+                }
+            }
+            auto cachedBindings = meta.getVector<TextureBinding>();
+            auto cachedSamplers = meta.getVector<SamplerState>();
+            for (auto &state : cachedSamplers)
+                state = SamplerState(state.minFilter, state.magFilter,
+                                     state.wrapS, state.wrapT);
+            for (auto &binding : cachedBindings) {
+                if (binding.texture >= int64_t(cachedTextures.size())
+                    || binding.sampler >= int64_t(cachedSamplers.size()))
+                    throw std::runtime_error("Corrupted cache file");
+            }
+            std::vector<std::string> cachedModelFiles(meta.get<uint64_t>());
+            for (auto &file : cachedModelFiles) file = meta.getString();
+            std::map<std::string, size_t> cachedTextureFiles;
+            size_t textureFileCount = meta.get<uint64_t>();
+            for (size_t i = 0; i < textureFileCount; ++i) {
+                auto file = meta.getString();
+                size_t slot = meta.get<uint64_t>();
+                if (slot >= cachedTextures.size())
+                    throw std::runtime_error("Corrupted cache file");
+                cachedTextureFiles[file] = slot;
+            }
 
-                glBindBuffer(GL_ARRAY_BUFFER, buffers[accessor.bufferView]);
-                glEnableVertexAttribArray(vaa);
-                glVertexAttribPointer(
-                    vaa, size, accessor.componentType,
-                    accessor.normalized ? GL_TRUE : GL_FALSE, byteStride,
-                    static_cast<char *>(nullptr) + accessor.byteOffset);
+            Geometry cachedGeometry;
+            cachedGeometry.indexType = meta.get<uint32_t>();
+            cachedGeometry.draws = meta.getVector<GeometryDraw>();
+            cachedGeometry.meshFirstDraw = meta.getVector<uint32_t>();
+            cachedGeometry.drawBounds = meta.getVector<GeometryBox>();
+            cachedGeometry.optimized = meta.get<uint8_t>();
+            cachedGeometry.quantized = meta.get<uint8_t>();
+            cachedGeometry.meshDequantization = meta.getVector<glm::mat4>();
+            cachedGeometry.meshlets = meta.getVector<Meshlet>();
+            cachedGeometry.drawFirstMeshlet = meta.getVector<uint32_t>();
+            cachedGeometry.lods = meta.getVector<GeometryLod>();
+            cachedGeometry.drawFirstLod = meta.getVector<uint32_t>();
+            cachedGeometry.meshBounds = meta.getVector<glm::vec4>();
+            if (options.optimizeMeshes && !cachedGeometry.optimized) {
+                std::cout << "Cache holds unoptimized meshes\n";
+                return false;
+            }
+            auto &drawFirstMeshlet = cachedGeometry.drawFirstMeshlet;
+            if (options.buildMeshlets && drawFirstMeshlet.empty()) {
+                std::cout << "Cache holds no meshlets\n";
+                return false;
+            }
+            auto &drawFirstLod = cachedGeometry.drawFirstLod;
+            if (options.buildLods && drawFirstLod.empty()) {
+                std::cout << "Cache holds no LODs\n";
+                return false;
+            }
+            if (options.quantizeVertices != cachedGeometry.quantized) {
+                std::cout << "Cache holds "
+                          << (cachedGeometry.quantized ? "quantized" : "float")
+                          << " vertices\n";
+                return false;
+            }
+            auto &meshFirstDraw = cachedGeometry.meshFirstDraw;
+            if ((cachedGeometry.indexType != GL_UNSIGNED_SHORT
+                 && cachedGeometry.indexType != GL_UNSIGNED_INT)
+                || meshFirstDraw.size() != cached.meshes.size() + 1
+                || meshFirstDraw.back() != cachedGeometry.draws.size()
+                || cachedGeometry.drawBounds.size()
+                       != cachedGeometry.draws.size()
+                || (cachedGeometry.quantized
+                    && cachedGeometry.meshDequantization.size()
+                           != cached.meshes.size())
+                || (!drawFirstMeshlet.empty()
+                    && (drawFirstMeshlet.size()
+                            != cachedGeometry.draws.size() + 1
+                        || !std::is_sorted(drawFirstMeshlet.begin(),
+                                           drawFirstMeshlet.end())
+                        || drawFirstMeshlet.back()
+                               != cachedGeometry.meshlets.size()))
+                || (!drawFirstLod.empty()
+                    && (drawFirstLod.size() != cachedGeometry.draws.size() + 1
+                        || !std::is_sorted(drawFirstLod.begin(),
+                                           drawFirstLod.end())
+                        || drawFirstLod.back() != cachedGeometry.lods.size()
+                        || cachedGeometry.meshBounds.size()
+                               != cached.meshes.size())))
+                throw std::runtime_error("Corrupted cache file");
+            auto [vertices, vertexBytes] = getBlob();
+            auto [indices, indexBytes] = getBlob();
+            size_t indexCount = indexBytes / cachedGeometry.indexSize();
+            size_t vertexCount = vertexBytes / cachedGeometry.vertexStride();
+            for (auto &draw : cachedGeometry.draws) {
+                if (draw.firstIndex + size_t(draw.indexCount) > indexCount
+                    || draw.baseVertex < 0
+                    || draw.baseVertex + size_t(draw.vertexCount) > vertexCount)
+                    throw std::runtime_error("Corrupted cache file");
             }
+            for (auto &meshlet : cachedGeometry.meshlets) {
+                if (meshlet.firstIndex + size_t(meshlet.indexCount)
+                    > indexCount)
+                    throw std::runtime_error("Corrupted cache file");
+            }
+            for (auto &lod : cachedGeometry.lods) {
+                if (lod.firstIndex + size_t(lod.indexCount) > indexCount)
+                    throw std::runtime_error("Corrupted cache file");
+            }
+            uploadGeometry(vertices, vertexBytes, indices, indexBytes);
+
+            model = std::move(cached);
+            geometry = std::move(cachedGeometry);
+            textures = std::move(cachedTextures);
+            textureUsages = std::move(cachedUsages);
+            textureBindings = std::move(cachedBindings);
+            samplerStates = std::move(cachedSamplers);
+            modelFiles = std::move(cachedModelFiles);
+            textureFiles = std::move(cachedTextureFiles);
+            cacheFile = std::move(file);
+            return true;
+        } catch (const std::exception &e) {
+            std::cout << "Ignoring cache " << cachePath << ": " << e.what()
+                      << '\n';
+            return false;
         }
     }
 
-    void drawNode(const glm::mat4 &matView, glm::mat4 matModel, int nodeId,
-                  bool textured) {
+    void findUsedNodes(std::vector<bool> &visited, int nodeId) {
+        if (visited[nodeId]) return;
+        visited[nodeId] = true;
+
         auto &node = model.nodes[nodeId];
-        if (node.matrix.size() == 16) {
-            glm::mat4 matNode = glm::make_mat4(node.matrix.data());
-            matModel *= matNode;
+        for (int nodeId : node.children) findUsedNodes(visited, nodeId);
+    }
+
+    // Leaves the instances to draw in visibleInstances, all of them
+    // unless culling is on. The BVH is kept up to date either way, for
+    // picking.
+    void cullInstances(const glm::mat4 &viewProj) {
+        auto start = std::chrono::steady_clock::now();
+        size_t count = scene.instanceNodes.size();
+        updateBvh();
+        visibleInstances.resize(count);
+        if (frustumCulling && bvhCulling && count >= BVH_MIN_CULL_BOXES) {
+            bvh.queryFrustum(transforms.boxes, Frustum(viewProj),
+                             visibleInstances);
+        } else if (frustumCulling) {
+            visibleInstances.resize(cullBoxes(
+                transforms.boxes, Frustum(viewProj), visibleInstances.data()));
         } else {
-            if (node.translation.size() == 3) {
-                glm::vec3 vec = glm::make_vec3(node.translation.data());
-                glm::mat4 matNode = glm::translate(glm::mat4(1.0f), vec);
-                matModel *= matNode;
+            std::iota(visibleInstances.begin(), visibleInstances.end(), 0);
+        }
+        std::chrono::duration<double, std::milli> dt
+            = std::chrono::steady_clock::now() - start;
+        cullStats = {count, visibleInstances.size(), dt.count()};
+    }
+
+    void updateBvh() {
+        uint32_t count = scene.instanceNodes.size();
+        if (bvh.size() != count)
+            bvh.build(transforms.boxes);
+        else if (bvhStale)
+            bvh.refit(transforms.boxes, {{0, count}});
+        else
+            bvh.refit(transforms.boxes, transforms.movedInstances);
+        bvhStale = false;
+    }
+
+    // Whether the GPU-driven pass draws this frame. It falls back to the
+    // CPU paths while a draw would have to bind its own texture.
+    bool indirectReady() {
+        if (!gpuDriven || indirect.instanceCount() == 0) return false;
+        rebuildMaterials();
+        bool textured = std::any_of(scene.baseColorTextures.begin(),
+                                    scene.baseColorTextures.end(),
+                                    [](int32_t id) { return id >= 0; });
+        return !textured || materialTextures.coversAll();
+    }
+
+    // cull.comp writes a command per instance, which one multi-draw then
+    // submits, so the CPU's part does not grow with the scene. LODs and
+    // meshlets are left to the CPU paths, instances draw whole. Leaves no
+    // program in use.
+    void drawIndirect(const glm::mat4 &matView, const glm::mat4 &matProj,
+                      const glm::mat4 &matModel) {
+        auto start = std::chrono::steady_clock::now();
+        // Refit by the next pick or CPU frame
+        if (!transforms.movedInstances.empty()) bvhStale = true;
+
+        {
+            RaiiUseProgram _bind(programCull.get());
+            Frustum frustum(matProj * matView);
+            glUniformMatrix4fv(uniformCullMatModel, 1, GL_FALSE,
+                               reinterpret_cast<const GLfloat *>(&matModel));
+            glUniformMatrix4fv(uniformCullMatView, 1, GL_FALSE,
+                               reinterpret_cast<const GLfloat *>(&matView));
+            glUniform4fv(uniformCullFrustumPlanes, 6,
+                         reinterpret_cast<const GLfloat *>(frustum.planes));
+            glUniform1i(uniformCullFrustumCulling, frustumCulling);
+            glUniform1ui(uniformCullInstanceCount, indirect.instanceCount());
+            indirect.cull();
+        }
+
+        RaiiUseProgram _bind(programGBufIndirect.get());
+        bool materials = bindMaterials(uniformIndirectTexturePath,
+                                       uniformIndirectTextureArrays);
+        RaiiBindVao _bindVao(vao);
+        glUniformMatrix4fv(uniformIndirectMatModel, 1, GL_FALSE,
+                           reinterpret_cast<const GLfloat *>(&matModel));
+        glUniform1i(uniformIndirectOctahedralNormals, scene.quantized);
+        indirect.draw(scene.indexType);
+        if (materials) materialTextures.unbind();
+
+        // Counted by the GPU some frames back
+        auto &stats = indirect.lastStats();
+        submittedTriangles = stats.triangles;
+        submitStats.draws = 1;
+        std::chrono::duration<double, std::milli> dt
+            = std::chrono::steady_clock::now() - start;
+        cullStats = {indirect.instanceCount(), stats.visible, dt.count()};
+    }
+
+    // Draws the visible primitives of one shader variant, in node order
+    void drawPass(const glm::mat4 &matProj, bool textured) {
+        bool materials = textured && bindMaterials();
+        glUniform1i(uniformIsTextured, textured);
+        ++submitStats.variantChanges;
+        size_t count = visibleInstances.size();
+        for (size_t begin = 0, end = 0; begin < count; begin = end) {
+            uint32_t nodeId = scene.instanceNodes[visibleInstances[begin]];
+            end = begin + 1;
+            while (end < count
+                   && scene.instanceNodes[visibleInstances[end]] == nodeId)
+                ++end;
+            int meshId = scene.nodeMeshes[nodeId];
+            // Both passes select alike, the first one counts
+            uint32_t lod
+                = selectLod(nodeId, meshId, nodeModelViews[nodeId], matProj);
+            if (textured) ++nodesPerLod[lod];
+            drawInstances(matProj, nodeId, meshId, lod, begin, end, textured);
+        }
+        if (materials) materialTextures.unbind();
+    }
+
+    // One walk over the visible instances emits a packet for each, which
+    // are then drawn in key order. With instancing, nodes drawing the same
+    // primitive at the same LOD share a packet, keyed by the nearest of
+    // them. Uniforms and textures are only set when the packet needs
+    // other ones than the previous.
+    void drawSorted(const glm::mat4 &matProj) {
+        packets.clear();
+        int64_t walked = -1;
+        float depth = 0.0f;
+        for (uint32_t instance : visibleInstances) {
+            uint32_t nodeId = scene.instanceNodes[instance];
+            if (nodeId != walked) {
+                walked = nodeId;
+                int meshId = scene.nodeMeshes[nodeId];
+                auto &matMesh = nodeModelViews[nodeId];
+                ++nodesPerLod[selectLod(nodeId, meshId, matMesh, matProj)];
+                glm::vec4 bounds = scene.meshBounds[meshId];
+                depth = -(matMesh * glm::vec4(glm::vec3(bounds), 1.0f)).z;
+            }
+            uint32_t primId = scene.instancePrims[instance];
+            int32_t materialId = scene.primMaterials[primId];
+            bool textured = scene.baseColorTextures[materialId] >= 0;
+            uint64_t key = drawSortKey(textured, materialId, depth);
+            if (!instancing) {
+                packets.push_back({key, nodeId, primId});
+                continue;
             }
-            if (node.rotation.size() == 4) {
-                glm::quat quat = glm::make_quat(node.rotation.data());
-                matModel *= glm::toMat4(quat);
+            uint32_t &slot = packetSlot(primId, nodeLods[nodeId]);
+            if (slot == UINT32_MAX) {
+                slot = packets.size();
+                packets.push_back({key, nodeId, primId, 0, 0});
+            }
+            auto &packet = packets[slot];
+            // Only the depth differs
+            if (key < packet.key) packet.key = key, packet.nodeId = nodeId;
+            ++packet.instanceCount;
+        }
+        if (instancing) gatherInstances();
+        sortDrawPackets(packets, packetScratch);
+
+        bool materials = bindMaterials();
+        int variant = -1;
+        int64_t material = -1;
+        int64_t node = -1;
+        bool instanced = false;
+        // Whose dequantization matrix is set, which instanced packets
+        // need as well
+        int64_t mesh = -1;
+        std::optional<MeshletCuller> culler;
+        // Instances cull no meshlets, those are only good for one node
+        const std::optional<MeshletCuller> noCuller;
+        for (auto &packet : packets) {
+            bool many = packet.instanceCount > 1;
+            if (many != instanced) {
+                instanced = many;
+                glUniform1i(uniformInstanced, many);
+            }
+            if (!many && packet.nodeId != node) {
+                node = packet.nodeId;
+                mesh = scene.nodeMeshes[node];
+                setNodeUniforms(matProj, node, mesh, nodeLods[node], culler);
+                ++submitStats.transformChanges;
+            }
+            if (scene.nodeMeshes[packet.nodeId] != mesh) {
+                mesh = scene.nodeMeshes[packet.nodeId];
+                setDequantization(mesh);
+            }
+            if (!selectRanges(packet.primId, nodeLods[packet.nodeId],
+                              many ? noCuller : culler))
+                continue;
+
+            bool textured = drawKeyTextured(packet.key);
+            if (textured != variant) {
+                variant = textured;
+                glUniform1i(uniformIsTextured, textured);
+                ++submitStats.variantChanges;
+            }
+            uint32_t materialId = drawKeyMaterial(packet.key);
+            if (materialId != material) {
+                material = materialId;
+                setMaterial(materialId);
+                ++submitStats.materialChanges;
+            }
+            if (many) {
+                drawInstanced(packet);
+                ++submitStats.instancedDraws;
+                submitStats.instances += packet.instanceCount;
+            } else {
+                drawPrimitive(packet.primId);
+            }
+            ++submitStats.draws;
+        }
+        if (instanced) glUniform1i(uniformInstanced, false);
+        if (textureBinds > 0) {
+            glBindTexture(GL_TEXTURE_2D, 0);
+            glBindSampler(0, 0);
+        }
+        if (materials) materialTextures.unbind();
+    }
+
+    uint32_t &packetSlot(uint32_t primId, uint32_t lod) {
+        size_t slots = scene.primCounts.size() * (MAX_LODS + 1);
+        if (packetSlots.size() != slots) packetSlots.assign(slots, UINT32_MAX);
+        return packetSlots[primId * (MAX_LODS + 1) + lod];
+    }
+
+    // Lays out the instances of the packets with several from their
+    // firstInstance on, in node order, and streams their matrices to the
+    // vertex array's instance binding. Leaves the slots empty.
+    void gatherInstances() {
+        // Filled back to front from where the packet's instances end
+        uint32_t instances = 0;
+        for (auto &packet : packets) {
+            if (packet.instanceCount < 2) continue;
+            instances += packet.instanceCount;
+            packet.firstInstance = instances;
+        }
+        instanceMatrices.resize(instances);
+        for (size_t i = visibleInstances.size(); i-- > 0;) {
+            uint32_t nodeId = scene.instanceNodes[visibleInstances[i]];
+            uint32_t primId = scene.instancePrims[visibleInstances[i]];
+            auto &packet = packets[packetSlot(primId, nodeLods[nodeId])];
+            if (packet.instanceCount < 2) continue;
+            instanceMatrices[--packet.firstInstance]
+                = {transforms.worlds[nodeId], nodeNormals[nodeId]};
+        }
+        for (auto &packet : packets)
+            packetSlot(packet.primId, nodeLods[packet.nodeId]) = UINT32_MAX;
+        if (instanceMatrices.empty()) return;
+
+        // Orphans the last frame's, which draws may still read
+        RaiiBindBuffer _bind(GL_ARRAY_BUFFER, instanceMatrixBuffer);
+        glBufferData(GL_ARRAY_BUFFER,
+                     instanceMatrices.size() * sizeof(InstanceMatrices),
+                     instanceMatrices.data(), GL_STREAM_DRAW);
+    }
+
+    // Leaves the base color texture of a material bound on unit 0, unless
+    // the material buffer covers it
+    void setMaterial(int32_t materialId) {
+        auto &factor = scene.baseColorFactors[materialId];
+        glUniform4f(uniformColorFactor, factor.r, factor.g, factor.b,
+                    factor.a);
+        int32_t textureId = scene.baseColorTextures[materialId];
+        if (textureId < 0) return;
+        if (!materialTextures.needsBind(materialId)) {
+            glUniform1i(uniformMaterialId, materialId);
+            return;
+        }
+        ++textureBinds;
+        auto &streamed = textures[textureId];
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D,
+                      streamed.resident ? streamed.tex : placeholder);
+        glBindSampler(0, samplers[scene.baseColorSamplers[materialId]]);
+    }
+
+    // Coarsest LOD of the mesh whose error, scaled to the pixels its
+    // bounding sphere's nearest point covers, stays under the threshold.
+    // Going coarser takes some margin below it, so a node sitting at the
+    // threshold does not flip between two LODs from frame to frame.
+    uint32_t selectLod(size_t nodeId, int meshId, const glm::mat4 &matMesh,
+                       const glm::mat4 &matProj) {
+        auto &range = scene.meshes[meshId];
+        uint32_t &lod = nodeLods[nodeId];
+        if (!lodSelection || range.lodCount == 0) return lod = 0;
+
+        glm::vec4 bounds = scene.meshBounds[meshId];
+        glm::vec3 center = matMesh * glm::vec4(glm::vec3(bounds), 1.0f);
+        float scale = std::max({glm::length(glm::vec3(matMesh[0])),
+                                glm::length(glm::vec3(matMesh[1])),
+                                glm::length(glm::vec3(matMesh[2]))});
+        float distance = glm::length(center) - bounds.w * scale;
+        if (distance <= 0.0f) return lod = 0;
+        float pixelsPerUnit
+            = 0.5f * lodViewportHeight * matProj[1][1] * scale / distance;
+        auto pixels = [&](uint32_t level) {
+            return scene.meshLodErrors[range.firstLodError + level - 1]
+                   * pixelsPerUnit;
+        };
+
+        lod = std::min(lod, range.lodCount);
+        while (lod < range.lodCount
+               && pixels(lod + 1) <= LOD_HYSTERESIS * lodThreshold)
+            ++lod;
+        while (lod > 0 && pixels(lod) > lodThreshold) --lod;
+        return lod;
+    }
+
+    void rebuildMaterials() {
+        if (!materialsDirty || !streamingDone) return;
+        materialTextures.build(texturePath, textures, samplers,
+                               scene.baseColorTextures,
+                               scene.baseColorSamplers);
+        materialsDirty = false;
+    }
+
+    // Rebuilds the material buffer when due and binds it with its arrays
+    // for the pass. False when draws bind their textures themselves.
+    bool bindMaterials(GLuint pathUniform = uniformTexturePath,
+                       GLuint arraysUniform = uniformTextureArrays) {
+        textureBinds = 0;
+        rebuildMaterials();
+        auto path = materialTextures.path();
+        glUniform1i(pathUniform, static_cast<int>(path));
+        // Even unused, the arrays must not share unit 0 with tex
+        GLint units[MAX_TEXTURE_ARRAYS];
+        for (int i = 0; i < MAX_TEXTURE_ARRAYS; ++i) units[i] = 1 + i;
+        glUniform1iv(arraysUniform, MAX_TEXTURE_ARRAYS, units);
+        if (path == TexturePath::Binds) return false;
+
+        materialTextures.bind();
+        return true;
+    }
+
+    // Primitives of one node, those of the visible instances [begin, end)
+    void drawInstances(const glm::mat4 &matProj, size_t nodeId, int meshId,
+                       uint32_t lod, size_t begin, size_t end,
+                       bool expectTexture) {
+        std::optional<MeshletCuller> culler;
+        setNodeUniforms(matProj, nodeId, meshId, lod, culler);
+        ++submitStats.transformChanges;
+        for (size_t i = begin; i < end; ++i) {
+            uint32_t primId = scene.instancePrims[visibleInstances[i]];
+            int32_t materialId = scene.primMaterials[primId];
+            int32_t textureId = scene.baseColorTextures[materialId];
+            bool hasTexture = textureId >= 0;
+            if (hasTexture != expectTexture) continue;
+            if (!selectRanges(primId, lod, culler)) continue;
+
+            auto &factor = scene.baseColorFactors[materialId];
+            glUniform4f(uniformColorFactor, factor.r, factor.g, factor.b,
+                        factor.a);
+            ++submitStats.materialChanges;
+            ++submitStats.draws;
+
+            if (hasTexture && !materialTextures.needsBind(materialId)) {
+                glUniform1i(uniformMaterialId, materialId);
+                drawPrimitive(primId);
+            } else if (hasTexture) {
+                ++textureBinds;
+                auto &streamed = textures[textureId];
+                GLuint texture = streamed.resident ? streamed.tex : placeholder;
+                GLuint sampler = samplers[scene.baseColorSamplers[materialId]];
+                glActiveTexture(GL_TEXTURE0);
+                RaiiBindTexture _bind(GL_TEXTURE_2D, texture);
+                RaiiBindSampler _bindSampler(0, sampler);
+                drawPrimitive(primId);
+            } else {
+                drawPrimitive(primId);
             }
         }
-        if (0 <= node.mesh && node.mesh < model.meshes.size())
-            drawMesh(matView, matModel, node.mesh, textured);
-        for (int childId : node.children)
-            drawNode(matView, matModel, childId, textured);
     }
 
-    void drawMesh(const glm::mat4 &matView, const glm::mat4 &matModel,
-                  int meshId, bool expectTexture) {
-        auto &mesh = model.meshes[meshId];
-        glm::mat4 matNormal = glm::transpose(glm::inverse(matView * matModel));
-        RaiiBindVao _bind1(vaos[meshId]);
+    // Matrices of a node showing meshId, and the culler for its meshlets
+    // when the LOD has them
+    void setNodeUniforms(const glm::mat4 &matProj, size_t nodeId, int meshId,
+                         uint32_t lod, std::optional<MeshletCuller> &culler) {
+        culler.reset();
+        if (meshletCulling && !scene.meshlets.empty() && lod == 0)
+            culler.emplace(matProj, nodeModelViews[nodeId]);
         glUniformMatrix4fv(uniformMatNormal, 1, GL_FALSE,
-                           reinterpret_cast<GLfloat *>(&matNormal));
+                           reinterpret_cast<GLfloat *>(&nodeNormals[nodeId]));
+        auto &matModel = transforms.worlds[nodeId];
         glUniformMatrix4fv(uniformMatModel, 1, GL_FALSE,
                            reinterpret_cast<const GLfloat *>(&matModel));
-        for (auto &prim : mesh.primitives) {
-            auto &accessor = model.accessors[prim.indices];
-            RaiiBindBuffer _bind2(GL_ELEMENT_ARRAY_BUFFER,
-                                  buffers[accessor.bufferView]);
-
-            auto &material = model.materials[prim.material];
-            auto &pbr = material.pbrMetallicRoughness;
-            auto &texInfo = pbr.baseColorTexture;
-            glUniform4f(uniformColorFactor, pbr.baseColorFactor[0],
-                        pbr.baseColorFactor[1], pbr.baseColorFactor[2],
-                        pbr.baseColorFactor[3]);
+        setDequantization(meshId);
+    }
 
-            bool hasTexture
-                = 0 <= texInfo.index && texInfo.index < textures.size();
+    void setDequantization(int meshId) {
+        auto &matDequant = scene.meshDequantization[meshId];
+        glUniformMatrix4fv(uniformMatDequant, 1, GL_FALSE,
+                           reinterpret_cast<const GLfloat *>(&matDequant));
+    }
 
-            if (hasTexture && expectTexture) {
-                GLuint texture = textures[texInfo.index];
-                glActiveTexture(GL_TEXTURE0);
-                RaiiBindTexture _bind3(GL_TEXTURE_2D, texture);
+    // Leaves the index ranges for drawPrimitive: the LOD's, those of the
+    // surviving meshlets, or none to draw the whole primitive. False if
+    // all meshlets were culled.
+    bool selectRanges(uint32_t primId, uint32_t lod,
+                      const std::optional<MeshletCuller> &culler) {
+        rangeCounts.clear();
+        rangeOffsets.clear();
+        rangeBaseVertices.clear();
+        size_t indexSize = scene.indexType == GL_UNSIGNED_SHORT ? 2 : 4;
+        uint32_t firstLod = scene.primFirstLod[primId];
+        uint32_t lodCount = scene.primFirstLod[primId + 1] - firstLod;
+        if (lod > 0 && lodCount > 0) {
+            auto &range = scene.lods[firstLod + std::min(lod, lodCount) - 1];
+            rangeCounts.push_back(range.indexCount);
+            rangeOffsets.push_back(static_cast<char *>(nullptr)
+                                   + size_t(range.firstIndex) * indexSize);
+            rangeBaseVertices.push_back(scene.primBaseVertices[primId]);
+            return true;
+        }
 
-                glDrawElements(
-                    prim.mode, accessor.count, accessor.componentType,
-                    static_cast<char *>(nullptr) + accessor.byteOffset);
+        uint32_t first = scene.primFirstMeshlet[primId];
+        uint32_t end = scene.primFirstMeshlet[primId + 1];
+        if (!culler || first == end) return true;
+
+        uint32_t rangeEnd = UINT32_MAX;
+        for (uint32_t meshletId = first; meshletId < end; ++meshletId) {
+            auto &meshlet = scene.meshlets[meshletId];
+            size_t triangles = meshlet.indexCount / 3;
+            ++meshletStats.meshlets;
+            meshletStats.triangles += triangles;
+            if (culler->outsideFrustum(meshlet)) {
+                ++meshletStats.frustumCulled;
+                meshletStats.culledTriangles += triangles;
+                continue;
+            }
+            if (culler->backFacing(meshlet)) {
+                ++meshletStats.backfaceCulled;
+                meshletStats.culledTriangles += triangles;
+                continue;
             }
-            if (!hasTexture && !expectTexture) {
-                glDrawElements(
-                    prim.mode, accessor.count, accessor.componentType,
-                    static_cast<char *>(nullptr) + accessor.byteOffset);
+            // Neighbors in the index buffer merge into one range
+            if (meshlet.firstIndex == rangeEnd) {
+                rangeCounts.back() += meshlet.indexCount;
+            } else {
+                rangeCounts.push_back(meshlet.indexCount);
+                rangeOffsets.push_back(static_cast<char *>(nullptr)
+                                       + size_t(meshlet.firstIndex)
+                                             * indexSize);
+                rangeBaseVertices.push_back(scene.primBaseVertices[primId]);
             }
+            rangeEnd = meshlet.firstIndex + meshlet.indexCount;
+        }
+        return !rangeCounts.empty();
+    }
+
+    // As drawPrimitive, for each of the packet's instances
+    void drawInstanced(const DrawPacket &packet) {
+        uint32_t primId = packet.primId;
+        GLsizei instances = packet.instanceCount;
+        if (rangeCounts.empty()) {
+            submittedTriangles
+                += size_t(scene.primCounts[primId] / 3) * instances;
+            glDrawElementsInstancedBaseVertexBaseInstance(
+                scene.primModes[primId], scene.primCounts[primId],
+                scene.indexType,
+                static_cast<char *>(nullptr) + scene.primIndexOffsets[primId],
+                instances, scene.primBaseVertices[primId],
+                packet.firstInstance);
+            return;
+        }
+        for (size_t i = 0; i < rangeCounts.size(); ++i) {
+            submittedTriangles += size_t(rangeCounts[i] / 3) * instances;
+            glDrawElementsInstancedBaseVertexBaseInstance(
+                scene.primModes[primId], rangeCounts[i], scene.indexType,
+                rangeOffsets[i], instances, rangeBaseVertices[i],
+                packet.firstInstance);
         }
     }
+
+    void drawPrimitive(uint32_t primId) {
+        if (!rangeCounts.empty()) {
+            for (GLsizei count : rangeCounts) submittedTriangles += count / 3;
+            glMultiDrawElementsBaseVertex(
+                scene.primModes[primId], rangeCounts.data(), scene.indexType,
+                rangeOffsets.data(), rangeCounts.size(),
+                rangeBaseVertices.data());
+            return;
+        }
+        submittedTriangles += scene.primCounts[primId] / 3;
+        glDrawElementsBaseVertex(
+            scene.primModes[primId], scene.primCounts[primId],
+            scene.indexType,
+            static_cast<char *>(nullptr) + scene.primIndexOffsets[primId],
+            scene.primBaseVertices[primId]);
+    }
 };
 
 constexpr GLsizei GBUF_SIZE = 2;
@@ -395,8 +2416,56 @@ void framebufferSizeCallback(GLFWwindow *, int width, int height) {
 
 constexpr GLuint NOISE_TEXTURE_SIZE = 97;
 
-int main() {
-    loadShaders();
+// Applies one of the command line flags shared by the viewer and the
+// load benchmark, false if arg is none of them
+bool parseLoadOption(const std::string &arg, LoadOptions &options) {
+    if (arg == "--no-parallel-decode") {
+        options.parallelDecode = false;
+    } else if (arg == "--no-cache") {
+        options.useCache = false;
+    } else if (arg == "--no-compressed-textures") {
+        options.compressedTextures = false;
+    } else if (arg == "--no-staging-ring") {
+        options.stagingRing = false;
+    } else if (arg == "--no-mesh-optimization") {
+        options.optimizeMeshes = false;
+    } else if (arg == "--no-vertex-quantization") {
+        options.quantizeVertices = false;
+    } else if (arg == "--no-lods") {
+        options.buildLods = false;
+    } else if (arg == "--no-meshlets") {
+        options.buildMeshlets = false;
+    } else if (arg == "--no-async-load") {
+        options.asyncLoad = false;
+    } else if (arg == "--kaiser-mips") {
+        options.mipFilter = MipFilter::Kaiser;
+    } else if (arg == "--compare-driver-mipmaps") {
+        options.compareDriverMipmaps = true;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+#ifndef HW03_LOADBENCH
+int main(int argc, char **argv) {
+    auto start = std::chrono::steady_clock::now();
+    LoadOptions options;
+    std::string modelPath = "chess/chess.gltf";
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            modelPath = arg;
+        } else if (!parseLoadOption(arg, options)) {
+            std::cerr << "Unknown option " << arg << '\n';
+            return 1;
+        }
+    }
+
+    {
+        TraceScope _trace("shaders");
+        loadShaders();
+    }
 
     GLuint noiseTexture = 0;
     glGenTextures(1, &noiseTexture);
@@ -468,8 +2537,25 @@ int main() {
             throw std::runtime_error("Framebuffer incomplete");
     }
 
-    Model model;
-    model.loadFrom("chess/chess.gltf");
+    auto model = std::make_unique<Model>();
+    model->startLoading(modelPath, options);
+
+    // Hot reload: a changed shader rebuilds its program, a changed image
+    // is decoded again in the background and swapped in once streamed,
+    // and changes to the glTF or its buffers load a new model, which
+    // replaces the current one when ready
+    FileWatcher watcher;
+    std::unique_ptr<Model> nextModel;
+
+    // Zero texture binds per draw once streaming is done, where possible
+    int texturePath = static_cast<int>(model->bindlessSupported()
+                                           ? TexturePath::Bindless
+                                           : TexturePath::Arrays);
+    GpuTimer gbufTimer;
+    double gbufCpuMillis = 0.0;
+    bool watchingModel = false;
+    bool modelChanged = false;
+    bool tracePrinted = false;
 
     glm::vec3 camPos = {0.0f, 0.0f, 1.0f};
     float camAngleX = 0.0f;
@@ -482,6 +2568,18 @@ int main() {
 
     float specularPow = 16.0f;
     float morphProgress = 0.0f;
+    bool meshletCulling = true;
+    bool frustumCulling = true;
+    bool bvhCulling = true;
+    int32_t pickedNode = -1;
+    // Local matrix of the picked node when picked, and how far it moved
+    glm::mat4 pickedLocal(1.0f);
+    glm::vec3 pickedOffset(0.0f);
+    bool lodSelection = true;
+    bool drawList = true;
+    bool instancing = true;
+    bool gpuDriven = false;
+    float lodThreshold = 1.0f;
     float fov = 45.0f;
     float camSpeed = 1.0f;
     float gamma = 1.0f;
@@ -500,13 +2598,68 @@ int main() {
     float rotationSpeed = 0.0f;
     float cycle = 0.0f;
 
+    int uploadBudgetKb = 4096;
+    size_t frameIndex = 0;
+
     while (!glfwWindowShouldClose(window)) {
+        if (frameIndex++ == 1) {
+            std::chrono::duration<double, std::milli> dt
+                = std::chrono::steady_clock::now() - start;
+            std::cout << "First frame presented after " << dt.count()
+                      << " ms\n";
+        }
         RaiiFrame _frame;
 
+        if (!watchingModel && model->pollLoad()) {
+            watcher.clear();
+            for (auto &shader : SHADER_FILES) watcher.watch(shader.path);
+            for (auto &file : model->sourceFiles()) watcher.watch(file);
+            watchingModel = true;
+        }
+        for (auto &file : watcher.poll()) {
+            auto shader = std::find_if(
+                std::begin(SHADER_FILES), std::end(SHADER_FILES),
+                [&](const ShaderFile &shader) { return file == shader.path; });
+            if (shader != std::end(SHADER_FILES)) {
+                std::cout << "Reloading shader " << file << '\n';
+                try {
+                    shader->load();
+                } catch (...) {
+                    // Failed to compile shaders
+                }
+            } else if (!model->reloadTexture(file)) {
+                modelChanged = true;
+            }
+        }
+        // A reload that fails leaves the current model up. It loads in the
+        // background even with --no-async-load, which only holds for the
+        // first load.
+        try {
+            if (modelChanged && !nextModel) {
+                std::cout << "Reloading model " << modelPath << '\n';
+                modelChanged = false;
+                LoadOptions reloadOptions = options;
+                reloadOptions.asyncLoad = true;
+                nextModel = std::make_unique<Model>();
+                nextModel->startLoading(modelPath, reloadOptions);
+            }
+            if (nextModel && nextModel->pollLoad()) {
+                model = std::move(nextModel);
+                pickedNode = -1;
+                watchingModel = false;
+                tracePrinted = false;
+            }
+        } catch (const std::exception &e) {
+            std::cout << "Could not reload " << modelPath << ": " << e.what()
+                      << '\n';
+            nextModel.reset();
+        }
+
         float deltaTime = ImGui::GetIO().DeltaTime;
 
         ImGui::Begin("Info");
         ImGui::Text("FPS: %f", ImGui::GetIO().Framerate);
+        model->showLoadProgress();
         ImGui::SliderFloat("Camera speed", &camSpeed, 0.0f, 4.0f, "%.3f",
                            ImGuiSliderFlags_Logarithmic);
         ImGui::SliderFloat("FOV", &fov, 15.0f, 90.0f);
@@ -551,6 +2704,93 @@ int main() {
 
         ImGui::SliderFloat("Model rotation speed", &rotationSpeed, 0.0f, 1.0f);
 
+        ImGui::SliderInt("Upload budget (KB/frame)", &uploadBudgetKb, 64,
+                         65536, "%d", ImGuiSliderFlags_Logarithmic);
+        if (ImGui::CollapsingHeader("Texture path")) {
+            ImGui::Combo("Path", &texturePath, TEXTURE_PATH_NAMES,
+                         IM_ARRAYSIZE(TEXTURE_PATH_NAMES));
+            ImGui::Text("Active: %s%s",
+                        TEXTURE_PATH_NAMES[static_cast<int>(
+                            model->activeTexturePath())],
+                        model->bindlessSupported() ? ""
+                                                   : " (no bindless)");
+            ImGui::Text("G-buffer pass: %.3f ms CPU, %.3f ms GPU",
+                        gbufCpuMillis, gbufTimer.averageMillis());
+            ImGui::Text("Texture binds: %zu", model->textureBindCount());
+        }
+        model->setTexturePath(static_cast<TexturePath>(texturePath));
+        if (model->hasMeshlets() && ImGui::CollapsingHeader("Meshlets")) {
+            ImGui::Checkbox("Cull meshlets", &meshletCulling);
+            auto &stats = model->lastMeshletStats();
+            ImGui::Text("%zu meshlets: %zu outside the frustum, "
+                        "%zu facing away",
+                        stats.meshlets, stats.frustumCulled,
+                        stats.backfaceCulled);
+            ImGui::Text("Culled %zu of %zu triangles", stats.culledTriangles,
+                        stats.triangles);
+        }
+        model->setMeshletCulling(meshletCulling && morphProgress == 0.0f);
+        model->setFrustumCulling(frustumCulling && morphProgress == 0.0f,
+                                 bvhCulling);
+        model->setDrawList(drawList);
+        model->setInstancing(instancing);
+        model->setGpuDriven(gpuDriven);
+        if (ImGui::CollapsingHeader("Draw stats")) {
+            ImGui::Text("Triangles submitted: %zu",
+                        model->submittedTriangleCount());
+            model->showTransformInfo();
+            ImGui::Checkbox("Frustum culling", &frustumCulling);
+            ImGui::SameLine();
+            ImGui::Checkbox("Through BVH in large scenes", &bvhCulling);
+            auto &cull = model->lastCullStats();
+            ImGui::Text("Primitives: %zu visible, %zu culled, %.3f ms",
+                        cull.visible, cull.tested - cull.visible, cull.millis);
+            if (pickedNode >= 0) {
+                ImGui::Text("Picked node %d", pickedNode);
+                if (ImGui::DragFloat3("Move picked node", &pickedOffset.x,
+                                      0.01f))
+                    model->setNodeLocal(
+                        pickedNode,
+                        glm::translate(glm::mat4(1.0f), pickedOffset)
+                            * pickedLocal);
+            } else {
+                ImGui::Text("Right click picks a node");
+            }
+            ImGui::Checkbox("Sorted draw list", &drawList);
+            if (drawList) {
+                ImGui::SameLine();
+                ImGui::Checkbox("Instancing", &instancing);
+            }
+            if (model->gpuDrivenSupported()) {
+                ImGui::SameLine();
+                ImGui::Checkbox("GPU-driven", &gpuDriven);
+                if (gpuDriven && !model->drewGpuDriven())
+                    ImGui::Text("Drawn by the CPU until the material buffer "
+                                "covers every texture");
+            }
+            auto &submit = model->lastSubmitStats();
+            ImGui::Text("Submission: %.3f ms CPU, %zu draws",
+                        submit.cpuMillis, submit.draws);
+            if (submit.instancedDraws > 0)
+                ImGui::Text("Instanced: %zu draws of %zu instances",
+                            submit.instancedDraws, submit.instances);
+            ImGui::Text("State changes: %zu variant, %zu material, "
+                        "%zu transform",
+                        submit.variantChanges, submit.materialChanges,
+                        submit.transformChanges);
+            if (model->hasLods()) {
+                ImGui::Checkbox("Select LODs", &lodSelection);
+                ImGui::SliderFloat("LOD error (pixels)", &lodThreshold, 0.25f,
+                                   16.0f, "%.2f",
+                                   ImGuiSliderFlags_Logarithmic);
+                auto &counts = model->lodNodeCounts();
+                for (size_t lod = 0; lod < counts.size(); ++lod)
+                    ImGui::Text("LOD %zu: %zu nodes", lod, counts[lod]);
+            }
+        }
+        model->showTextureInfo();
+        model->showUploadInfo();
+
         if (ImGui::Button("Reload shaders")) {
             try {
                 loadShaders();
@@ -562,6 +2802,7 @@ int main() {
 
         int width = 0, height = 0;
         glfwGetFramebufferSize(window, &width, &height);
+        model->setLodSelection(lodSelection, lodThreshold, height);
 
         float fovTan = glm::tan(glm::radians(fov));
 
@@ -614,6 +2855,19 @@ int main() {
         glm::mat4 matProj = glm::perspective(
             glm::radians(fov), 1.0f * width / height, zNearFar.y, zNearFar.x);
 
+        if (!ImGui::GetIO().WantCaptureMouse && ImGui::IsMouseClicked(1)) {
+            auto &io = ImGui::GetIO();
+            glm::vec2 ndc = {2.0f * io.MousePos.x / io.DisplaySize.x - 1.0f,
+                             1.0f - 2.0f * io.MousePos.y / io.DisplaySize.y};
+            float halfTan = glm::tan(0.5f * glm::radians(fov));
+            glm::vec3 dir = camForward
+                            + ndc.x * halfTan * width / height * camRight
+                            + ndc.y * halfTan * camUp;
+            pickedNode = model->pickNode(camPos, dir);
+            if (pickedNode >= 0) pickedLocal = model->nodeLocal(pickedNode);
+            pickedOffset = glm::vec3(0.0f);
+        }
+
         // We will calculate everything in view space,
         // where coordinates are still orthonormal
         glm::vec3 alColor = ambientIntensity * ambientColor;
@@ -627,6 +2881,13 @@ int main() {
             = glm::cos(glm::radians(glm::vec2{spotLightPhi, spotLightTheta}));
         glm::vec3 slColor = spotLightIntensity * spotLightColor;
 
+        model->streamTextures(size_t(uploadBudgetKb) * 1024);
+        // Startup ends once the last texture is resident
+        if (!tracePrinted && model->texturesStreamed()) {
+            StartupTrace::print(std::cout, startupTrace.take());
+            tracePrinted = true;
+        }
+
         {
             RaiiBindFramebuffer _bind1(GL_FRAMEBUFFER, fbo);
             RaiiUseProgram _bind2(programGBuf.get());
@@ -649,12 +2910,24 @@ int main() {
             glUniformMatrix4fv(uniformMatProj, 1, GL_FALSE,
                                reinterpret_cast<GLfloat *>(&matProj));
             glUniform1f(uniformMorphProgress, morphProgress);
+            GLuint indirectProgram = programGBufIndirect.get();
+            glProgramUniformMatrix4fv(indirectProgram, uniformIndirectMatView,
+                                      1, GL_FALSE,
+                                      reinterpret_cast<GLfloat *>(&matView));
+            glProgramUniformMatrix4fv(indirectProgram, uniformIndirectMatProj,
+                                      1, GL_FALSE,
+                                      reinterpret_cast<GLfloat *>(&matProj));
+            glProgramUniform1f(indirectProgram, uniformIndirectMorphProgress,
+                               morphProgress);
 
             glDepthFunc(GL_GREATER);
-            glUniform1i(uniformIsTextured, 1);
-            model.drawPassTextured(matView, matModel);
-            glUniform1i(uniformIsTextured, 0);
-            model.drawPassFlat(matView, matModel);
+            auto passStart = std::chrono::steady_clock::now();
+            gbufTimer.begin();
+            model->drawGBuffer(matView, matProj, matModel);
+            gbufTimer.end();
+            std::chrono::duration<double, std::milli> passTime
+                = std::chrono::steady_clock::now() - passStart;
+            gbufCpuMillis += 0.05 * (passTime.count() - gbufCpuMillis);
 
             glDisable(GL_CULL_FACE);
             glDisable(GL_DEPTH_TEST);
@@ -714,3 +2987,129 @@ int main() {
 
     return 0;
 }
+#else
+// Nearest rank percentile of sorted values
+double percentile(const std::vector<double> &sorted, double p) {
+    size_t rank = std::ceil(p * sorted.size());
+    return sorted[std::max<size_t>(rank, 1) - 1];
+}
+
+std::string jsonString(const std::string &text) {
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') quoted += '\\';
+        quoted += c;
+    }
+    return quoted + '"';
+}
+
+// Per phase totals of every run the phase occurred in
+struct PhaseStats {
+    std::vector<std::string> order;
+    std::map<std::string, std::vector<double>> millis;
+    std::map<std::string, size_t> bytes;
+
+    void add(const std::vector<TracePhase> &phases) {
+        for (auto &phase : phases) {
+            if (!millis.count(phase.phase)) order.push_back(phase.phase);
+            millis[phase.phase].push_back(phase.millis);
+            bytes[phase.phase] += phase.bytes;
+        }
+    }
+
+    void print(std::ostream &out) {
+        out << "{";
+        for (size_t i = 0; i < order.size(); ++i) {
+            auto &values = millis[order[i]];
+            double sum = 0.0;
+            for (double value : values) sum += value;
+            std::sort(values.begin(), values.end());
+            out << (i ? "," : "") << "\n    " << jsonString(order[i])
+                << ": {\"runs\": " << values.size()
+                << ", \"mean_ms\": " << sum / values.size()
+                << ", \"p50_ms\": " << percentile(values, 0.5)
+                << ", \"p95_ms\": " << percentile(values, 0.95)
+                << ", \"bytes\": " << bytes[order[i]] / values.size() << "}";
+        }
+        out << "\n  }";
+    }
+};
+
+// Loads a model in a fresh headless context until its last texture is
+// resident and returns the startup phases
+std::vector<TracePhase> benchLoad(const std::string &modelPath,
+                                  const LoadOptions &options) {
+    startupTrace.take();
+    auto start = std::chrono::steady_clock::now();
+    {
+        HeadlessContext context;
+        {
+            TraceScope _trace("shaders");
+            loadShaders();
+        }
+        {
+            Model model;
+            model.startLoading(modelPath, options);
+            while (!model.texturesStreamed()) model.streamTextures(SIZE_MAX);
+            glFinish();
+            std::chrono::duration<double, std::milli> dt
+                = std::chrono::steady_clock::now() - start;
+            startupTrace.record({"total", {}, dt.count(), 0});
+        }
+        // Programs go with the context
+        programGBuf = ShaderProgram();
+        programGBufIndirect = ShaderProgram();
+        programCull = ShaderProgram();
+        programScreen = ShaderProgram();
+    }
+    return StartupTrace::summarize(startupTrace.take());
+}
+
+// Loads a model a number of times and prints the mean, median and 95th
+// percentile of every startup phase over the runs as JSON. Each run loads
+// once cold, ignoring <path>.cache and the KTX2 files, so it parses,
+// decodes, builds mips and uploads. The run then loads once warm from the
+// cache, which a first load that is not measured writes. --no-cache
+// leaves the warm loads out. The loader's own output goes to stderr.
+int main(int argc, char **argv) {
+    LoadOptions options;
+    // The loader thread's shared context needs GLFW
+    options.asyncLoad = false;
+    std::string modelPath = "chess/chess.gltf";
+    int runs = 10;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            modelPath = arg;
+        } else if (arg == "--runs" && i + 1 < argc) {
+            runs = std::max(std::atoi(argv[++i]), 1);
+        } else if (!parseLoadOption(arg, options)) {
+            std::cerr << "Unknown option " << arg << '\n';
+            return 1;
+        }
+    }
+
+    std::streambuf *out = std::cout.rdbuf(std::cerr.rdbuf());
+    LoadOptions coldOptions = options;
+    coldOptions.useCache = false;
+    coldOptions.compressedTextures = false;
+    benchLoad(modelPath, options);
+    PhaseStats cold;
+    PhaseStats warm;
+    for (int run = 0; run < runs; ++run) {
+        cold.add(benchLoad(modelPath, coldOptions));
+        if (options.useCache) warm.add(benchLoad(modelPath, options));
+    }
+    std::cout.rdbuf(out);
+
+    std::cout << "{\n  \"model\": " << jsonString(modelPath)
+              << ",\n  \"runs\": " << runs << ",\n  \"cold\": ";
+    cold.print(std::cout);
+    if (options.useCache) {
+        std::cout << ",\n  \"warm\": ";
+        warm.print(std::cout);
+    }
+    std::cout << "\n}\n";
+    return 0;
+}
+#endif
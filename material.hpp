@@ -0,0 +1,248 @@
+#ifndef MATERIAL_H
+#define MATERIAL_H
+
+#include "routine.hpp"
+#include "texture.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <tuple>
+#include <vector>
+
+// How the G-buffer pass reaches base color textures: a bind per textured
+// draw, layers of a few texture arrays bound once per pass, or bindless
+// handles. The latter two index a material buffer per draw.
+enum class TexturePath { Binds, Arrays, Bindless };
+
+constexpr const char *TEXTURE_PATH_NAMES[] = {"Binds", "Texture arrays",
+                                              "Bindless"};
+
+// Texture units 1 to MAX_TEXTURE_ARRAYS hold the arrays, as in gbuf.frag
+constexpr int MAX_TEXTURE_ARRAYS = 8;
+constexpr GLuint MATERIAL_BUFFER_BINDING = 0;
+
+// glad is generated without extensions, ARB_bindless_texture is loaded by
+// hand. All null when unsupported.
+struct BindlessApi {
+    using PfnGetTextureSamplerHandle
+        = GLuint64(GLAD_API_PTR *)(GLuint, GLuint);
+    using PfnMakeHandleResident = void(GLAD_API_PTR *)(GLuint64);
+
+    PfnGetTextureSamplerHandle getTextureSamplerHandle = nullptr;
+    PfnMakeHandleResident makeResident = nullptr;
+    PfnMakeHandleResident makeNonResident = nullptr;
+
+    static BindlessApi load() {
+        BindlessApi api;
+        if (!hasExtension("GL_ARB_bindless_texture")) return api;
+        api.getTextureSamplerHandle
+            = reinterpret_cast<PfnGetTextureSamplerHandle>(
+                getProcAddress("glGetTextureSamplerHandleARB"));
+        api.makeResident = reinterpret_cast<PfnMakeHandleResident>(
+            getProcAddress("glMakeTextureHandleResidentARB"));
+        api.makeNonResident = reinterpret_cast<PfnMakeHandleResident>(
+            getProcAddress("glMakeTextureHandleNonResidentARB"));
+        if (!api.getTextureSamplerHandle || !api.makeResident
+            || !api.makeNonResident)
+            return {};
+        return api;
+    }
+
+    bool isSupported() const noexcept { return getTextureSamplerHandle; }
+};
+
+// std430 layout of gbuf.frag's Material
+struct GpuMaterial {
+    GLuint64 handle = 0;
+    int32_t array = -1;
+    int32_t layer = 0;
+};
+
+// Material buffer plus the texture arrays or resident handles behind it.
+// Built from complete textures only: a handle freezes its texture's
+// state, which streaming still changes, and arrays copy whole chains.
+struct MaterialTextures {
+    MaterialTextures(const MaterialTextures &) = delete;
+    MaterialTextures &operator=(const MaterialTextures &) = delete;
+
+    MaterialTextures() = default;
+    ~MaterialTextures() { clear(); }
+
+    // Path the current buffers were built for, Binds when there are none
+    TexturePath path() const noexcept { return built; }
+
+    // Per material, whether the draw still has to bind its texture
+    bool needsBind(int32_t materialId) const noexcept {
+        return built == TexturePath::Binds || materialBinds[materialId];
+    }
+
+    // Whether no draw has to bind a texture, so one draw can show them all
+    bool coversAll() const noexcept {
+        return built != TexturePath::Binds
+               && std::find(materialBinds.begin(), materialBinds.end(), true)
+                      == materialBinds.end();
+    }
+
+    // textureIds and samplerIds are per material, -1 if untextured
+    void build(TexturePath path, const std::vector<StreamedTexture> &textures,
+               const std::vector<GLuint> &samplers,
+               const std::vector<int32_t> &textureIds,
+               const std::vector<int32_t> &samplerIds) {
+        clear();
+        if (path == TexturePath::Binds) return;
+        if (path == TexturePath::Bindless && !bindless.isSupported()) return;
+
+        std::vector<GpuMaterial> materials(textureIds.size());
+        materialBinds.assign(textureIds.size(), false);
+        if (path == TexturePath::Arrays)
+            buildArrays(textures, samplers, textureIds, samplerIds, materials);
+        else
+            buildHandles(textures, samplers, textureIds, samplerIds,
+                         materials);
+
+        glGenBuffers(1, &materialBuffer);
+        RaiiBindBuffer _bind(GL_SHADER_STORAGE_BUFFER, materialBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                     std::max<size_t>(materials.size(), 1)
+                         * sizeof(GpuMaterial),
+                     materials.data(), GL_STATIC_DRAW);
+        built = path;
+    }
+
+    void clear() {
+        for (GLuint64 handle : residentHandles)
+            bindless.makeNonResident(handle);
+        residentHandles.clear();
+        glDeleteTextures(arrays.size(), arrays.data());
+        arrays.clear();
+        arraySamplers.clear();
+        glDeleteBuffers(1, &materialBuffer);
+        materialBuffer = 0;
+        materialBinds.clear();
+        built = TexturePath::Binds;
+    }
+
+    // For the whole pass, instead of a texture per draw
+    void bind() const {
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MATERIAL_BUFFER_BINDING,
+                         materialBuffer);
+        for (size_t i = 0; i < arrays.size(); ++i) {
+            glActiveTexture(GL_TEXTURE1 + i);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, arrays[i]);
+            glBindSampler(1 + i, arraySamplers[i]);
+        }
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    void unbind() const {
+        for (size_t i = 0; i < arrays.size(); ++i) {
+            glActiveTexture(GL_TEXTURE1 + i);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+            glBindSampler(1 + i, 0);
+        }
+        glActiveTexture(GL_TEXTURE0);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MATERIAL_BUFFER_BINDING, 0);
+    }
+
+    bool bindlessSupported() const noexcept {
+        return bindless.isSupported();
+    }
+
+  private:
+    BindlessApi bindless = BindlessApi::load();
+    TexturePath built = TexturePath::Binds;
+    GLuint materialBuffer = 0;
+    std::vector<bool> materialBinds;
+    std::vector<GLuint> arrays;
+    std::vector<GLuint> arraySamplers;
+    std::vector<GLuint64> residentHandles;
+
+    // One array per format, size and sampler, one layer per texture in it.
+    // Textures past MAX_TEXTURE_ARRAYS keep being bound per draw.
+    void buildArrays(const std::vector<StreamedTexture> &textures,
+                     const std::vector<GLuint> &samplers,
+                     const std::vector<int32_t> &textureIds,
+                     const std::vector<int32_t> &samplerIds,
+                     std::vector<GpuMaterial> &materials) {
+        using Key = std::tuple<GLenum, int, int, size_t, int32_t>;
+        std::map<Key, int32_t> arrayIds;
+        // Per array, the texture of every layer
+        std::vector<std::vector<int32_t>> layers;
+        for (size_t materialId = 0; materialId < textureIds.size();
+             ++materialId) {
+            int32_t textureId = textureIds[materialId];
+            if (textureId < 0) continue;
+            auto &texture = textures[textureId];
+            auto &top = texture.levels[0];
+            Key key{texture.format, top.width, top.height,
+                    texture.levels.size(), samplerIds[materialId]};
+            auto it = arrayIds.find(key);
+            if (it == arrayIds.end()) {
+                if (layers.size() == MAX_TEXTURE_ARRAYS) {
+                    materialBinds[materialId] = true;
+                    continue;
+                }
+                it = arrayIds.emplace(key, layers.size()).first;
+                layers.emplace_back();
+                arraySamplers.push_back(samplers[samplerIds[materialId]]);
+            }
+            auto &arrayLayers = layers[it->second];
+            auto layer = std::find(arrayLayers.begin(), arrayLayers.end(),
+                                   textureId);
+            if (layer == arrayLayers.end())
+                layer = arrayLayers.insert(arrayLayers.end(), textureId);
+            materials[materialId].array = it->second;
+            materials[materialId].layer = layer - arrayLayers.begin();
+        }
+
+        // Copies stay on the GPU, the streamed textures are the source
+        arrays.resize(layers.size());
+        glGenTextures(arrays.size(), arrays.data());
+        for (size_t i = 0; i < arrays.size(); ++i) {
+            auto &first = textures[layers[i][0]];
+            auto &top = first.levels[0];
+            RaiiBindTexture _bind(GL_TEXTURE_2D_ARRAY, arrays[i]);
+            glTexStorage3D(GL_TEXTURE_2D_ARRAY, first.levels.size(),
+                           first.format, top.width, top.height,
+                           layers[i].size());
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL,
+                            first.levels.size() - 1);
+            for (size_t layer = 0; layer < layers[i].size(); ++layer) {
+                auto &texture = textures[layers[i][layer]];
+                for (size_t level = 0; level < texture.levels.size();
+                     ++level) {
+                    auto &size = texture.levels[level];
+                    glCopyImageSubData(texture.tex, GL_TEXTURE_2D, level, 0,
+                                       0, 0, arrays[i], GL_TEXTURE_2D_ARRAY,
+                                       level, 0, 0, layer, size.width,
+                                       size.height, 1);
+                }
+            }
+        }
+    }
+
+    void buildHandles(const std::vector<StreamedTexture> &textures,
+                      const std::vector<GLuint> &samplers,
+                      const std::vector<int32_t> &textureIds,
+                      const std::vector<int32_t> &samplerIds,
+                      std::vector<GpuMaterial> &materials) {
+        for (size_t materialId = 0; materialId < textureIds.size();
+             ++materialId) {
+            int32_t textureId = textureIds[materialId];
+            if (textureId < 0) continue;
+            // The same texture and sampler give the same handle
+            GLuint64 handle = bindless.getTextureSamplerHandle(
+                textures[textureId].tex, samplers[samplerIds[materialId]]);
+            if (std::find(residentHandles.begin(), residentHandles.end(),
+                          handle)
+                == residentHandles.end()) {
+                bindless.makeResident(handle);
+                residentHandles.push_back(handle);
+            }
+            materials[materialId].handle = handle;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef MESHLET_H
+#define MESHLET_H
+
+#include "geometry.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <glm/geometric.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+
+// Limits of a meshlet, as mesh shading hardware favors them
+constexpr size_t MAX_MESHLET_VERTICES = 64;
+constexpr size_t MAX_MESHLET_TRIANGLES = 124;
+
+// Splits a triangle list draw into meshlets along its index order, which
+// optimizeDraw has already made local
+inline std::vector<Meshlet> buildDrawMeshlets(const Geometry &geometry,
+                                              const GeometryDraw &draw) {
+    std::vector<Meshlet> meshlets;
+    if (draw.indexCount % 3 != 0) return meshlets;
+
+    size_t indexSize = geometry.indexSize();
+    auto indexData = geometry.indices.data() + draw.firstIndex * indexSize;
+    auto index = [&](size_t i) -> uint32_t {
+        if (indexSize == 2) {
+            uint16_t value;
+            std::memcpy(&value, indexData + 2 * i, 2);
+            return value;
+        }
+        uint32_t value;
+        std::memcpy(&value, indexData + 4 * i, 4);
+        return value;
+    };
+    const Vertex *vertices = geometry.vertices.data() + draw.baseVertex;
+
+    // Last meshlet each vertex was added to, instead of a set per meshlet
+    std::vector<uint32_t> seenBy(draw.vertexCount, UINT32_MAX);
+    std::vector<uint32_t> unique;
+    size_t begin = 0;
+    auto finish = [&](size_t end) {
+        Meshlet meshlet;
+        meshlet.firstIndex = draw.firstIndex + begin;
+        meshlet.indexCount = end - begin;
+
+        glm::vec3 lo(INFINITY), hi(-INFINITY);
+        for (uint32_t v : unique) {
+            lo = glm::min(lo, vertices[v].position);
+            hi = glm::max(hi, vertices[v].position);
+        }
+        meshlet.center = 0.5f * (lo + hi);
+        for (uint32_t v : unique)
+            meshlet.radius = std::max(
+                meshlet.radius,
+                glm::distance(meshlet.center, vertices[v].position));
+
+        std::vector<glm::vec3> normals;
+        glm::vec3 sum(0.0f);
+        for (size_t i = begin; i < end; i += 3) {
+            glm::vec3 p0 = vertices[index(i)].position;
+            glm::vec3 p1 = vertices[index(i + 1)].position;
+            glm::vec3 p2 = vertices[index(i + 2)].position;
+            glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+            float length = glm::length(normal);
+            if (length <= 0.0f) continue;
+            normals.push_back(normal / length);
+            sum += normals.back();
+        }
+        float sumLength = glm::length(sum);
+        if (!normals.empty() && sumLength > 0.0f) {
+            glm::vec3 axis = sum / sumLength;
+            float minDot = 1.0f;
+            for (auto &normal : normals)
+                minDot = std::min(minDot, glm::dot(axis, normal));
+            // Sine of the widest normal's angle past the axis' normal
+            // plane, so a view direction at least this far behind every
+            // triangle sees only their backs
+            if (minDot > 0.0f) {
+                meshlet.coneAxis = axis;
+                meshlet.coneCutoff = std::sqrt(1.0f - minDot * minDot);
+            }
+        }
+        meshlets.push_back(meshlet);
+        unique.clear();
+        begin = end;
+    };
+
+    for (size_t i = 0; i < draw.indexCount; i += 3) {
+        uint32_t meshletId = meshlets.size();
+        size_t added = 0;
+        for (int k = 0; k < 3; ++k)
+            if (seenBy[index(i + k)] != meshletId) ++added;
+        if (unique.size() + added > MAX_MESHLET_VERTICES
+            || (i - begin) / 3 == MAX_MESHLET_TRIANGLES) {
+            finish(i);
+            ++meshletId;
+        }
+        for (int k = 0; k < 3; ++k) {
+            uint32_t v = index(i + k);
+            if (seenBy[v] == meshletId) continue;
+            seenBy[v] = meshletId;
+            unique.push_back(v);
+        }
+    }
+    if (begin < draw.indexCount) finish(draw.indexCount);
+    return meshlets;
+}
+
+// Frustum planes and eye position in the space of one mesh, so meshlet
+// bounds are tested without transforming them
+struct MeshletCuller {
+    glm::vec4 planes[6];
+    glm::vec3 eye;
+    // Mirroring transforms flip the winding the cones were built for
+    bool cones;
+
+    // matMesh takes mesh space to view space
+    MeshletCuller(const glm::mat4 &matProj, const glm::mat4 &matMesh) {
+        glm::mat4 clip = glm::transpose(matProj * matMesh);
+        for (int i = 0; i < 3; ++i) {
+            planes[2 * i] = clip[3] + clip[i];
+            planes[2 * i + 1] = clip[3] - clip[i];
+        }
+        for (auto &plane : planes) plane /= glm::length(glm::vec3(plane));
+        eye = glm::vec3(glm::inverse(matMesh)[3]);
+        cones = glm::determinant(glm::mat3(matMesh)) > 0.0f;
+    }
+
+    bool outsideFrustum(const Meshlet &meshlet) const {
+        for (auto &plane : planes)
+            if (glm::dot(glm::vec3(plane), meshlet.center) + plane.w
+                < -meshlet.radius)
+                return true;
+        return false;
+    }
+
+    bool backFacing(const Meshlet &meshlet) const {
+        if (!cones) return false;
+        glm::vec3 toCenter = meshlet.center - eye;
+        return glm::dot(toCenter, meshlet.coneAxis)
+               >= meshlet.coneCutoff * glm::length(toCenter) + meshlet.radius;
+    }
+};
+
+// Per pass, for the UI
+struct MeshletStats {
+    size_t meshlets = 0;
+    size_t frustumCulled = 0;
+    size_t backfaceCulled = 0;
+    size_t triangles = 0;
+    size_t culledTriangles = 0;
+};
+
+#endif
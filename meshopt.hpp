@@ -0,0 +1,259 @@
+#ifndef MESHOPT_H
+#define MESHOPT_H
+
+#include "geometry.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <glm/geometric.hpp>
+#include <glm/vec3.hpp>
+
+// Post-transform cache size assumed by Tipsify and used to report ACMR
+constexpr int VERTEX_CACHE_SIZE = 16;
+// Overdraw clusters are cut at Tipsify's dead ends once this large
+constexpr size_t MIN_CLUSTER_TRIANGLES = 64;
+
+// Average cache miss ratio of a FIFO cache: misses per triangle
+inline float computeAcmr(const std::vector<uint32_t> &indices,
+                         size_t vertexCount,
+                         int cacheSize = VERTEX_CACHE_SIZE) {
+    if (indices.size() < 3) return 0.0f;
+    // A vertex is cached while fewer than cacheSize misses followed it
+    std::vector<size_t> missedAt(vertexCount, 0);
+    size_t misses = 0;
+    for (uint32_t v : indices) {
+        if (missedAt[v] && misses - missedAt[v] < size_t(cacheSize)) continue;
+        missedAt[v] = ++misses;
+    }
+    return float(misses) / (indices.size() / 3);
+}
+
+// Triangles around every vertex, as offsets into one flat list
+struct VertexAdjacency {
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> triangles;
+
+    VertexAdjacency(const std::vector<uint32_t> &indices, size_t vertexCount)
+        : offsets(vertexCount + 1, 0), triangles(indices.size()) {
+        for (uint32_t v : indices) ++offsets[v + 1];
+        for (size_t v = 0; v < vertexCount; ++v) offsets[v + 1] += offsets[v];
+        std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < indices.size(); ++i)
+            triangles[fill[indices[i]]++] = i / 3;
+    }
+};
+
+// Tipsify (Sander, Nehab and Barczak 2007). Returns the triangle order
+// and marks where it had to jump to an unconnected vertex.
+inline std::vector<uint32_t> tipsify(const std::vector<uint32_t> &indices,
+                                     size_t vertexCount,
+                                     std::vector<bool> &deadEnds) {
+    size_t triangleCount = indices.size() / 3;
+    VertexAdjacency adjacency(indices, vertexCount);
+    std::vector<uint32_t> live(vertexCount);
+    for (size_t v = 0; v < vertexCount; ++v)
+        live[v] = adjacency.offsets[v + 1] - adjacency.offsets[v];
+
+    std::vector<size_t> cachedAt(vertexCount, 0);
+    std::vector<bool> emitted(triangleCount, false);
+    std::vector<uint32_t> deadEndStack;
+    std::vector<uint32_t> candidates;
+    std::vector<uint32_t> order;
+    order.reserve(triangleCount);
+    deadEnds.assign(triangleCount, false);
+
+    size_t time = VERTEX_CACHE_SIZE + 1;
+    size_t cursor = 0;
+    int64_t fanning = vertexCount > 0 ? 0 : -1;
+    bool jumped = true;
+    while (fanning >= 0) {
+        candidates.clear();
+        for (uint32_t i = adjacency.offsets[fanning];
+             i < adjacency.offsets[fanning + 1]; ++i) {
+            uint32_t t = adjacency.triangles[i];
+            if (emitted[t]) continue;
+            if (jumped) deadEnds[order.size()] = true;
+            jumped = false;
+            emitted[t] = true;
+            order.push_back(t);
+            for (int k = 0; k < 3; ++k) {
+                uint32_t v = indices[3 * t + k];
+                deadEndStack.push_back(v);
+                candidates.push_back(v);
+                --live[v];
+                if (time - cachedAt[v] > VERTEX_CACHE_SIZE)
+                    cachedAt[v] = time++;
+            }
+        }
+
+        // Prefer the candidate that is still cached after fanning it
+        int64_t next = -1;
+        int64_t bestPriority = -1;
+        for (uint32_t v : candidates) {
+            if (live[v] == 0) continue;
+            int64_t priority = 0;
+            if (time - cachedAt[v] + 2 * live[v] <= VERTEX_CACHE_SIZE)
+                priority = time - cachedAt[v];
+            if (priority > bestPriority) {
+                bestPriority = priority;
+                next = v;
+            }
+        }
+        if (next < 0) {
+            jumped = true;
+            while (!deadEndStack.empty() && next < 0) {
+                uint32_t v = deadEndStack.back();
+                deadEndStack.pop_back();
+                if (live[v] > 0) next = v;
+            }
+            while (next < 0 && cursor < vertexCount) {
+                if (live[cursor] > 0) next = cursor;
+                ++cursor;
+            }
+        }
+        fanning = next;
+    }
+    return order;
+}
+
+// Splits the order into clusters at dead ends and sorts them so that
+// clusters facing away from the mesh center are drawn first. Those
+// tend to occlude the rest, which then fails the depth test early.
+inline std::vector<uint32_t>
+sortClustersForOverdraw(const std::vector<uint32_t> &indices,
+                        const std::vector<uint32_t> &order,
+                        const std::vector<bool> &deadEnds,
+                        const Vertex *vertices) {
+    struct Cluster {
+        size_t begin;
+        size_t end;
+        float key;
+    };
+    std::vector<Cluster> clusters;
+    for (size_t i = 0; i < order.size(); ++i) {
+        if (clusters.empty()
+            || (deadEnds[i]
+                && i - clusters.back().begin >= MIN_CLUSTER_TRIANGLES))
+            clusters.push_back({i, i, 0.0f});
+        clusters.back().end = i + 1;
+    }
+
+    auto position = [&](uint32_t t, int k) {
+        return vertices[indices[3 * t + k]].position;
+    };
+    glm::vec3 meshCenter(0.0f);
+    float meshArea = 0.0f;
+    std::vector<glm::vec3> centers(clusters.size(), glm::vec3(0.0f));
+    std::vector<glm::vec3> normals(clusters.size(), glm::vec3(0.0f));
+    std::vector<float> areas(clusters.size(), 0.0f);
+    for (size_t c = 0; c < clusters.size(); ++c) {
+        for (size_t i = clusters[c].begin; i < clusters[c].end; ++i) {
+            glm::vec3 p0 = position(order[i], 0);
+            glm::vec3 p1 = position(order[i], 1);
+            glm::vec3 p2 = position(order[i], 2);
+            glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+            float area = glm::length(normal);
+            glm::vec3 center = (p0 + p1 + p2) / 3.0f;
+            centers[c] += area * center;
+            normals[c] += normal;
+            areas[c] += area;
+        }
+        meshCenter += centers[c];
+        meshArea += areas[c];
+    }
+    if (meshArea > 0.0f) meshCenter /= meshArea;
+
+    for (size_t c = 0; c < clusters.size(); ++c) {
+        float normalLength = glm::length(normals[c]);
+        if (areas[c] <= 0.0f || normalLength <= 0.0f) continue;
+        clusters[c].key = glm::dot(centers[c] / areas[c] - meshCenter,
+                                   normals[c] / normalLength);
+    }
+    std::stable_sort(clusters.begin(), clusters.end(),
+                     [](const Cluster &a, const Cluster &b) {
+                         return a.key > b.key;
+                     });
+
+    std::vector<uint32_t> sorted;
+    sorted.reserve(order.size());
+    for (auto &cluster : clusters)
+        sorted.insert(sorted.end(), order.begin() + cluster.begin,
+                      order.begin() + cluster.end);
+    return sorted;
+}
+
+struct MeshOptStats {
+    float acmrBefore = 0.0f;
+    float acmrAfter = 0.0f;
+    double millis = 0.0;
+};
+
+// Reorders one triangle list draw in place: triangles for vertex cache
+// reuse and then overdraw, vertices in order of first use
+inline MeshOptStats optimizeDraw(Geometry &geometry,
+                                 const GeometryDraw &draw) {
+    MeshOptStats stats;
+    if (draw.indexCount % 3 != 0) return stats;
+
+    auto start = std::chrono::steady_clock::now();
+    size_t indexSize = geometry.indexSize();
+    auto indexData = geometry.indices.data() + draw.firstIndex * indexSize;
+    std::vector<uint32_t> indices(draw.indexCount);
+    for (size_t i = 0; i < indices.size(); ++i) {
+        if (indexSize == 2) {
+            uint16_t index;
+            std::memcpy(&index, indexData + 2 * i, 2);
+            indices[i] = index;
+        } else {
+            std::memcpy(&indices[i], indexData + 4 * i, 4);
+        }
+    }
+
+    stats.acmrBefore = computeAcmr(indices, draw.vertexCount);
+
+    Vertex *vertices = geometry.vertices.data() + draw.baseVertex;
+    std::vector<bool> deadEnds;
+    auto order = tipsify(indices, draw.vertexCount, deadEnds);
+    order = sortClustersForOverdraw(indices, order, deadEnds, vertices);
+
+    std::vector<uint32_t> remap(draw.vertexCount, UINT32_MAX);
+    std::vector<Vertex> reordered;
+    reordered.reserve(draw.vertexCount);
+    std::vector<uint32_t> optimized;
+    optimized.reserve(indices.size());
+    for (uint32_t t : order) {
+        for (int k = 0; k < 3; ++k) {
+            uint32_t v = indices[3 * t + k];
+            if (remap[v] == UINT32_MAX) {
+                remap[v] = reordered.size();
+                reordered.push_back(vertices[v]);
+            }
+            optimized.push_back(remap[v]);
+        }
+    }
+    // Unreferenced vertices keep the range's size intact
+    for (uint32_t v = 0; v < draw.vertexCount; ++v)
+        if (remap[v] == UINT32_MAX) reordered.push_back(vertices[v]);
+    std::copy(reordered.begin(), reordered.end(), vertices);
+
+    for (size_t i = 0; i < optimized.size(); ++i) {
+        if (indexSize == 2) {
+            uint16_t index = optimized[i];
+            std::memcpy(indexData + 2 * i, &index, 2);
+        } else {
+            std::memcpy(indexData + 4 * i, &optimized[i], 4);
+        }
+    }
+
+    stats.acmrAfter = computeAcmr(optimized, draw.vertexCount);
+    std::chrono::duration<double, std::milli> dt
+        = std::chrono::steady_clock::now() - start;
+    stats.millis = dt.count();
+    return stats;
+}
+
+#endif
@@ -0,0 +1,331 @@
+#ifndef MIP_H
+#define MIP_H
+
+#include "image.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Box averages 2x2 texels. Kaiser is a windowed sinc over a few texels
+// each way, which keeps distant mips sharper at some extra cost.
+enum class MipFilter { Box, Kaiser };
+
+constexpr const char *MIP_FILTER_NAMES[] = {"box", "kaiser"};
+
+// Kaiser support and shape in destination texels, as texture tools use
+constexpr float KAISER_RADIUS = 3.0f;
+constexpr float KAISER_ALPHA = 4.0f;
+
+// Destination rows filtered per task
+constexpr int MIP_BAND_ROWS = 16;
+
+inline float besselI0(float x) {
+    float sum = 1.0f, term = 1.0f;
+    for (int k = 1; k < 32 && term > sum * 1e-7f; ++k) {
+        float half = x / (2.0f * k);
+        term *= half * half;
+        sum += term;
+    }
+    return sum;
+}
+
+inline float kaiserSinc(float u) {
+    constexpr float PI = 3.14159265358979f;
+    float t = u / KAISER_RADIUS;
+    if (t * t >= 1.0f) return 0.0f;
+    float window = besselI0(KAISER_ALPHA * std::sqrt(1.0f - t * t))
+                   / besselI0(KAISER_ALPHA);
+    float sinc = u == 0.0f ? 1.0f : std::sin(PI * u) / (PI * u);
+    return sinc * window;
+}
+
+// Source texels and weights of every destination texel along one axis.
+// Taps of destination texel i are [offsets[i], offsets[i + 1]).
+struct MipTaps {
+    std::vector<uint32_t> offsets;
+    std::vector<int> sources;
+    std::vector<float> weights;
+
+    MipTaps(int srcSize, int dstSize, MipFilter filter) {
+        offsets.push_back(0);
+        for (int i = 0; i < dstSize; ++i) {
+            if (filter == MipFilter::Box) {
+                // As the 2x2 box: an odd last row or column is dropped
+                sources.push_back(std::min(2 * i, srcSize - 1));
+                sources.push_back(std::min(2 * i + 1, srcSize - 1));
+                weights.insert(weights.end(), {0.5f, 0.5f});
+            } else {
+                float scale = float(srcSize) / dstSize;
+                float center = (i + 0.5f) * scale;
+                int first = std::floor(center - KAISER_RADIUS * scale);
+                int last = std::ceil(center + KAISER_RADIUS * scale);
+                size_t begin = weights.size();
+                float sum = 0.0f;
+                for (int s = first; s < last; ++s) {
+                    float weight = kaiserSinc((s + 0.5f - center) / scale);
+                    if (weight == 0.0f) continue;
+                    // Clamped to the edge, as sampling does
+                    sources.push_back(std::clamp(s, 0, srcSize - 1));
+                    weights.push_back(weight);
+                    sum += weight;
+                }
+                for (size_t t = begin; t < weights.size(); ++t)
+                    weights[t] /= sum;
+            }
+            offsets.push_back(sources.size());
+        }
+    }
+
+    std::pair<int, int> sourceRange(int dstBegin, int dstEnd) const {
+        auto first = sources.begin() + offsets[dstBegin];
+        auto last = sources.begin() + offsets[dstEnd];
+        auto [lo, hi] = std::minmax_element(first, last);
+        return {*lo, *hi + 1};
+    }
+};
+
+// Four float channels of a texel, in one SSE register where available
+struct Texel4f {
+#ifdef __SSE2__
+    __m128 v = _mm_setzero_ps();
+
+    void addScaled(const float *texel, float weight) {
+        v = _mm_add_ps(v, _mm_mul_ps(_mm_loadu_ps(texel), _mm_set1_ps(weight)));
+    }
+    void store(float *texel) const { _mm_storeu_ps(texel, v); }
+#else
+    float v[4] = {};
+
+    void addScaled(const float *texel, float weight) {
+        for (int c = 0; c < 4; ++c) v[c] += texel[c] * weight;
+    }
+    void store(float *texel) const { std::memcpy(texel, v, sizeof(v)); }
+#endif
+};
+
+inline const std::array<float, 256> &srgbToLinearTable() {
+    static const auto table = [] {
+        std::array<float, 256> t;
+        for (int i = 0; i < 256; ++i) {
+            float c = i / 255.0f;
+            t[i] = c <= 0.04045f ? c / 12.92f
+                                 : std::pow((c + 0.055f) / 1.055f, 2.4f);
+        }
+        return t;
+    }();
+    return table;
+}
+
+// Indexed by linear intensity in 1/65535 steps, off by one byte from the
+// exact conversion only right at rounding boundaries
+inline const std::vector<uint8_t> &linearToSrgbTable() {
+    static const auto table = [] {
+        std::vector<uint8_t> t(65536);
+        for (size_t i = 0; i < t.size(); ++i) {
+            float c = i / 65535.0f;
+            float s = c <= 0.0031308f ? c * 12.92f
+                                      : 1.055f * std::pow(c, 1 / 2.4f) - 0.055f;
+            t[i] = static_cast<uint8_t>(s * 255.0f + 0.5f);
+        }
+        return t;
+    }();
+    return table;
+}
+
+// RGBA8 texels to floats the filter can average: linear light for base
+// color, signed vectors for normal maps, plain fractions otherwise
+inline void decodeTexels(const unsigned char *src, float *dst, int count,
+                         ImageUsage usage) {
+    auto &srgb = srgbToLinearTable();
+    for (int i = 0; i < count; ++i, src += 4, dst += 4) {
+        for (int c = 0; c < 3; ++c) {
+            if (usage == ImageUsage::BaseColor)
+                dst[c] = srgb[src[c]];
+            else if (usage == ImageUsage::Normal)
+                dst[c] = src[c] * (2.0f / 255.0f) - 1.0f;
+            else
+                dst[c] = src[c] * (1.0f / 255.0f);
+        }
+        dst[3] = src[3] * (1.0f / 255.0f);
+    }
+}
+
+// Inverse of decodeTexels. Averaged normals are renormalized.
+inline void encodeTexels(const float *src, unsigned char *dst, int count,
+                         ImageUsage usage) {
+    auto &srgb = linearToSrgbTable();
+    auto unorm = [](float c) {
+        return static_cast<unsigned char>(std::clamp(c, 0.0f, 1.0f) * 255.0f
+                                          + 0.5f);
+    };
+    for (int i = 0; i < count; ++i, src += 4, dst += 4) {
+        if (usage == ImageUsage::BaseColor) {
+            for (int c = 0; c < 3; ++c)
+                dst[c] = srgb[size_t(std::clamp(src[c], 0.0f, 1.0f) * 65535.0f
+                                     + 0.5f)];
+        } else if (usage == ImageUsage::Normal) {
+            float length = std::sqrt(src[0] * src[0] + src[1] * src[1]
+                                     + src[2] * src[2]);
+            float scale = length > 1e-6f ? 1.0f / length : 0.0f;
+            for (int c = 0; c < 3; ++c)
+                dst[c] = unorm(src[c] * scale * 0.5f + 0.5f);
+            if (scale == 0.0f) dst[2] = 255;
+        } else {
+            for (int c = 0; c < 3; ++c) dst[c] = unorm(src[c]);
+        }
+        dst[3] = unorm(src[3]);
+    }
+}
+
+// One level from the previous through separable taps, in bands of rows.
+// Source rows a band needs are decoded and filtered horizontally once.
+inline void filterMipLevel(const MipLevel &prev, const MipLevel &next,
+                           ImageUsage usage, MipFilter filter) {
+    MipTaps columns(prev.width, next.width, filter);
+    MipTaps rows(prev.height, next.height, filter);
+    auto dst = const_cast<unsigned char *>(next.data);
+    size_t bands = (next.height + MIP_BAND_ROWS - 1) / MIP_BAND_ROWS;
+    parallelFor(bands, [&](size_t band) {
+        int y0 = band * MIP_BAND_ROWS;
+        int y1 = std::min(y0 + MIP_BAND_ROWS, next.height);
+        auto [srcBegin, srcEnd] = rows.sourceRange(y0, y1);
+
+        std::vector<float> decoded(size_t(4) * prev.width);
+        std::vector<float> filtered(size_t(4) * next.width
+                                    * (srcEnd - srcBegin));
+        for (int sy = srcBegin; sy < srcEnd; ++sy) {
+            decodeTexels(prev.data + size_t(4) * sy * prev.width,
+                         decoded.data(), prev.width, usage);
+            float *out = &filtered[size_t(4) * next.width * (sy - srcBegin)];
+            for (int x = 0; x < next.width; ++x) {
+                Texel4f sum;
+                for (auto t = columns.offsets[x]; t < columns.offsets[x + 1];
+                     ++t)
+                    sum.addScaled(&decoded[4 * columns.sources[t]],
+                                  columns.weights[t]);
+                sum.store(out + 4 * x);
+            }
+        }
+
+        std::vector<float> row(size_t(4) * next.width);
+        for (int y = y0; y < y1; ++y) {
+            for (int x = 0; x < next.width; ++x) {
+                Texel4f sum;
+                for (auto t = rows.offsets[y]; t < rows.offsets[y + 1]; ++t) {
+                    size_t sy = rows.sources[t] - srcBegin;
+                    sum.addScaled(&filtered[4 * (sy * next.width + x)],
+                                  rows.weights[t]);
+                }
+                sum.store(&row[4 * x]);
+            }
+            encodeTexels(row.data(), dst + size_t(4) * y * next.width,
+                         next.width, usage);
+        }
+    });
+}
+
+// (a + b + c + d + 2) / 4 per channel of the 2x2 texels under each
+// destination texel. SSE2 takes four destination texels at a time where
+// no edge clamping is needed, with the same rounding as the scalar tail.
+inline void boxMipRow(const unsigned char *row0, const unsigned char *row1,
+                      unsigned char *dst, int srcWidth, int dstWidth) {
+    int x = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+    // Two source texels of both rows to one destination texel in lanes 0-3
+    auto pair = [&](__m128i a, __m128i b) {
+        __m128i sum = _mm_add_epi16(a, b);
+        return _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+    };
+    auto quad = [&](const unsigned char *p0, const unsigned char *p1) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p0));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p1));
+        __m128i lo = pair(_mm_unpacklo_epi8(a, zero),
+                          _mm_unpacklo_epi8(b, zero));
+        __m128i hi = pair(_mm_unpackhi_epi8(a, zero),
+                          _mm_unpackhi_epi8(b, zero));
+        __m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), two);
+        return _mm_srli_epi16(sum, 2);
+    };
+    for (; x + 4 <= dstWidth && 2 * x + 8 <= srcWidth; x += 4) {
+        __m128i first = quad(row0 + 8 * x, row1 + 8 * x);
+        __m128i second = quad(row0 + 8 * x + 16, row1 + 8 * x + 16);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 4 * x),
+                         _mm_packus_epi16(first, second));
+    }
+#endif
+    for (; x < dstWidth; ++x) {
+        int x0 = std::min(2 * x, srcWidth - 1);
+        int x1 = std::min(2 * x + 1, srcWidth - 1);
+        for (int c = 0; c < 4; ++c) {
+            unsigned sum = row0[4 * x0 + c] + row0[4 * x1 + c]
+                           + row1[4 * x0 + c] + row1[4 * x1 + c];
+            dst[4 * x + c] = (sum + 2) / 4;
+        }
+    }
+}
+
+inline void boxMipLevel(const MipLevel &prev, const MipLevel &next) {
+    auto dst = const_cast<unsigned char *>(next.data);
+    size_t bands = (next.height + MIP_BAND_ROWS - 1) / MIP_BAND_ROWS;
+    parallelFor(bands, [&](size_t band) {
+        int y0 = band * MIP_BAND_ROWS;
+        int y1 = std::min(y0 + MIP_BAND_ROWS, next.height);
+        for (int y = y0; y < y1; ++y) {
+            int r0 = std::min(2 * y, prev.height - 1);
+            int r1 = std::min(2 * y + 1, prev.height - 1);
+            boxMipRow(prev.data + size_t(4) * r0 * prev.width,
+                      prev.data + size_t(4) * r1 * prev.width,
+                      dst + size_t(4) * y * next.width, prev.width,
+                      next.width);
+        }
+    });
+}
+
+// Fills texels with the full mip chain of an RGBA8 image. Base color is
+// filtered in linear light and normal maps are renormalized; other data
+// takes the plain byte average, which is what Box gives for Unknown.
+inline std::vector<MipLevel>
+buildMipChain(std::vector<unsigned char> &texels, const unsigned char *src,
+              int width, int height, ImageUsage usage = ImageUsage::Unknown,
+              MipFilter filter = MipFilter::Box) {
+    std::vector<MipLevel> levels(mipLevelCount(width, height));
+    size_t total = 0;
+    for (size_t i = 0; i < levels.size(); ++i) {
+        levels[i].width = width;
+        levels[i].height = height;
+        levels[i].size = size_t(4) * width * height;
+        total += levels[i].size;
+        width = std::max(width / 2, 1);
+        height = std::max(height / 2, 1);
+    }
+
+    texels.resize(total);
+    size_t offset = 0;
+    for (auto &level : levels) {
+        level.data = texels.data() + offset;
+        offset += level.size;
+    }
+    std::memcpy(texels.data(), src, levels[0].size);
+
+    bool plain = usage == ImageUsage::Unknown || usage == ImageUsage::Orm;
+    for (size_t i = 1; i < levels.size(); ++i) {
+        if (plain && filter == MipFilter::Box)
+            boxMipLevel(levels[i - 1], levels[i]);
+        else
+            filterMipLevel(levels[i - 1], levels[i], usage, filter);
+    }
+    return levels;
+}
+
+#endif
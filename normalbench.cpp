@@ -0,0 +1,89 @@
+#include "normals.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <glm/ext/matrix_transform.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+// Random node transforms, a share of them with non-uniform scale
+static std::vector<glm::mat4> randomWorlds(size_t count, float nonUniform,
+                                           std::vector<uint8_t> &similar) {
+    std::default_random_engine rng;
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> scale(0.25f, 4.0f);
+    std::vector<glm::mat4> worlds;
+    similar.clear();
+    for (size_t i = 0; i < count; ++i) {
+        glm::quat rotation = glm::normalize(
+            glm::quat(unit(rng), unit(rng), unit(rng), unit(rng)));
+        glm::vec3 s(scale(rng));
+        bool uniform = (unit(rng) + 1.0f) * 0.5f >= nonUniform;
+        if (!uniform) s = {scale(rng), scale(rng), scale(rng)};
+        glm::vec3 offset(unit(rng), unit(rng), unit(rng));
+        glm::mat4 world = glm::translate(glm::mat4(1.0f), 10.0f * offset);
+        world = glm::scale(world * glm::mat4_cast(rotation), s);
+        worlds.push_back(world);
+        similar.push_back(isSimilarity(world));
+    }
+    return worlds;
+}
+
+// Times the glm path drawMesh used to take against computeNodeMatrices
+// and reports how far their normal matrices are apart
+int main(int argc, char **argv) {
+    size_t count = argc > 1 ? std::atoi(argv[1]) : 10000;
+    int repeats = argc > 2 ? std::atoi(argv[2]) : 100;
+    glm::mat4 matView = glm::lookAt(glm::vec3(3.0f, 2.0f, 5.0f),
+                                    glm::vec3(0.0f), glm::vec3(0, 1, 0));
+
+    using Clock = std::chrono::steady_clock;
+    for (float nonUniform : {0.0f, 0.5f, 1.0f}) {
+        std::vector<uint8_t> similar;
+        auto worlds = randomWorlds(count, nonUniform, similar);
+        std::vector<glm::mat4> glmModelViews(count), glmNormals(count);
+        std::vector<glm::mat4> modelViews(count), normals(count);
+
+        auto start = Clock::now();
+        for (int r = 0; r < repeats; ++r) {
+            for (size_t i = 0; i < count; ++i) {
+                glmModelViews[i] = matView * worlds[i];
+                glmNormals[i] = glm::transpose(glm::inverse(glmModelViews[i]));
+            }
+        }
+        std::chrono::duration<double, std::nano> glmTime = Clock::now() - start;
+
+        start = Clock::now();
+        for (int r = 0; r < repeats; ++r)
+            computeNodeMatrices(matView, worlds.data(), similar.data(), count,
+                                modelViews.data(), normals.data());
+        std::chrono::duration<double, std::nano> batchTime
+            = Clock::now() - start;
+
+        // Relative to the largest entry of the glm matrix
+        float maxError = 0.0f;
+        for (size_t i = 0; i < count; ++i) {
+            float largest = 0.0f, error = 0.0f;
+            for (int c = 0; c < 3; ++c) {
+                for (int r = 0; r < 3; ++r) {
+                    largest = std::max(largest, std::abs(glmNormals[i][c][r]));
+                    error = std::max(error, std::abs(glmNormals[i][c][r]
+                                                     - normals[i][c][r]));
+                }
+            }
+            maxError = std::max(maxError, error / largest);
+        }
+
+        size_t similarCount = std::count(similar.begin(), similar.end(), 1);
+        double perNode = 1.0 / (double(count) * repeats);
+        std::cout << count << " nodes, " << similarCount
+                  << " similarities: glm " << glmTime.count() * perNode
+                  << " ns/node, batched " << batchTime.count() * perNode
+                  << " ns/node, max relative error " << maxError << '\n';
+    }
+    return 0;
+}
@@ -0,0 +1,117 @@
+#ifndef NORMALS_H
+#define NORMALS_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include <glm/geometric.hpp>
+#include <glm/mat3x3.hpp>
+#include <glm/mat4x4.hpp>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Relative tolerance for columns to count as orthogonal and equally long
+constexpr float SIMILARITY_TOLERANCE = 1e-4f;
+
+// True for a rotation with uniform scale, plus any translation, whose
+// inverse transpose is the matrix itself over the squared scale
+inline bool isSimilarity(const glm::mat4 &mat) {
+    glm::vec3 c0(mat[0]), c1(mat[1]), c2(mat[2]);
+    float s2 = glm::dot(c0, c0);
+    if (s2 == 0.0f || mat[0][3] != 0.0f || mat[1][3] != 0.0f
+        || mat[2][3] != 0.0f)
+        return false;
+    float tolerance = SIMILARITY_TOLERANCE * s2;
+    return std::abs(glm::dot(c1, c1) - s2) <= tolerance
+           && std::abs(glm::dot(c2, c2) - s2) <= tolerance
+           && std::abs(glm::dot(c0, c1)) <= tolerance
+           && std::abs(glm::dot(c0, c2)) <= tolerance
+           && std::abs(glm::dot(c1, c2)) <= tolerance;
+}
+
+#ifdef __SSE2__
+inline __m128 cross3(__m128 a, __m128 b) {
+    __m128 aYzx = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 bYzx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(a, bYzx), _mm_mul_ps(aYzx, b));
+    return _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1));
+}
+
+// Sum of all four lanes of a * b, in every lane
+inline __m128 dot4(__m128 a, __m128 b) {
+    __m128 m = _mm_mul_ps(a, b);
+    m = _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+}
+#endif
+
+// Model-view matrices of a batch of nodes, and the normal matrices taking
+// their normals to view space. Only the upper 3x3 of a normal matrix is
+// set, as the inverse transpose from the cofactors, or for nodes marked
+// similar under a similar view, as the model-view matrix over its
+// squared scale.
+inline void computeNodeMatrices(const glm::mat4 &matView,
+                                const glm::mat4 *worlds,
+                                const uint8_t *similar, size_t count,
+                                glm::mat4 *modelViews, glm::mat4 *normals) {
+    bool viewSimilar = isSimilarity(matView);
+#ifdef __SSE2__
+    __m128 view[4];
+    for (int c = 0; c < 4; ++c) view[c] = _mm_loadu_ps(&matView[c][0]);
+    const __m128 xyz = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+    const __m128 unitW = _mm_set_ps(1.0f, 0.0f, 0.0f, 0.0f);
+    for (size_t i = 0; i < count; ++i) {
+        const float *world = &worlds[i][0][0];
+        float *modelView = &modelViews[i][0][0];
+        __m128 mv[4];
+        for (int c = 0; c < 4; ++c) {
+            const float *column = world + 4 * c;
+            __m128 sum = _mm_mul_ps(view[0], _mm_set1_ps(column[0]));
+            sum = _mm_add_ps(sum, _mm_mul_ps(view[1], _mm_set1_ps(column[1])));
+            sum = _mm_add_ps(sum, _mm_mul_ps(view[2], _mm_set1_ps(column[2])));
+            sum = _mm_add_ps(sum, _mm_mul_ps(view[3], _mm_set1_ps(column[3])));
+            mv[c] = sum;
+            _mm_storeu_ps(modelView + 4 * c, sum);
+        }
+
+        __m128 c0 = _mm_and_ps(mv[0], xyz);
+        __m128 c1 = _mm_and_ps(mv[1], xyz);
+        __m128 c2 = _mm_and_ps(mv[2], xyz);
+        __m128 n0, n1, n2, scale;
+        if (viewSimilar && similar[i]) {
+            n0 = c0, n1 = c1, n2 = c2;
+            scale = _mm_div_ps(_mm_set1_ps(1.0f), dot4(c0, c0));
+        } else {
+            n0 = cross3(c1, c2);
+            n1 = cross3(c2, c0);
+            n2 = cross3(c0, c1);
+            scale = _mm_div_ps(_mm_set1_ps(1.0f), dot4(c0, n0));
+        }
+        float *normal = &normals[i][0][0];
+        _mm_storeu_ps(normal, _mm_mul_ps(n0, scale));
+        _mm_storeu_ps(normal + 4, _mm_mul_ps(n1, scale));
+        _mm_storeu_ps(normal + 8, _mm_mul_ps(n2, scale));
+        _mm_storeu_ps(normal + 12, unitW);
+    }
+#else
+    for (size_t i = 0; i < count; ++i) {
+        glm::mat4 mv = matView * worlds[i];
+        modelViews[i] = mv;
+        glm::vec3 c0(mv[0]), c1(mv[1]), c2(mv[2]);
+        glm::mat3 n;
+        if (viewSimilar && similar[i]) {
+            n = glm::mat3(c0, c1, c2) / glm::dot(c0, c0);
+        } else {
+            n = glm::mat3(glm::cross(c1, c2), glm::cross(c2, c0),
+                          glm::cross(c0, c1));
+            n /= glm::dot(c0, n[0]);
+        }
+        normals[i] = glm::mat4(n);
+    }
+#endif
+}
+
+#endif
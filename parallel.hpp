@@ -0,0 +1,59 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+inline size_t workerCount() {
+    size_t n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+// Set on the threads of a running parallelFor
+inline thread_local bool insideParallelFor = false;
+
+// Calls fn(i) for every i in [0, count) on all cores.
+// Items are handed out one by one, so uneven workloads balance themselves.
+// The first exception thrown by fn is rethrown on the calling thread.
+// Nested calls run serially, the outer loop already keeps the cores busy.
+template <typename F> void parallelFor(size_t count, F &&fn) {
+    size_t nThreads = std::min(workerCount(), count);
+    if (nThreads <= 1 || insideParallelFor) {
+        for (size_t i = 0; i < count; ++i) fn(i);
+        return;
+    }
+
+    std::atomic<size_t> next = 0;
+    std::exception_ptr error;
+    std::mutex errorMutex;
+
+    auto work = [&]() {
+        bool outer = insideParallelFor;
+        insideParallelFor = true;
+        for (size_t i = next++; i < count; i = next++) {
+            try {
+                fn(i);
+            } catch (...) {
+                std::lock_guard _lock(errorMutex);
+                if (!error) error = std::current_exception();
+                next = count;
+            }
+        }
+        insideParallelFor = outer;
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(nThreads - 1);
+    for (size_t i = 1; i < nThreads; ++i) threads.emplace_back(work);
+    work();
+    for (auto &thread : threads) thread.join();
+
+    if (error) std::rethrow_exception(error);
+}
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include "geometry.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <glm/common.hpp>
+#include <glm/ext/matrix_transform.hpp>
+#include <glm/geometric.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/trigonometric.hpp>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+
+// IEEE 754 binary16, rounding to nearest even
+inline uint16_t floatToHalf(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t magnitude = bits & 0x7fffffff;
+    if (magnitude >= 0x7f800000)
+        return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0);
+    // 65520 and above round to infinity
+    if (magnitude >= 0x477ff000) return sign | 0x7c00;
+    if (magnitude < 0x38800000) {
+        // Subnormal, in units of 2^-24
+        float abs;
+        std::memcpy(&abs, &magnitude, sizeof(abs));
+        return sign | uint16_t(std::nearbyint(abs * 16777216.0f));
+    }
+    uint32_t rounded = magnitude + 0xfff + ((magnitude >> 13) & 1);
+    return sign | ((rounded - 0x38000000) >> 13);
+}
+
+inline float halfToFloat(uint16_t half) {
+    uint32_t sign = uint32_t(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x3ff;
+    if (exponent == 0) {
+        float value = mantissa / 16777216.0f;
+        return sign ? -value : value;
+    }
+    uint32_t bits = exponent == 0x1f
+                        ? sign | 0x7f800000 | (mantissa << 13)
+                        : sign | ((exponent + 112) << 23) | (mantissa << 13);
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+inline int16_t floatToSnorm16(float value) {
+    return int16_t(std::lround(glm::clamp(value, -1.0f, 1.0f) * 32767.0f));
+}
+
+inline float snorm16ToFloat(int16_t value) {
+    return std::max(value / 32767.0f, -1.0f);
+}
+
+// Maps a unit vector onto the octahedron unfolded into [-1, 1]^2
+inline glm::vec2 octahedralEncode(const glm::vec3 &n) {
+    glm::vec3 v = n / (std::abs(n.x) + std::abs(n.y) + std::abs(n.z));
+    glm::vec2 e(v.x, v.y);
+    if (v.z < 0.0f) {
+        glm::vec2 sign(e.x >= 0.0f ? 1.0f : -1.0f, e.y >= 0.0f ? 1.0f : -1.0f);
+        e = (1.0f - glm::abs(glm::vec2(e.y, e.x))) * sign;
+    }
+    return e;
+}
+
+// Same decoding as gbuf.vert
+inline glm::vec3 octahedralDecode(const glm::vec2 &e) {
+    glm::vec3 v(e.x, e.y, 1.0f - std::abs(e.x) - std::abs(e.y));
+    float t = std::max(-v.z, 0.0f);
+    v.x += v.x >= 0.0f ? -t : t;
+    v.y += v.y >= 0.0f ? -t : t;
+    return glm::normalize(v);
+}
+
+// Largest differences between a mesh's vertices and their quantized form
+struct QuantizationError {
+    // In mesh units, and relative to the diagonal of the mesh's bounds
+    float position = 0.0f;
+    float positionRelative = 0.0f;
+    float normalDegrees = 0.0f;
+    float texCoord = 0.0f;
+};
+
+// Converts geometry to QuantizedVertex. Positions are quantized per mesh
+// over the mesh's bounding box, whose mapping back is stored in
+// meshDequantization. Returns the error per mesh.
+inline std::vector<QuantizationError> quantizeGeometry(Geometry &geometry) {
+    size_t meshCount = geometry.meshFirstDraw.size() - 1;
+    std::vector<QuantizationError> errors(meshCount);
+    geometry.meshDequantization.assign(meshCount, glm::mat4(1.0f));
+    geometry.quantizedVertices.resize(geometry.vertices.size());
+
+    parallelFor(meshCount, [&](size_t meshId) {
+        uint32_t first = geometry.meshFirstDraw[meshId];
+        uint32_t end = geometry.meshFirstDraw[meshId + 1];
+        auto forEachVertex = [&](auto &&fn) {
+            for (uint32_t drawId = first; drawId < end; ++drawId) {
+                auto &draw = geometry.draws[drawId];
+                for (uint32_t i = 0; i < draw.vertexCount; ++i)
+                    fn(size_t(draw.baseVertex) + i);
+            }
+        };
+
+        glm::vec3 lo(INFINITY), hi(-INFINITY);
+        forEachVertex([&](size_t v) {
+            lo = glm::min(lo, geometry.vertices[v].position);
+            hi = glm::max(hi, geometry.vertices[v].position);
+        });
+        if (lo.x > hi.x) return;
+        glm::vec3 extent = hi - lo;
+        geometry.meshDequantization[meshId]
+            = glm::scale(glm::translate(glm::mat4(1.0f), lo), extent);
+
+        auto &error = errors[meshId];
+        forEachVertex([&](size_t v) {
+            auto &src = geometry.vertices[v];
+            auto &dst = geometry.quantizedVertices[v];
+
+            glm::vec3 position(0.0f);
+            for (int c = 0; c < 3; ++c) {
+                float unit = extent[c] > 0.0f
+                                 ? (src.position[c] - lo[c]) / extent[c]
+                                 : 0.0f;
+                dst.position[c]
+                    = uint16_t(std::lround(glm::clamp(unit, 0.0f, 1.0f)
+                                           * 65535.0f));
+                position[c] = lo[c] + dst.position[c] / 65535.0f * extent[c];
+            }
+            dst.position[3] = 0;
+            error.position = std::max(error.position,
+                                      glm::length(position - src.position));
+
+            float length = glm::length(src.normal);
+            if (length > 0.0f) {
+                glm::vec3 normal = src.normal / length;
+                glm::vec2 encoded = octahedralEncode(normal);
+                dst.normal[0] = floatToSnorm16(encoded.x);
+                dst.normal[1] = floatToSnorm16(encoded.y);
+                glm::vec3 decoded
+                    = octahedralDecode({snorm16ToFloat(dst.normal[0]),
+                                        snorm16ToFloat(dst.normal[1])});
+                float cosine = glm::clamp(glm::dot(decoded, normal), -1.0f,
+                                          1.0f);
+                error.normalDegrees = std::max(
+                    error.normalDegrees, glm::degrees(std::acos(cosine)));
+            } else {
+                dst.normal[0] = dst.normal[1] = 0;
+            }
+
+            for (int c = 0; c < 2; ++c) {
+                dst.texCoord[c] = floatToHalf(src.texCoord[c]);
+                error.texCoord = std::max(
+                    error.texCoord,
+                    std::abs(halfToFloat(dst.texCoord[c]) - src.texCoord[c]));
+            }
+        });
+        float diagonal = glm::length(extent);
+        error.positionRelative
+            = diagonal > 0.0f ? error.position / diagonal : 0.0f;
+    });
+
+    geometry.vertices = std::vector<Vertex>();
+    geometry.quantized = true;
+    return errors;
+}
+
+#endif
@@ -1,11 +1,14 @@
 #ifndef ROUTINE_H
 #define ROUTINE_H
 
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
 
+#include "trace.hpp"
+
 #include <glad/gl.h>
 
 #include <GLFW/glfw3.h>
@@ -70,13 +73,48 @@ inline void APIENTRY glDebugOutput(GLenum source, GLenum type, unsigned int id,
     std::cout << std::endl;
 }
 
+inline bool hasExtension(const char *name) {
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i = 0; i < count; ++i) {
+        auto ext
+            = reinterpret_cast<const char *>(glGetStringi(GL_EXTENSIONS, i));
+        if (std::strcmp(ext, name) == 0) return true;
+    }
+    return false;
+}
+
 inline GLFWwindow *window;
 
+// Looks up entry points glad does not load, set with the current context
+inline GLADloadfunc getProcAddress = nullptr;
+
+// For the context current on the calling thread
+inline void enableDebugOutput() {
+    glEnable(GL_DEBUG_OUTPUT);
+    glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+    glDebugMessageCallback(glDebugOutput, nullptr);
+    glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, nullptr,
+                          GL_TRUE);
+}
+
+// Hidden window whose context shares objects with the main window's,
+// to be made current on another thread. GLFW wants it created and
+// destroyed on the main thread.
+inline GLFWwindow *createSharedContext() {
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    GLFWwindow *shared = glfwCreateWindow(1, 1, "Loader", nullptr, window);
+    glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+    if (!shared) throw std::runtime_error("Could not create shared context");
+    return shared;
+}
+
 struct RaiiContext {
     RaiiContext(const RaiiContext &) = delete;
     RaiiContext &operator=(const RaiiContext &) = delete;
 
     RaiiContext() {
+        TraceScope _trace("window");
         glfwSetErrorCallback(errorCallback);
 
         if (!glfwInit()) {
@@ -94,13 +132,10 @@ struct RaiiContext {
 
         glfwMakeContextCurrent(window);
         gladLoadGL(glfwGetProcAddress);
+        getProcAddress = glfwGetProcAddress;
         glfwSwapInterval(0);
 
-        glEnable(GL_DEBUG_OUTPUT);
-        glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
-        glDebugMessageCallback(glDebugOutput, nullptr);
-        glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0,
-                              nullptr, GL_TRUE);
+        enableDebugOutput();
 
         IMGUI_CHECKVERSION();
         ImGui::CreateContext();
@@ -151,11 +186,17 @@ struct Shader {
 
     Shader() : idx(0) {}
 
-    Shader(GLenum type, const char *filepath) {
+    // defines, if any, go right after the #version line
+    Shader(GLenum type, const char *filepath, const char *defines = nullptr) {
         std::ifstream ifs(filepath);
         std::ostringstream oss;
         oss << ifs.rdbuf();
         std::string str = oss.str();
+        if (defines) {
+            size_t eol = str.find('\n');
+            str.insert(eol == std::string::npos ? str.size() : eol + 1,
+                       defines);
+        }
 
         std::cout << "Compiling shader " << filepath << '\n';
         // std::cout << " with source code:\n"
@@ -215,17 +256,13 @@ struct ShaderProgram {
         idx = glCreateProgram();
         glAttachShader(get(), vert);
         glAttachShader(get(), frag);
-        glLinkProgram(get());
-
-        std::string str;
-        str.resize(4096);
-        GLsizei size = str.size();
-        glGetProgramInfoLog(get(), size, &size, str.data());
-        std::cout << "Linking log:\n" << str.data() << std::endl;
+        link();
+    }
 
-        GLint status = 0;
-        glGetProgramiv(get(), GL_LINK_STATUS, &status);
-        if (!status) throw std::runtime_error("Failed to link program");
+    explicit ShaderProgram(GLuint comp) {
+        idx = glCreateProgram();
+        glAttachShader(get(), comp);
+        link();
     }
 
     ~ShaderProgram() { clear(); }
@@ -246,6 +283,20 @@ struct ShaderProgram {
   private:
     GLuint idx = 0;
 
+    void link() {
+        glLinkProgram(get());
+
+        std::string str;
+        str.resize(4096);
+        GLsizei size = str.size();
+        glGetProgramInfoLog(get(), size, &size, str.data());
+        std::cout << "Linking log:\n" << str.data() << std::endl;
+
+        GLint status = 0;
+        glGetProgramiv(get(), GL_LINK_STATUS, &status);
+        if (!status) throw std::runtime_error("Failed to link program");
+    }
+
     GLuint release() {
         GLuint res = idx;
         idx = 0;
@@ -275,6 +326,8 @@ struct RaiiBind_Target {
 using RaiiBindBuffer = RaiiBind_Target<&glBindBuffer>;
 using RaiiBindTexture = RaiiBind_Target<&glBindTexture>;
 using RaiiBindFramebuffer = RaiiBind_Target<&glBindFramebuffer>;
+// Target is the texture unit
+using RaiiBindSampler = RaiiBind_Target<&glBindSampler>;
 
 template <void(GLAD_API_PTR **glBindNoTarget)(GLuint)>
 struct RaiiBind_NoTarget {
@@ -288,4 +341,41 @@ struct RaiiBind_NoTarget {
 using RaiiUseProgram = RaiiBind_NoTarget<&glUseProgram>;
 using RaiiBindVao = RaiiBind_NoTarget<&glBindVertexArray>;
 
+// GPU time between begin() and end(), read back a few frames later so the
+// CPU never waits for a query. Averages the results it sees.
+struct GpuTimer {
+    GpuTimer(const GpuTimer &) = delete;
+    GpuTimer &operator=(const GpuTimer &) = delete;
+
+    GpuTimer() { glGenQueries(LATENCY, queries); }
+    ~GpuTimer() { glDeleteQueries(LATENCY, queries); }
+
+    void begin() {
+        auto &query = queries[next];
+        if (pending[next]) {
+            GLuint64 nanos = 0;
+            glGetQueryObjectui64v(query, GL_QUERY_RESULT, &nanos);
+            millis += SMOOTHING * (nanos / 1e6 - millis);
+        }
+        glBeginQuery(GL_TIME_ELAPSED, query);
+    }
+
+    void end() {
+        glEndQuery(GL_TIME_ELAPSED);
+        pending[next] = true;
+        next = (next + 1) % LATENCY;
+    }
+
+    double averageMillis() const noexcept { return millis; }
+
+  private:
+    static constexpr int LATENCY = 4;
+    static constexpr double SMOOTHING = 0.05;
+
+    GLuint queries[LATENCY] = {};
+    bool pending[LATENCY] = {};
+    int next = 0;
+    double millis = 0.0;
+};
+
 #endif
@@ -0,0 +1,340 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "cull.hpp"
+#include "geometry.hpp"
+#include "normals.hpp"
+#include "routine.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <glm/ext/matrix_transform.hpp>
+#include <glm/ext/quaternion_float.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include <glm/gtx/quaternion.hpp>
+#include <glm/mat4x4.hpp>
+#include <glm/vec4.hpp>
+
+#include <tiny_gltf.h>
+
+// GL texture and sampler slots a glTF texture resolves to, -1 if unused
+struct TextureBinding {
+    int32_t texture = -1;
+    int32_t sampler = -1;
+};
+
+// Draw-ready copy of the default glTF scene, one array per field.
+// Nodes are stored depth first, so every parent precedes its children
+// and world transforms come out of a single forward pass.
+struct Scene {
+    struct MeshRange {
+        uint32_t firstPrimitive = 0;
+        uint32_t primitiveCount = 0;
+        // Errors of LODs 1 to lodCount are [firstLodError,
+        // firstLodError + lodCount) in meshLodErrors
+        uint32_t firstLodError = 0;
+        uint32_t lodCount = 0;
+    };
+
+    // Per node. The subtree of node i is [i, nodeSubtreeEnds[i]).
+    std::vector<int32_t> nodeParents;
+    std::vector<uint32_t> nodeSubtreeEnds;
+    std::vector<glm::mat4> nodeLocals;
+    std::vector<int32_t> nodeMeshes;
+    // A node has an instance per primitive of its mesh, those of node i
+    // are [nodeFirstInstance[i], nodeFirstInstance[i + 1])
+    std::vector<uint32_t> nodeFirstInstance;
+    std::vector<uint32_t> instanceNodes;
+    std::vector<uint32_t> instancePrims;
+
+    // Per glTF mesh, empty for meshes outside the scene
+    std::vector<MeshRange> meshes;
+    // Maps vertex positions to mesh space, identity unless quantized
+    std::vector<glm::mat4> meshDequantization;
+    // Bounding sphere in mesh space, center and radius
+    std::vector<glm::vec4> meshBounds;
+    // Per LOD of a mesh, the largest error of its primitives at that LOD
+    std::vector<float> meshLodErrors;
+
+    // Per primitive, all drawn from the shared buffers of Geometry
+    GLenum indexType = GL_UNSIGNED_SHORT;
+    bool quantized = false;
+    std::vector<GLenum> primModes;
+    std::vector<GLsizei> primCounts;
+    std::vector<size_t> primIndexOffsets;
+    std::vector<GLint> primBaseVertices;
+    std::vector<int32_t> primMaterials;
+    std::vector<GeometryBox> primBounds;
+    // Meshlets of primitive i are [primFirstMeshlet[i],
+    // primFirstMeshlet[i + 1]), none when they were not built
+    std::vector<Meshlet> meshlets;
+    std::vector<uint32_t> primFirstMeshlet;
+    // LODs of primitive i are [primFirstLod[i], primFirstLod[i + 1]).
+    // A mesh LOD past a primitive's last draws that last one.
+    std::vector<GeometryLod> lods;
+    std::vector<uint32_t> primFirstLod;
+
+    // Per material, texture and sampler -1 when untextured
+    std::vector<glm::vec4> baseColorFactors;
+    std::vector<int32_t> baseColorTextures;
+    std::vector<int32_t> baseColorSamplers;
+
+    size_t nodeCount() const noexcept { return nodeParents.size(); }
+};
+
+// World matrices of a scene's nodes and the world bounds of their
+// instances, kept from frame to frame. Only the subtrees under changed
+// local matrices are recomputed, and every node when the model matrix
+// above the roots changes.
+struct WorldTransforms {
+    std::vector<glm::mat4> worlds;
+    // Per node, whether its world matrix is a similarity, as every local
+    // matrix on its path and the model matrix are
+    std::vector<uint8_t> similar;
+    // Per instance
+    BoxSet boxes;
+    // Instance ranges [first, second) the last update moved
+    std::vector<std::pair<uint32_t, uint32_t>> movedInstances;
+    // Node ranges [first, second) the last update recomputed
+    std::vector<std::pair<uint32_t, uint32_t>> movedNodes;
+
+    // Its subtree is recomputed by the next update
+    void setLocal(Scene &scene, uint32_t nodeId, const glm::mat4 &local) {
+        scene.nodeLocals[nodeId] = local;
+        dirtyNodes.push_back(nodeId);
+    }
+
+    // Returns how many nodes were recomputed
+    size_t update(const Scene &scene, const glm::mat4 &matModel) {
+        size_t count = scene.nodeCount();
+        movedInstances.clear();
+        movedNodes.clear();
+        if (worlds.size() != count
+            || boxes.size() != scene.instanceNodes.size() || matModel != root) {
+            worlds.resize(count);
+            similar.resize(count);
+            boxes.resize(scene.instanceNodes.size());
+            root = matModel;
+            rootSimilar = isSimilarity(matModel);
+            dirtyNodes.clear();
+            recompute(scene, 0, count);
+            return count;
+        }
+
+        // A subtree nested in one recomputed before needs no pass of its
+        // own, as nodes are stored depth first
+        std::sort(dirtyNodes.begin(), dirtyNodes.end());
+        size_t updated = 0;
+        uint32_t doneUntil = 0;
+        for (uint32_t nodeId : dirtyNodes) {
+            if (nodeId < doneUntil) continue;
+            doneUntil = scene.nodeSubtreeEnds[nodeId];
+            recompute(scene, nodeId, doneUntil);
+            updated += doneUntil - nodeId;
+        }
+        dirtyNodes.clear();
+        return updated;
+    }
+
+  private:
+    glm::mat4 root{1.0f};
+    bool rootSimilar = true;
+    std::vector<uint32_t> dirtyNodes;
+
+    // Parents of begin are up to date already
+    void recompute(const Scene &scene, size_t begin, size_t end) {
+        uint32_t first = scene.nodeFirstInstance[begin];
+        uint32_t last = scene.nodeFirstInstance[end];
+        if (first < last) movedInstances.push_back({first, last});
+        if (begin < end)
+            movedNodes.push_back({uint32_t(begin), uint32_t(end)});
+        for (size_t i = begin; i < end; ++i) {
+            int32_t parent = scene.nodeParents[i];
+            worlds[i] = (parent < 0 ? root : worlds[parent])
+                        * scene.nodeLocals[i];
+            similar[i] = (parent < 0 ? rootSimilar : similar[parent])
+                         && isSimilarity(scene.nodeLocals[i]);
+            for (uint32_t instance = scene.nodeFirstInstance[i];
+                 instance < scene.nodeFirstInstance[i + 1]; ++instance)
+                boxes.set(instance, worlds[i],
+                          scene.primBounds[scene.instancePrims[instance]]);
+        }
+    }
+};
+
+inline glm::mat4 nodeLocalMatrix(const tinygltf::Node &node) {
+    if (node.matrix.size() == 16)
+        return glm::mat4(glm::make_mat4(node.matrix.data()));
+
+    glm::mat4 mat(1.0f);
+    if (node.translation.size() == 3) {
+        glm::vec3 vec = glm::make_vec3(node.translation.data());
+        mat = glm::translate(mat, vec);
+    }
+    if (node.rotation.size() == 4) {
+        glm::quat quat = glm::make_quat(node.rotation.data());
+        mat *= glm::toMat4(quat);
+    }
+    if (node.scale.size() == 3) {
+        glm::vec3 vec = glm::make_vec3(node.scale.data());
+        mat = glm::scale(mat, vec);
+    }
+    return mat;
+}
+
+// Flattens the default scene. Primitives come in the order of
+// geometry's draws, glTF textures map to GL slots through textures.
+inline Scene buildScene(const tinygltf::Model &model,
+                        const Geometry &geometry,
+                        const std::vector<TextureBinding> &textures) {
+    Scene scene;
+
+    struct Pending {
+        int nodeId;
+        int32_t parent;
+    };
+    std::vector<Pending> stack;
+    auto &roots = model.scenes[model.defaultScene].nodes;
+    for (size_t i = roots.size(); i-- > 0;) stack.push_back({roots[i], -1});
+    std::vector<bool> visited(model.nodes.size(), false);
+    while (!stack.empty()) {
+        auto [nodeId, parent] = stack.back();
+        stack.pop_back();
+        if (visited[nodeId]) continue;
+        visited[nodeId] = true;
+
+        auto &node = model.nodes[nodeId];
+        int32_t index = scene.nodeParents.size();
+        scene.nodeParents.push_back(parent);
+        scene.nodeLocals.push_back(nodeLocalMatrix(node));
+        bool hasMesh = 0 <= node.mesh && node.mesh < model.meshes.size();
+        scene.nodeMeshes.push_back(hasMesh ? node.mesh : -1);
+
+        for (size_t i = node.children.size(); i-- > 0;)
+            stack.push_back({node.children[i], index});
+    }
+    scene.nodeSubtreeEnds.resize(scene.nodeCount());
+    for (size_t i = scene.nodeCount(); i-- > 0;) {
+        auto &end = scene.nodeSubtreeEnds[i];
+        end = std::max<uint32_t>(end, i + 1);
+        int32_t parent = scene.nodeParents[i];
+        if (parent >= 0)
+            scene.nodeSubtreeEnds[parent]
+                = std::max(scene.nodeSubtreeEnds[parent], end);
+    }
+
+    if (geometry.meshFirstDraw.size() != model.meshes.size() + 1
+        || (geometry.quantized
+            && geometry.meshDequantization.size() != model.meshes.size()))
+        throw std::runtime_error("Geometry does not match the model");
+    size_t primCount = geometry.draws.size();
+    scene.indexType = geometry.indexType;
+    scene.quantized = geometry.quantized;
+    scene.primModes.resize(primCount);
+    scene.primCounts.resize(primCount);
+    scene.primIndexOffsets.resize(primCount);
+    scene.primBaseVertices.resize(primCount);
+    scene.primMaterials.resize(primCount);
+    if (geometry.drawBounds.size() == primCount)
+        scene.primBounds = geometry.drawBounds;
+    else
+        scene.primBounds.assign(primCount, GeometryBox{});
+    if (geometry.drawFirstMeshlet.size() == primCount + 1) {
+        scene.meshlets = geometry.meshlets;
+        scene.primFirstMeshlet = geometry.drawFirstMeshlet;
+    } else {
+        scene.primFirstMeshlet.assign(primCount + 1, 0);
+    }
+    if (geometry.drawFirstLod.size() == primCount + 1) {
+        scene.lods = geometry.lods;
+        scene.primFirstLod = geometry.drawFirstLod;
+    } else {
+        scene.primFirstLod.assign(primCount + 1, 0);
+    }
+    if (geometry.meshBounds.size() == model.meshes.size())
+        scene.meshBounds = geometry.meshBounds;
+    else
+        scene.meshBounds.assign(model.meshes.size(), glm::vec4(0.0f));
+
+    scene.meshes.resize(model.meshes.size());
+    if (geometry.quantized)
+        scene.meshDequantization = geometry.meshDequantization;
+    else
+        scene.meshDequantization.assign(model.meshes.size(), glm::mat4(1.0f));
+    for (int meshId = 0; meshId < model.meshes.size(); ++meshId) {
+        auto &range = scene.meshes[meshId];
+        range.firstPrimitive = geometry.meshFirstDraw[meshId];
+        range.primitiveCount
+            = geometry.meshFirstDraw[meshId + 1] - range.firstPrimitive;
+        if (range.primitiveCount == 0) continue;
+
+        auto &prims = model.meshes[meshId].primitives;
+        if (prims.size() != range.primitiveCount)
+            throw std::runtime_error("Geometry does not match the model");
+        for (uint32_t i = 0; i < range.primitiveCount; ++i) {
+            uint32_t primId = range.firstPrimitive + i;
+            auto &draw = geometry.draws[primId];
+            scene.primModes[primId] = prims[i].mode;
+            scene.primCounts[primId] = draw.indexCount;
+            scene.primIndexOffsets[primId]
+                = size_t(draw.firstIndex) * geometry.indexSize();
+            scene.primBaseVertices[primId] = draw.baseVertex;
+            scene.primMaterials[primId] = prims[i].material;
+        }
+
+        range.firstLodError = scene.meshLodErrors.size();
+        for (uint32_t primId = range.firstPrimitive;
+             primId < range.firstPrimitive + range.primitiveCount; ++primId)
+            range.lodCount = std::max(range.lodCount,
+                                      scene.primFirstLod[primId + 1]
+                                          - scene.primFirstLod[primId]);
+        for (uint32_t lod = 1; lod <= range.lodCount; ++lod) {
+            float error = 0.0f;
+            for (uint32_t primId = range.firstPrimitive;
+                 primId < range.firstPrimitive + range.primitiveCount;
+                 ++primId) {
+                uint32_t first = scene.primFirstLod[primId];
+                uint32_t count = scene.primFirstLod[primId + 1] - first;
+                if (count > 0)
+                    error = std::max(
+                        error,
+                        scene.lods[first + std::min(lod, count) - 1].error);
+            }
+            scene.meshLodErrors.push_back(error);
+        }
+    }
+
+    scene.nodeFirstInstance.push_back(0);
+    for (uint32_t nodeId = 0; nodeId < scene.nodeCount(); ++nodeId) {
+        int32_t meshId = scene.nodeMeshes[nodeId];
+        if (meshId >= 0) {
+            auto &range = scene.meshes[meshId];
+            for (uint32_t i = 0; i < range.primitiveCount; ++i) {
+                scene.instanceNodes.push_back(nodeId);
+                scene.instancePrims.push_back(range.firstPrimitive + i);
+            }
+        }
+        scene.nodeFirstInstance.push_back(scene.instanceNodes.size());
+    }
+
+    for (auto &material : model.materials) {
+        auto &pbr = material.pbrMetallicRoughness;
+        auto &factor = pbr.baseColorFactor;
+        scene.baseColorFactors.emplace_back(factor[0], factor[1], factor[2],
+                                            factor[3]);
+        int texture = pbr.baseColorTexture.index;
+        TextureBinding binding;
+        if (0 <= texture && texture < textures.size())
+            binding = textures[texture];
+        if (binding.texture < 0 || binding.sampler < 0) binding = {};
+        scene.baseColorTextures.push_back(binding.texture);
+        scene.baseColorSamplers.push_back(binding.sampler);
+    }
+    return scene;
+}
+
+#endif
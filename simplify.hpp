@@ -0,0 +1,256 @@
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+#include "geometry.hpp"
+#include "meshopt.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <glm/geometric.hpp>
+#include <glm/vec3.hpp>
+
+// Coarser versions built per primitive besides the full one
+constexpr size_t MAX_LODS = 3;
+// Each LOD aims for this share of the previous one's triangles
+constexpr float LOD_TRIANGLE_RATIO = 0.5f;
+// An LOD saving less than this share of triangles ends the chain
+constexpr float LOD_MIN_REDUCTION = 0.1f;
+// Share of the error threshold an LOD has to stay under to be switched
+// to, while it is kept up to the full threshold
+constexpr float LOD_HYSTERESIS = 0.8f;
+
+// Sum of squared distances to a set of planes, weighted by triangle area
+struct Quadric {
+    double aa = 0, ab = 0, ac = 0, ad = 0, bb = 0, bc = 0, bd = 0, cc = 0,
+           cd = 0, dd = 0;
+    double weight = 0;
+
+    void addPlane(const glm::dvec3 &n, double d, double w) {
+        aa += w * n.x * n.x, ab += w * n.x * n.y, ac += w * n.x * n.z;
+        ad += w * n.x * d, bb += w * n.y * n.y, bc += w * n.y * n.z;
+        bd += w * n.y * d, cc += w * n.z * n.z, cd += w * n.z * d;
+        dd += w * d * d, weight += w;
+    }
+
+    void add(const Quadric &q) {
+        aa += q.aa, ab += q.ab, ac += q.ac, ad += q.ad, bb += q.bb;
+        bc += q.bc, bd += q.bd, cc += q.cc, cd += q.cd, dd += q.dd;
+        weight += q.weight;
+    }
+
+    // Mean squared distance of p to the planes
+    double error(const glm::vec3 &p) const {
+        double x = p.x, y = p.y, z = p.z;
+        double sum = aa * x * x + 2 * ab * x * y + 2 * ac * x * z
+                     + 2 * ad * x + bb * y * y + 2 * bc * y * z + 2 * bd * y
+                     + cc * z * z + 2 * cd * z + dd;
+        return weight > 0 ? std::max(sum, 0.0) / weight : 0.0;
+    }
+};
+
+// Quadric error simplification by collapsing vertices into neighbors
+// (Garland and Heckbert 1997), keeping the vertex buffer as it is.
+// Vertices sharing a position with others, on UV or normal seams, and
+// vertices on open borders never move, so the silhouette and texture
+// mapping hold. Collapses that would flip a triangle are skipped.
+// Returns at least targetTriangles triangles; error is the distance the
+// surface moved, in mesh units.
+inline std::vector<uint32_t>
+simplifyIndices(std::vector<uint32_t> indices, const Vertex *vertices,
+                size_t vertexCount, size_t targetTriangles, float &error) {
+    // Vertices at the same position share one topology id
+    std::vector<uint32_t> byPosition(vertexCount);
+    for (uint32_t v = 0; v < vertexCount; ++v) byPosition[v] = v;
+    auto less = [&](uint32_t a, uint32_t b) {
+        auto &pa = vertices[a].position, &pb = vertices[b].position;
+        if (pa.x != pb.x) return pa.x < pb.x;
+        if (pa.y != pb.y) return pa.y < pb.y;
+        return pa.z < pb.z;
+    };
+    std::sort(byPosition.begin(), byPosition.end(), less);
+    std::vector<uint32_t> topology(vertexCount);
+    std::vector<bool> locked(vertexCount, false);
+    for (size_t i = 0; i < vertexCount;) {
+        size_t end = i + 1;
+        while (end < vertexCount
+               && !less(byPosition[i], byPosition[end]))
+            ++end;
+        for (size_t k = i; k < end; ++k) {
+            topology[byPosition[k]] = byPosition[i];
+            locked[byPosition[k]] = end - i > 1;
+        }
+        i = end;
+    }
+
+    // An edge without its opposite half lies on a border
+    std::vector<uint64_t> edges;
+    for (size_t i = 0; i < indices.size(); i += 3) {
+        for (int k = 0; k < 3; ++k) {
+            uint64_t a = topology[indices[i + k]];
+            uint64_t b = topology[indices[i + (k + 1) % 3]];
+            edges.push_back(a << 32 | b);
+        }
+    }
+    std::sort(edges.begin(), edges.end());
+    for (uint64_t edge : edges) {
+        uint64_t opposite = edge << 32 | edge >> 32;
+        if (!std::binary_search(edges.begin(), edges.end(), opposite)) {
+            locked[edge >> 32] = true;
+            locked[edge & UINT32_MAX] = true;
+        }
+    }
+    for (uint32_t v = 0; v < vertexCount; ++v)
+        if (locked[topology[v]]) locked[v] = true;
+
+    std::vector<Quadric> quadrics(vertexCount);
+    for (size_t i = 0; i < indices.size(); i += 3) {
+        glm::dvec3 p0 = vertices[indices[i]].position;
+        glm::dvec3 p1 = vertices[indices[i + 1]].position;
+        glm::dvec3 p2 = vertices[indices[i + 2]].position;
+        glm::dvec3 normal = glm::cross(p1 - p0, p2 - p0);
+        double area = glm::length(normal);
+        if (area <= 0) continue;
+        normal /= area;
+        for (int k = 0; k < 3; ++k)
+            quadrics[indices[i + k]].addPlane(normal, -glm::dot(normal, p0),
+                                              area);
+    }
+
+    struct Collapse {
+        uint32_t from;
+        uint32_t to;
+        double cost;
+    };
+    double maxCost = 0;
+    size_t triangles = indices.size() / 3;
+    std::vector<Collapse> candidates;
+    std::vector<uint32_t> into(vertexCount);
+    std::vector<bool> touched(vertexCount);
+    while (triangles > targetTriangles) {
+        candidates.clear();
+        for (size_t i = 0; i < indices.size(); i += 3) {
+            for (int k = 0; k < 3; ++k) {
+                uint32_t a = indices[i + k];
+                uint32_t b = indices[i + (k + 1) % 3];
+                if (!locked[a])
+                    candidates.push_back(
+                        {a, b, quadrics[a].error(vertices[b].position)});
+                if (!locked[b])
+                    candidates.push_back(
+                        {b, a, quadrics[b].error(vertices[a].position)});
+            }
+        }
+        if (candidates.empty()) break;
+        // Every collapse removes about two triangles. Considering twice
+        // as many as needed keeps a pass from reaching for expensive ones
+        // while cheap ones are only blocked by their neighbors.
+        size_t wanted
+            = std::min(candidates.size(), triangles - targetTriangles);
+        auto cheaper = [](const Collapse &a, const Collapse &b) {
+            return a.cost < b.cost;
+        };
+        std::nth_element(candidates.begin(), candidates.begin() + wanted - 1,
+                         candidates.end(), cheaper);
+        candidates.resize(wanted);
+        std::sort(candidates.begin(), candidates.end(), cheaper);
+
+        VertexAdjacency adjacency(indices, vertexCount);
+        for (uint32_t v = 0; v < vertexCount; ++v) into[v] = v;
+        std::fill(touched.begin(), touched.end(), false);
+        size_t collapsed = 0;
+        for (auto &candidate : candidates) {
+            if (triangles <= targetTriangles) break;
+            uint32_t from = candidate.from, to = candidate.to;
+            if (touched[from] || touched[to]) continue;
+
+            bool flips = false;
+            size_t removed = 0;
+            glm::vec3 target = vertices[to].position;
+            for (uint32_t i = adjacency.offsets[from];
+                 i < adjacency.offsets[from + 1] && !flips; ++i) {
+                const uint32_t *tri = &indices[3 * adjacency.triangles[i]];
+                if (tri[0] == to || tri[1] == to || tri[2] == to) {
+                    ++removed;
+                    continue;
+                }
+                glm::vec3 p[3], q[3];
+                for (int k = 0; k < 3; ++k) {
+                    p[k] = vertices[tri[k]].position;
+                    q[k] = tri[k] == from ? target : p[k];
+                }
+                glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+                glm::vec3 after = glm::cross(q[1] - q[0], q[2] - q[0]);
+                flips = glm::dot(before, after) <= 0.0f;
+            }
+            if (flips) continue;
+
+            into[from] = to;
+            quadrics[to].add(quadrics[from]);
+            maxCost = std::max(maxCost, candidate.cost);
+            triangles -= removed;
+            ++collapsed;
+            // Neighbors keep still for the rest of the pass, so the flip
+            // checks above saw their final positions
+            for (uint32_t i = adjacency.offsets[from];
+                 i < adjacency.offsets[from + 1]; ++i)
+                for (int k = 0; k < 3; ++k)
+                    touched[indices[3 * adjacency.triangles[i] + k]] = true;
+        }
+        if (collapsed == 0) break;
+
+        size_t kept = 0;
+        for (size_t i = 0; i < indices.size(); i += 3) {
+            uint32_t a = into[indices[i]], b = into[indices[i + 1]],
+                     c = into[indices[i + 2]];
+            if (a == b || b == c || c == a) continue;
+            indices[kept++] = a, indices[kept++] = b, indices[kept++] = c;
+        }
+        indices.resize(kept);
+        triangles = kept / 3;
+    }
+    error = std::sqrt(maxCost);
+    return indices;
+}
+
+// One simplified index list of a draw, relative to its baseVertex
+struct DrawLod {
+    std::vector<uint32_t> indices;
+    float error = 0.0f;
+};
+
+// Up to MAX_LODS coarser versions of a triangle list draw, each built
+// from the previous one and ordered for the vertex cache
+inline std::vector<DrawLod> buildDrawLods(const Geometry &geometry,
+                                          const GeometryDraw &draw) {
+    std::vector<DrawLod> lods;
+    if (draw.indexCount % 3 != 0) return lods;
+    auto indices = readDrawIndices(geometry, draw);
+    const Vertex *vertices = geometry.vertices.data() + draw.baseVertex;
+    float error = 0.0f;
+    while (lods.size() < MAX_LODS) {
+        size_t triangles = indices.size() / 3;
+        size_t target = triangles * LOD_TRIANGLE_RATIO;
+        float lodError = 0.0f;
+        auto simplified = simplifyIndices(indices, vertices,
+                                          draw.vertexCount, target, lodError);
+        if (simplified.size() / 3
+            > triangles * (1.0f - LOD_MIN_REDUCTION))
+            break;
+
+        std::vector<bool> deadEnds;
+        auto order = tipsify(simplified, draw.vertexCount, deadEnds);
+        indices.clear();
+        for (uint32_t t : order)
+            indices.insert(indices.end(), &simplified[3 * t],
+                           &simplified[3 * t] + 3);
+        // Each step moved the surface of the previous one
+        error += lodError;
+        lods.push_back({indices, error});
+    }
+    return lods;
+}
+
+#endif
@@ -0,0 +1,74 @@
+#include "gltf.hpp"
+#include "texcompress.hpp"
+
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+
+// Hashes the encoded bytes before handing them to the default loader
+static bool hashingImageLoader(tinygltf::Image *image, const int imageId,
+                               std::string *err, std::string *warn,
+                               int reqWidth, int reqHeight,
+                               const unsigned char *bytes, int size,
+                               void *userData) {
+    auto &hashes = *static_cast<std::map<int, uint64_t> *>(userData);
+    hashes[imageId] = hashBytes(bytes, size);
+    return tinygltf::LoadImageData(image, imageId, err, warn, reqWidth,
+                                   reqHeight, bytes, size, nullptr);
+}
+
+static const char *formatName(BcFormat format) {
+    switch (format) {
+    case BcFormat::BC1: return "BC1";
+    case BcFormat::BC5: return "BC5";
+    case BcFormat::BC7: return "BC7";
+    }
+    return "?";
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " model.gltf|model.glb\n"
+                  << "Writes a block compressed .ktx2 file for every image\n";
+        return 1;
+    }
+    std::string path = argv[1];
+
+    tinygltf::Model model;
+    std::map<int, uint64_t> hashes;
+    std::string err;
+    std::string warn;
+    GltfFile gltf;
+    bool ret
+        = gltf.load(model, path, err, warn, hashingImageLoader, &hashes);
+    std::cout << "Warnings: " << warn << "\nErrors: " << err << '\n';
+    if (!ret) throw std::runtime_error("Could not load model");
+
+    using Clock = std::chrono::steady_clock;
+    auto start = Clock::now();
+    auto usages = classifyImages(model);
+    for (int imageId = 0; imageId < model.images.size(); ++imageId) {
+        auto &img = model.images[imageId];
+        if (img.image.empty() || !hashes.count(imageId)) continue;
+
+        auto imgStart = Clock::now();
+        auto rgba = toRgba8(img.image.data(), img.width, img.height,
+                            img.component, img.bits);
+        std::vector<unsigned char> texels;
+        auto chain = buildMipChain(texels, rgba.data(), img.width, img.height,
+                                   usages[imageId]);
+        BcFormat format = chooseBcFormat(usages[imageId], chain[0]);
+        std::string outPath = ktx2PathFor(path, img, imageId);
+        compressToKtx2(outPath, format, chain, hashes[imageId]);
+
+        std::chrono::duration<double, std::milli> dt = Clock::now() - imgStart;
+        std::cout << outPath << ": " << formatName(format) << ' ' << img.width
+                  << 'x' << img.height << ", " << chain.size()
+                  << " levels in " << dt.count() << " ms\n";
+    }
+    std::chrono::duration<double, std::milli> total = Clock::now() - start;
+    std::cout << "Compressed in " << total.count() << " ms on "
+              << workerCount() << " threads\n";
+    return 0;
+}
@@ -0,0 +1,107 @@
+#ifndef TEXCOMPRESS_H
+#define TEXCOMPRESS_H
+
+#include "bc.hpp"
+#include "cache.hpp"
+#include "image.hpp"
+#include "ktx2.hpp"
+#include "mip.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <tiny_gltf.h>
+
+// How each image is referenced by the materials, base color winning ties
+inline std::vector<ImageUsage> classifyImages(const tinygltf::Model &model) {
+    std::vector<ImageUsage> usages(model.images.size(), ImageUsage::Unknown);
+    auto mark = [&](int textureId, ImageUsage usage) {
+        if (textureId < 0 || textureId >= model.textures.size()) return;
+        int imageId = model.textures[textureId].source;
+        if (imageId < 0 || imageId >= usages.size()) return;
+        if (usages[imageId] == ImageUsage::Unknown
+            || usage == ImageUsage::BaseColor)
+            usages[imageId] = usage;
+    };
+    for (auto &material : model.materials) {
+        auto &pbr = material.pbrMetallicRoughness;
+        mark(material.normalTexture.index, ImageUsage::Normal);
+        mark(material.occlusionTexture.index, ImageUsage::Orm);
+        mark(pbr.metallicRoughnessTexture.index, ImageUsage::Orm);
+        mark(pbr.baseColorTexture.index, ImageUsage::BaseColor);
+    }
+    return usages;
+}
+
+// Opaque color fits BC1, normal maps only need two channels in BC5,
+// and BC7 keeps the uncorrelated ORM channels (and alpha) apart
+inline BcFormat chooseBcFormat(ImageUsage usage, const MipLevel &rgba) {
+    switch (usage) {
+    case ImageUsage::Normal: return BcFormat::BC5;
+    case ImageUsage::BaseColor:
+        for (size_t i = 3; i < rgba.size; i += 4)
+            if (rgba.data[i] != 255) return BcFormat::BC7;
+        return BcFormat::BC1;
+    default: return BcFormat::BC7;
+    }
+}
+
+// Next to the image file, or next to the glTF for embedded images
+inline std::string ktx2PathFor(const std::string &gltfPath,
+                               const tinygltf::Image &image, int imageId) {
+    if (!image.uri.empty() && image.uri.rfind("data:", 0) != 0) {
+        std::string file;
+        tinygltf::URIDecode(image.uri, &file, nullptr);
+        auto path = std::filesystem::path(gltfPath).parent_path() / file;
+        return path.replace_extension(".ktx2").string();
+    }
+    return gltfPath + ".image" + std::to_string(imageId) + ".ktx2";
+}
+
+constexpr const char *KTX2_SOURCE_HASH_KEY = "hw03.sourceHash";
+
+inline std::string hashHex(uint64_t hash) {
+    char str[17];
+    std::snprintf(str, sizeof(str), "%016llx",
+                  static_cast<unsigned long long>(hash));
+    return str;
+}
+
+inline std::vector<std::vector<unsigned char>>
+compressLevels(BcFormat format, const std::vector<MipLevel> &rgba) {
+    std::vector<std::vector<unsigned char>> levels;
+    for (auto &level : rgba) levels.push_back(compressLevel(format, level));
+    return levels;
+}
+
+// Writes levels compressed from rgba to path. sourceHash is the hash of
+// the encoded image, so loaders can tell a stale file.
+inline void
+writeCompressedKtx2(const std::string &path, BcFormat format,
+                    const std::vector<MipLevel> &rgba,
+                    const std::vector<std::vector<unsigned char>> &levels,
+                    uint64_t sourceHash) {
+    writeKtx2(path, format, rgba[0].width, rgba[0].height, levels,
+              {{"KTXwriter", "hw03_texcompress"},
+               {KTX2_SOURCE_HASH_KEY, hashHex(sourceHash)}});
+}
+
+// Compresses a full RGBA8 chain and writes it to path
+inline std::vector<std::vector<unsigned char>>
+compressToKtx2(const std::string &path, BcFormat format,
+               const std::vector<MipLevel> &rgba, uint64_t sourceHash) {
+    auto levels = compressLevels(format, rgba);
+    writeCompressedKtx2(path, format, rgba, levels, sourceHash);
+    return levels;
+}
+
+inline bool ktx2MatchesSource(const Ktx2Texture &texture,
+                              uint64_t sourceHash) {
+    auto value = texture.find(KTX2_SOURCE_HASH_KEY);
+    return value && *value == hashHex(sourceHash);
+}
+
+#endif
@@ -0,0 +1,248 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include "bc.hpp"
+#include "image.hpp"
+#include "routine.hpp"
+#include "upload.hpp"
+
+#include <cstring>
+#include <vector>
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+
+inline GLenum glBcFormat(BcFormat format) {
+    switch (format) {
+    case BcFormat::BC1: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    case BcFormat::BC5: return GL_COMPRESSED_RG_RGTC2;
+    case BcFormat::BC7: return GL_COMPRESSED_RGBA_BPTC_UNORM;
+    }
+    return 0;
+}
+
+// RGTC is core since 3.0 and BPTC since 4.2, S3TC is still an extension
+inline bool bcTexturesSupported() {
+    return GLAD_GL_VERSION_4_2
+           && hasExtension("GL_EXT_texture_compression_s3tc");
+}
+
+inline size_t levelBytes(GLenum format, int width, int height) {
+    switch (format) {
+    case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+        return bcLevelBytes(BcFormat::BC1, width, height);
+    case GL_COMPRESSED_RG_RGTC2:
+        return bcLevelBytes(BcFormat::BC5, width, height);
+    case GL_COMPRESSED_RGBA_BPTC_UNORM:
+        return bcLevelBytes(BcFormat::BC7, width, height);
+    default: return size_t(4) * width * height;
+    }
+}
+
+// Texture whose levels are uploaded over several frames, smallest first.
+// Levels [levels.size() - resident, levels.size()) are on the GPU,
+// and the base level is kept at the largest of them.
+struct StreamedTexture {
+    GLuint tex = 0;
+    // GL_RGBA8 or one of the block compressed formats above
+    GLenum format = GL_RGBA8;
+    std::vector<MipLevel> levels;
+    // Backing store of levels unless they point into a mapped cache
+    std::vector<unsigned char> texels;
+    size_t resident = 0;
+
+    bool isComplete() const noexcept { return resident == levels.size(); }
+
+    size_t residentBytes() const noexcept {
+        size_t sum = 0;
+        for (size_t i = levels.size() - resident; i < levels.size(); ++i)
+            sum += levels[i].size;
+        return sum;
+    }
+
+    // Creates immutable storage for all levels without uploading any.
+    // Filtering and wrapping come from a sampler object.
+    void allocate() {
+        glGenTextures(1, &tex);
+        RaiiBindTexture _bind(GL_TEXTURE_2D, tex);
+        glTexStorage2D(GL_TEXTURE_2D, levels.size(), format,
+                       levels[0].width, levels[0].height);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL,
+                        levels.size() - 1);
+    }
+
+    void releaseTexels() {
+        for (auto &level : levels) level.data = nullptr;
+        texels.clear();
+        texels.shrink_to_fit();
+    }
+};
+
+// Filtering and wrapping of a glTF sampler. Unset or invalid values fall
+// back to bilinear filtering and repeating.
+struct SamplerState {
+    GLint minFilter = GL_LINEAR;
+    GLint magFilter = GL_LINEAR;
+    GLint wrapS = GL_REPEAT;
+    GLint wrapT = GL_REPEAT;
+
+    SamplerState() = default;
+    SamplerState(int minFilter, int magFilter, int wrapS, int wrapT) {
+        switch (minFilter) {
+        case GL_NEAREST:
+        case GL_LINEAR:
+        case GL_NEAREST_MIPMAP_NEAREST:
+        case GL_LINEAR_MIPMAP_NEAREST:
+        case GL_NEAREST_MIPMAP_LINEAR:
+        case GL_LINEAR_MIPMAP_LINEAR: this->minFilter = minFilter; break;
+        }
+        if (magFilter == GL_NEAREST || magFilter == GL_LINEAR)
+            this->magFilter = magFilter;
+        this->wrapS = validWrap(wrapS);
+        this->wrapT = validWrap(wrapT);
+    }
+
+    bool operator==(const SamplerState &rhs) const noexcept {
+        return minFilter == rhs.minFilter && magFilter == rhs.magFilter
+               && wrapS == rhs.wrapS && wrapT == rhs.wrapT;
+    }
+
+    GLuint create() const {
+        GLuint sampler = 0;
+        glGenSamplers(1, &sampler);
+        glSamplerParameteri(sampler, GL_TEXTURE_MIN_FILTER, minFilter);
+        glSamplerParameteri(sampler, GL_TEXTURE_MAG_FILTER, magFilter);
+        glSamplerParameteri(sampler, GL_TEXTURE_WRAP_S, wrapS);
+        glSamplerParameteri(sampler, GL_TEXTURE_WRAP_T, wrapT);
+        return sampler;
+    }
+
+  private:
+    static GLint validWrap(int wrap) {
+        switch (wrap) {
+        case GL_CLAMP_TO_EDGE:
+        case GL_MIRRORED_REPEAT: return wrap;
+        default: return GL_REPEAT;
+        }
+    }
+};
+
+inline GLuint createSolidTexture(const unsigned char rgba[4]) {
+    GLuint tex = 0;
+    glGenTextures(1, &tex);
+    RaiiBindTexture _bind(GL_TEXTURE_2D, tex);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA,
+                 GL_UNSIGNED_BYTE, rgba);
+    return tex;
+}
+
+// Uploads pending levels under a byte budget, through the staging ring
+// or a pixel buffer object of its own
+struct TextureStreamer {
+    TextureStreamer(const TextureStreamer &) = delete;
+    TextureStreamer &operator=(const TextureStreamer &) = delete;
+
+    TextureStreamer() = default;
+    ~TextureStreamer() { glDeleteBuffers(1, &pbo); }
+
+    // Picks the smallest pending level over all textures until the budget
+    // is spent. At least one level goes per call, so levels larger than
+    // the budget still get through. Returns the number of bytes uploaded.
+    size_t stream(std::vector<StreamedTexture> &textures, size_t budget,
+                  StagingRing *ring = nullptr) {
+        std::vector<Upload> uploads;
+        std::vector<size_t> planned(textures.size());
+        for (size_t i = 0; i < textures.size(); ++i)
+            planned[i] = textures[i].resident;
+
+        size_t total = 0;
+        for (;;) {
+            size_t best = textures.size();
+            size_t bestSize = 0;
+            for (size_t i = 0; i < textures.size(); ++i) {
+                auto &texture = textures[i];
+                if (!texture.tex || planned[i] == texture.levels.size())
+                    continue;
+                size_t size
+                    = texture.levels[texture.levels.size() - planned[i] - 1]
+                          .size;
+                if (best == textures.size() || size < bestSize) {
+                    best = i;
+                    bestSize = size;
+                }
+            }
+            if (best == textures.size()) break;
+            if (!uploads.empty() && total + bestSize > budget) break;
+
+            auto &texture = textures[best];
+            size_t level = texture.levels.size() - planned[best] - 1;
+            ++planned[best];
+            uploads.push_back({&texture, level, total});
+            total += (bestSize + 3) / 4 * 4;
+        }
+        if (uploads.empty()) return 0;
+
+        if (ring) {
+            for (auto &upload : uploads) {
+                auto &texture = *upload.texture;
+                auto &level = texture.levels[upload.level];
+                ring->uploadTexture(texture.tex, upload.level, level.width,
+                                    level.height, texture.format, level.data,
+                                    level.size);
+            }
+            ring->flush();
+        } else {
+            uploadThroughPbo(uploads, total);
+        }
+
+        for (auto &upload : uploads) {
+            RaiiBindTexture _bindTex(GL_TEXTURE_2D, upload.texture->tex);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL,
+                            upload.level);
+            ++upload.texture->resident;
+        }
+        return total;
+    }
+
+  private:
+    struct Upload {
+        StreamedTexture *texture;
+        size_t level;
+        size_t offset;
+    };
+
+    GLuint pbo = 0;
+
+    void uploadThroughPbo(const std::vector<Upload> &uploads, size_t total) {
+        if (!pbo) glGenBuffers(1, &pbo);
+        RaiiBindBuffer _bind(GL_PIXEL_UNPACK_BUFFER, pbo);
+        // Orphan the previous frame's storage instead of waiting for it
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, total, nullptr, GL_STREAM_DRAW);
+        auto dst = static_cast<unsigned char *>(
+            glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, total,
+                             GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+        if (!dst) throw std::runtime_error("Could not map upload buffer");
+        for (auto &upload : uploads) {
+            auto &level = upload.texture->levels[upload.level];
+            std::memcpy(dst + upload.offset, level.data, level.size);
+        }
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for (auto &upload : uploads) {
+            auto &texture = *upload.texture;
+            auto &level = texture.levels[upload.level];
+            RaiiBindTexture _bindTex(GL_TEXTURE_2D, texture.tex);
+            texSubImage2D(upload.level, level.width, level.height,
+                          texture.format,
+                          static_cast<char *>(nullptr) + upload.offset,
+                          level.size);
+        }
+    }
+};
+
+#endif
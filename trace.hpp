@@ -0,0 +1,104 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Wall time and bytes of one startup phase, for one asset where the phase
+// handles several. Phases run on worker threads record one event per
+// asset, so their sum is work rather than wall time.
+struct TraceEvent {
+    std::string phase;
+    std::string asset;
+    double millis = 0.0;
+    size_t bytes = 0;
+};
+
+// All events of a phase
+struct TracePhase {
+    std::string phase;
+    size_t count = 0;
+    double millis = 0.0;
+    size_t bytes = 0;
+};
+
+// Collects events from any thread until they are taken
+struct StartupTrace {
+    void record(TraceEvent event) {
+        std::lock_guard lock(mutex);
+        events.push_back(std::move(event));
+    }
+
+    std::vector<TraceEvent> take() {
+        std::lock_guard lock(mutex);
+        return std::exchange(events, {});
+    }
+
+    // Per phase totals, in the order the phases first finished
+    static std::vector<TracePhase>
+    summarize(const std::vector<TraceEvent> &events) {
+        std::vector<TracePhase> phases;
+        for (auto &event : events) {
+            auto it = std::find_if(
+                phases.begin(), phases.end(),
+                [&](const TracePhase &p) { return p.phase == event.phase; });
+            if (it == phases.end()) {
+                phases.push_back({event.phase});
+                it = phases.end() - 1;
+            }
+            ++it->count;
+            it->millis += event.millis;
+            it->bytes += event.bytes;
+        }
+        return phases;
+    }
+
+    static void print(std::ostream &os, const std::vector<TraceEvent> &events) {
+        os << "Startup trace:\n";
+        for (auto &phase : summarize(events)) {
+            os << "  " << phase.phase << ": " << phase.millis << " ms";
+            if (phase.count > 1) os << " over " << phase.count << " events";
+            if (phase.bytes > 0) os << ", " << phase.bytes / 1048576.0 << " MB";
+            os << '\n';
+        }
+    }
+
+  private:
+    std::mutex mutex;
+    std::vector<TraceEvent> events;
+};
+
+inline StartupTrace startupTrace;
+
+// Records the time until it goes out of scope as an event
+struct TraceScope {
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+    explicit TraceScope(const char *phase, std::string asset = {},
+                        size_t bytes = 0)
+        : phase(phase), asset(std::move(asset)), bytes(bytes),
+          start(std::chrono::steady_clock::now()) {}
+
+    ~TraceScope() {
+        std::chrono::duration<double, std::milli> dt
+            = std::chrono::steady_clock::now() - start;
+        startupTrace.record({phase, std::move(asset), dt.count(), bytes});
+    }
+
+    void addBytes(size_t count) noexcept { bytes += count; }
+
+  private:
+    const char *phase;
+    std::string asset;
+    size_t bytes;
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif
@@ -0,0 +1,284 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include "routine.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// glad is generated for 4.3, buffer storage is loaded by hand
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+#ifndef GL_GPU_MEMORY_INFO_TOTAL_AVAILABLE_MEMORY_NVX
+#define GL_GPU_MEMORY_INFO_TOTAL_AVAILABLE_MEMORY_NVX 0x9048
+#endif
+#ifndef GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX
+#define GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX 0x9049
+#endif
+
+using PfnGlBufferStorage = void(GLAD_API_PTR *)(GLenum, GLsizeiptr,
+                                                const void *, GLbitfield);
+
+// Null unless the context is 4.4+ or has ARB_buffer_storage
+inline PfnGlBufferStorage loadBufferStorage() {
+    GLint major = 0, minor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    if (major * 10 + minor < 44 && !hasExtension("GL_ARB_buffer_storage"))
+        return nullptr;
+    return reinterpret_cast<PfnGlBufferStorage>(
+        getProcAddress("glBufferStorage"));
+}
+
+// Uploads one level from client memory or from the bound unpack buffer
+inline void texSubImage2D(GLint level, GLsizei width, GLsizei height,
+                          GLenum format, const void *pixels, size_t size) {
+    if (format == GL_RGBA8) {
+        glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, width, height, GL_RGBA,
+                        GL_UNSIGNED_BYTE, pixels);
+    } else {
+        glCompressedTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, width, height,
+                                  format, size, pixels);
+    }
+}
+
+// Peak resident set of the process, which includes the driver's copies
+// of client data. Zero where /proc is not available.
+inline size_t peakResidentBytes() {
+    std::ifstream ifs("/proc/self/status");
+    std::string line;
+    while (std::getline(ifs, line)) {
+        if (line.rfind("VmHWM:", 0) == 0)
+            return std::stoull(line.substr(6)) * 1024;
+    }
+    return 0;
+}
+
+// Video memory in use as reported by GL_NVX_gpu_memory_info, or zero
+inline size_t gpuMemoryUsedBytes() {
+    static const bool supported = hasExtension("GL_NVX_gpu_memory_info");
+    if (!supported) return 0;
+    GLint total = 0, available = 0;
+    glGetIntegerv(GL_GPU_MEMORY_INFO_TOTAL_AVAILABLE_MEMORY_NVX, &total);
+    glGetIntegerv(GL_GPU_MEMORY_INFO_CURRENT_AVAILABLE_VIDMEM_NVX, &available);
+    return size_t(std::max(total - available, 0)) * 1024;
+}
+
+struct UploadStats {
+    double bufferMillis = 0.0;
+    double textureMillis = 0.0;
+    size_t bufferBytes = 0;
+    size_t textureBytes = 0;
+    size_t peakGpuBytes = 0;
+
+    void sampleGpuMemory() {
+        peakGpuBytes = std::max(peakGpuBytes, gpuMemoryUsedBytes());
+    }
+};
+
+// One persistently mapped buffer shared by all uploads. Data is copied in
+// right away, while the GL copies out of it are recorded and issued
+// together by flush(), which fences them. Space behind a signalled fence
+// is reused; when the ring is full, allocation flushes and waits.
+struct StagingRing {
+    StagingRing(const StagingRing &) = delete;
+    StagingRing &operator=(const StagingRing &) = delete;
+
+    StagingRing() = default;
+    ~StagingRing() { destroy(); }
+
+    // Returns false when the driver cannot map buffers persistently
+    bool create(size_t size) {
+        destroy();
+        bufferStorage = loadBufferStorage();
+        if (!bufferStorage) return false;
+        allocateStorage(size);
+        return true;
+    }
+
+    bool isActive() const noexcept { return buffer != 0; }
+
+    // Immutable buffer for staged data to be copied into
+    GLuint createBuffer(size_t size) {
+        GLuint dst = 0;
+        glGenBuffers(1, &dst);
+        RaiiBindBuffer _bind(GL_COPY_WRITE_BUFFER, dst);
+        bufferStorage(GL_COPY_WRITE_BUFFER, size, nullptr, 0);
+        return dst;
+    }
+
+    void uploadBuffer(GLuint dst, size_t dstOffset, const void *data,
+                      size_t size) {
+        Copy copy{};
+        copy.dst = dst;
+        copy.dstOffset = dstOffset;
+        std::memcpy(stage(copy, size), data, size);
+    }
+
+    // Format is GL_RGBA8 or a compressed format, as in StreamedTexture
+    void uploadTexture(GLuint tex, GLint level, GLsizei width, GLsizei height,
+                       GLenum format, const void *data, size_t size) {
+        Copy copy{};
+        copy.dst = tex;
+        copy.level = level;
+        copy.width = width;
+        copy.height = height;
+        copy.format = format;
+        std::memcpy(stage(copy, size), data, size);
+    }
+
+    // Issues the recorded copies and fences the space they read
+    void flush() {
+        retireSignalled();
+        if (copies.empty()) return;
+
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        RaiiBindBuffer _bindRead(GL_COPY_READ_BUFFER, buffer);
+        RaiiBindBuffer _bindUnpack(GL_PIXEL_UNPACK_BUFFER, buffer);
+        for (auto &copy : copies) {
+            if (!copy.format) {
+                RaiiBindBuffer _bindWrite(GL_COPY_WRITE_BUFFER, copy.dst);
+                glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                                    copy.offset, copy.dstOffset, copy.size);
+            } else {
+                RaiiBindTexture _bindTex(GL_TEXTURE_2D, copy.dst);
+                texSubImage2D(copy.level, copy.width, copy.height, copy.format,
+                              static_cast<char *>(nullptr) + copy.offset,
+                              copy.size);
+            }
+        }
+        copies.clear();
+
+        inFlight.push_back(
+            {glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0), pendingBytes});
+        pendingBytes = 0;
+    }
+
+    // Flushes and waits until the GPU has read everything
+    void finish() {
+        flush();
+        while (!inFlight.empty()) retireOldest(true);
+    }
+
+  private:
+    // Buffers have format 0, textures their internal format
+    struct Copy {
+        GLuint dst;
+        size_t dstOffset;
+        GLint level;
+        GLsizei width;
+        GLsizei height;
+        GLenum format;
+        size_t offset;
+        size_t size;
+    };
+
+    struct Fenced {
+        GLsync sync;
+        size_t bytes;
+    };
+
+    static constexpr size_t ALIGNMENT = 16;
+
+    PfnGlBufferStorage bufferStorage = nullptr;
+    GLuint buffer = 0;
+    unsigned char *ptr = nullptr;
+    size_t capacity = 0;
+    // Bytes [head - used, head) modulo capacity are recorded or in flight
+    size_t head = 0;
+    size_t used = 0;
+    size_t pendingBytes = 0;
+    std::vector<Copy> copies;
+    std::deque<Fenced> inFlight;
+
+    void allocateStorage(size_t size) {
+        GLbitfield flags
+            = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glGenBuffers(1, &buffer);
+        RaiiBindBuffer _bind(GL_COPY_READ_BUFFER, buffer);
+        bufferStorage(GL_COPY_READ_BUFFER, size, nullptr, flags);
+        ptr = static_cast<unsigned char *>(
+            glMapBufferRange(GL_COPY_READ_BUFFER, 0, size, flags));
+        if (!ptr) throw std::runtime_error("Could not map staging ring");
+        capacity = size;
+        head = 0;
+        used = 0;
+    }
+
+    void destroy() {
+        if (!buffer) return;
+        finish();
+        // Deleting a mapped buffer unmaps it
+        glDeleteBuffers(1, &buffer);
+        buffer = 0;
+        ptr = nullptr;
+        capacity = 0;
+    }
+
+    // Reserves size bytes for copy and records it
+    unsigned char *stage(Copy copy, size_t size) {
+        if (size > capacity) {
+            // Rare: a single level larger than the whole ring
+            size_t grown = capacity;
+            while (grown < size) grown *= 2;
+            destroy();
+            allocateStorage(grown);
+        }
+
+        size_t offset = 0, consumed = 0;
+        for (;;) {
+            if (used == 0) head = 0;
+            offset = (head + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+            if (offset + size > capacity) offset = 0;
+            // Padding skipped at the end of the ring counts as used
+            consumed = offset >= head ? offset + size - head
+                                      : capacity - head + offset + size;
+            if (used + consumed <= capacity) break;
+            if (inFlight.empty()) flush();
+            retireOldest(true);
+        }
+
+        head = offset + size;
+        used += consumed;
+        pendingBytes += consumed;
+        copy.offset = offset;
+        copy.size = size;
+        copies.push_back(copy);
+        return ptr + offset;
+    }
+
+    bool retireOldest(bool wait) {
+        auto &oldest = inFlight.front();
+        GLuint64 timeout = wait ? 1000000000ull : 0;
+        for (;;) {
+            GLenum status = glClientWaitSync(oldest.sync,
+                                             GL_SYNC_FLUSH_COMMANDS_BIT,
+                                             timeout);
+            if (status == GL_ALREADY_SIGNALED
+                || status == GL_CONDITION_SATISFIED)
+                break;
+            if (status == GL_WAIT_FAILED)
+                throw std::runtime_error("Could not wait for staging fence");
+            if (!wait) return false;
+        }
+        glDeleteSync(oldest.sync);
+        used -= oldest.bytes;
+        inFlight.pop_front();
+        return true;
+    }
+
+    void retireSignalled() {
+        while (!inFlight.empty() && retireOldest(false)) {}
+    }
+};
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <unistd.h>
+#define HW03_HAS_INOTIFY 1
+#endif
+
+// Reports changed files through inotify. The directories are watched
+// rather than the files, so editors that save by renaming a new file
+// over the old one are noticed too. A file is reported once it has been
+// quiet for the debounce time, so a burst of writes counts as one change.
+// Nothing is ever reported where inotify is not available.
+struct FileWatcher {
+    using Clock = std::chrono::steady_clock;
+
+    FileWatcher(const FileWatcher &) = delete;
+    FileWatcher &operator=(const FileWatcher &) = delete;
+
+    FileWatcher() {
+#ifdef HW03_HAS_INOTIFY
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+    }
+
+    ~FileWatcher() {
+#ifdef HW03_HAS_INOTIFY
+        if (fd >= 0) close(fd);
+#endif
+    }
+
+    // Adds path, which poll() reports back exactly as given
+    void watch(const std::string &path) {
+#ifdef HW03_HAS_INOTIFY
+        if (fd < 0) return;
+        std::filesystem::path file(path);
+        std::string dir = file.parent_path().string();
+        if (dir.empty()) dir = ".";
+        int wd = inotify_add_watch(fd, dir.c_str(),
+                                   IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd < 0) return;
+        directories.emplace(wd, dir);
+        files[{wd, file.filename().string()}] = path;
+#endif
+    }
+
+    // Stops watching everything, pending changes are dropped
+    void clear() {
+#ifdef HW03_HAS_INOTIFY
+        for (auto &[wd, dir] : directories) inotify_rm_watch(fd, wd);
+#endif
+        directories.clear();
+        files.clear();
+        changed.clear();
+    }
+
+    // Watched files that changed and have been quiet since
+    std::vector<std::string>
+    poll(Clock::duration debounce = std::chrono::milliseconds(200)) {
+        auto now = Clock::now();
+        readEvents(now);
+        std::vector<std::string> settled;
+        for (auto it = changed.begin(); it != changed.end();) {
+            if (now - it->second < debounce) {
+                ++it;
+                continue;
+            }
+            settled.push_back(it->first);
+            it = changed.erase(it);
+        }
+        return settled;
+    }
+
+  private:
+    int fd = -1;
+    std::map<int, std::string> directories;
+    // Watch descriptor and file name to the path given to watch()
+    std::map<std::pair<int, std::string>, std::string> files;
+    // Time of the last event per path
+    std::map<std::string, Clock::time_point> changed;
+
+    void readEvents(Clock::time_point now) {
+#ifdef HW03_HAS_INOTIFY
+        if (fd < 0) return;
+        alignas(inotify_event) char buffer[4096];
+        for (;;) {
+            ssize_t size = read(fd, buffer, sizeof(buffer));
+            if (size <= 0) return;
+            for (ssize_t offset = 0; offset < size;) {
+                auto event = reinterpret_cast<inotify_event *>(buffer + offset);
+                offset += sizeof(inotify_event) + event->len;
+                if (event->len == 0) continue;
+                auto it = files.find({event->wd, event->name});
+                if (it != files.end()) changed[it->second] = now;
+            }
+        }
+#endif
+    }
+};
+
+#endif